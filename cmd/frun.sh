@@ -0,0 +1,47 @@
+#!/bin/sh
+# renders on several local daemons through the coordinator, needs a release build with
+# render_mode = RenderMode::daemon. usage: frun.sh [daemon count] [coordinator args...]
+cd ../out/release
+count=${1:-2}
+[ $# -gt 0 ] && shift
+threads=$(( $(nproc) / count ))
+[ "$threads" -lt 1 ] && threads=1
+
+workers=""
+pids=""
+i=0
+while [ $i -lt "$count" ]; do
+	sock=/tmp/crack-tracer-$i.sock
+	# a socket file left over from an earlier run would look like the daemon is up
+	rm -f "$sock"
+	./crack-tracer --listen "$sock" --threads "$threads" > /dev/null &
+	pids="$pids $!"
+	workers="$workers --worker $sock"
+	i=$((i + 1))
+done
+
+# waits up to 60 s for every daemon to be listening, giving up early if one of them died
+for sock in $(echo "$workers" | sed 's/--worker//g'); do
+	tries=0
+	while [ ! -S "$sock" ]; do
+		for pid in $pids; do
+			if ! kill -0 "$pid" 2> /dev/null; then
+				echo "a daemon exited on startup" >&2
+				kill $pids 2> /dev/null
+				exit 1
+			fi
+		done
+		tries=$((tries + 1))
+		if [ $tries -ge 600 ]; then
+			echo "timed out waiting for $sock" >&2
+			kill $pids 2> /dev/null
+			exit 1
+		fi
+		sleep 0.1
+	done
+done
+./crack-tracer-coordinator $workers "$@"
+
+for sock in $(echo "$workers" | sed 's/--worker//g'); do
+	./crack-tracer-client --server "$sock" --shutdown > /dev/null
+done
@@ -0,0 +1,117 @@
+#pragma once
+#include "globals.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+#include <span>
+#include <vector>
+
+struct Aabb {
+  Vec3 min;
+  Vec3 max;
+};
+
+[[nodiscard]] inline Aabb merge(const Aabb& a, const Aabb& b) noexcept {
+  return Aabb{
+      .min = {std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z)},
+      .max = {std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z)},
+  };
+}
+
+struct alignas(32) BvhNode {
+  Vec3 min;
+  uint32_t first; // first primitive for leaves, left child for inner nodes (right is left + 1)
+  Vec3 max;
+  uint32_t count; // primitives in a leaf, 0 for inner nodes
+};
+
+// Bounding volume hierarchy over any kind of primitive, built from their bounding boxes.
+// Leaves cover the ranges [first, first + count) of prim_order, so callers that want
+// streaming loads during traversal can reorder their primitives by prim_order once after
+// building and index them directly.
+// Nodes are either the ones build() made or ones handed to use_nodes(), e.g. straight out of a
+// SceneCache mapping. prim_order is only there after build().
+class Bvh {
+public:
+  std::span<BvhNode> nodes;
+  std::vector<uint32_t> prim_order;
+
+  static constexpr uint32_t max_leaf_size = 4;
+  static constexpr unsigned max_depth = 64;
+
+  Bvh() = default;
+  // nodes would still point into the original
+  Bvh(const Bvh&) = delete;
+  Bvh& operator=(const Bvh&) = delete;
+  Bvh(Bvh&&) = default;
+  Bvh& operator=(Bvh&&) = default;
+
+  void build(const std::vector<Aabb>& boxes);
+
+  // traverses `built_nodes` from now on. They have to outlive the Bvh.
+  void use_nodes(const std::span<BvhNode> built_nodes) noexcept {
+    owned_nodes.clear();
+    prim_order.clear();
+    nodes = built_nodes;
+  }
+
+  // Recomputes the bounds of the leaves in nodes[begin, end) after their primitives moved,
+  // calling box_of(i) for every slot i of prim_order they cover. Leaves don't share
+  // primitives, so disjoint node ranges can be refit from different threads. Call
+  // refit_inner() once every leaf is done.
+  template <typename BoxOf>
+  void refit_leaves(const BoxOf& box_of, const size_t begin, const size_t end) {
+    for (size_t n = begin; n < end; n++) {
+      BvhNode& node = nodes[n];
+      if (node.count == 0) {
+        continue;
+      }
+      Aabb bounds = box_of(node.first);
+      for (uint32_t i = node.first + 1; i < node.first + node.count; i++) {
+        bounds = merge(bounds, box_of(i));
+      }
+      node.min = bounds.min;
+      node.max = bounds.max;
+    }
+  }
+
+  // Grows the inner nodes back around their refit children. Keeps the tree's topology, so
+  // it only stays tight while primitives move around near where they were built.
+  void refit_inner() noexcept;
+
+  [[nodiscard]] bool empty() const noexcept { return nodes.empty(); }
+
+private:
+  std::vector<BvhNode> owned_nodes;
+};
+
+namespace {
+  // lanes of the cluster whose ray passes through `node` somewhere in [t_min, t_max)
+  [[nodiscard, gnu::always_inline]] inline __m256 ray_box_hit(const Vec3_256& orig,
+                                                              const Vec3_256& rcp_dir,
+                                                              const BvhNode& node,
+                                                              const __m256& t_max) noexcept {
+    const Vec3_256 t_0 = (Vec3_256::broadcast_vec(node.min) - orig) * rcp_dir;
+    const Vec3_256 t_1 = (Vec3_256::broadcast_vec(node.max) - orig) * rcp_dir;
+
+    __m256 t_near = _mm256_max_ps(_mm256_min_ps(t_0.x, t_1.x), global::t_min_vec);
+    t_near = _mm256_max_ps(_mm256_min_ps(t_0.y, t_1.y), t_near);
+    t_near = _mm256_max_ps(_mm256_min_ps(t_0.z, t_1.z), t_near);
+
+    __m256 t_far = _mm256_min_ps(_mm256_max_ps(t_0.x, t_1.x), t_max);
+    t_far = _mm256_min_ps(_mm256_max_ps(t_0.y, t_1.y), t_far);
+    t_far = _mm256_min_ps(_mm256_max_ps(t_0.z, t_1.z), t_far);
+
+    return _mm256_cmp_ps(t_near, t_far, _CMP_LE_OQ);
+  }
+
+  // exact reciprocal, rcp_ps is too rough for slab tests on far away boxes
+  [[nodiscard, gnu::always_inline]] inline Vec3_256 rcp_dir(const Vec3_256& dir) noexcept {
+    return Vec3_256{
+        _mm256_div_ps(global::ones, dir.x),
+        _mm256_div_ps(global::ones, dir.y),
+        _mm256_div_ps(global::ones, dir.z),
+    };
+  }
+} // namespace
@@ -1,14 +1,19 @@
 #pragma once
+#include "types.hpp"
 #include "vec.hpp"
 #include <SDL_events.h>
 #include <SDL_keycode.h>
 
 class Camera {
 public:
-  Vec3 origin{-1.2f, 1.f, 5.f};
+  Vec3 origin = start_cam_origin;
 
   void register_key_event(const SDL_Event e);
   void update();
+  [[nodiscard]] View view() const noexcept { return View{.origin = origin}; }
+  [[nodiscard]] bool moving() const noexcept {
+    return velocity.x != 0.f || velocity.y != 0.f || velocity.z != 0.f;
+  }
 
 private:
   Vec3 velocity{0, 0, 0};
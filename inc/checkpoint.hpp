@@ -0,0 +1,38 @@
+#pragma once
+#include "types.hpp"
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+
+// Saves the running per pixel sums of a png render so a killed job can pick up where it left
+// off. Each save goes to a temporary file next to `path` that is renamed over it once it's
+// complete, so there's always a whole checkpoint on disk (the old or the new one), never a
+// torn one.
+class Checkpointer {
+public:
+  // `render_key` stands for everything the sums depend on besides the image size and sampling
+  // settings, which are checked on their own. Checkpoints saved under another key are ignored.
+  Checkpointer(std::string path, uint64_t render_key);
+  ~Checkpointer();
+
+  // Copies the sums out of `frame` and writes them to disk on a background thread, so the
+  // workers can carry on with the next pass. Waits for the previous save first.
+  void save_async(const FrameBuffers& frame, uint32_t groups_done);
+
+  // blocks until the last save_async() is done. Returns false if it failed.
+  bool wait();
+
+  // Reads back a checkpoint saved with the same key, image size and sampling settings.
+  // Returns false and leaves `frame` untouched if there's no usable checkpoint.
+  bool load(const FrameBuffers& frame, uint32_t& groups_done) const;
+
+  // deletes the checkpoint once the render it belongs to is written out
+  void remove() const;
+
+private:
+  std::string path;
+  uint64_t render_key;
+  std::vector<float> snapshot;
+  std::future<bool> pending;
+};
@@ -1,6 +1,7 @@
 #pragma once
 #include "globals.hpp"
 #include "vec.hpp"
+#include <immintrin.h>
 
 using Color = Vec3;
 using Color_256 = Vec3_256;
@@ -30,3 +31,90 @@ namespace colors {
 
   constexpr Color_256 background_color = {.x = global::ones, .y = global::ones, .z = global::ones};
 } // end of namespace colors
+
+namespace {
+  // Rec. 709 weights, for linear colors
+  [[nodiscard, gnu::always_inline]] constexpr float luminance(const Color& color) noexcept {
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+  }
+
+  // log2 of positive x: the exponent plus a degree 5 fit of log2 over the mantissa in [1, 2),
+  // good to ~3e-5
+  [[nodiscard, gnu::always_inline]] inline __m256 log2_256(const __m256& x) noexcept {
+    const __m256i bits = _mm256_castps_si256(x);
+    const __m256 exponent = _mm256_cvtepi32_ps(
+        _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), _mm256_set1_epi32(127)));
+    const __m256 m = _mm256_castsi256_ps(_mm256_or_si256(
+        _mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)), _mm256_set1_epi32(0x3f800000)));
+    const __m256 t = m - global::ones;
+
+    __m256 poly = _mm256_set1_ps(0.043428365f);
+    poly = _mm256_fmadd_ps(poly, t, _mm256_set1_ps(-0.18772049f));
+    poly = _mm256_fmadd_ps(poly, t, _mm256_set1_ps(0.40871894f));
+    poly = _mm256_fmadd_ps(poly, t, _mm256_set1_ps(-0.7057026f));
+    poly = _mm256_fmadd_ps(poly, t, _mm256_set1_ps(1.4412671f));
+    poly = _mm256_fmadd_ps(poly, t, _mm256_set1_ps(3.1930856e-05f));
+    return exponent + poly;
+  }
+
+  // 2^x for x > -126: a degree 4 fit over the fraction, good to ~8e-6 relative, with the
+  // integer part added straight onto the exponent bits
+  [[nodiscard, gnu::always_inline]] inline __m256 exp2_256(const __m256& x) noexcept {
+    const __m256 whole = _mm256_floor_ps(x);
+    const __m256 f = x - whole;
+
+    __m256 poly = _mm256_set1_ps(0.013676524f);
+    poly = _mm256_fmadd_ps(poly, f, _mm256_set1_ps(0.051666845f));
+    poly = _mm256_fmadd_ps(poly, f, _mm256_set1_ps(0.24171032f));
+    poly = _mm256_fmadd_ps(poly, f, _mm256_set1_ps(0.69293123f));
+    poly = _mm256_fmadd_ps(poly, f, _mm256_set1_ps(1.0000073f));
+
+    const __m256i shift = _mm256_slli_epi32(_mm256_cvtps_epi32(whole), 23);
+    return _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(poly), shift));
+  }
+
+  // sRGB transfer curve for linear values in [0, 1], within ~0.01 of a level at 8 bits
+  [[nodiscard, gnu::always_inline]] inline __m256 srgb_encode_256(const __m256& x) noexcept {
+    const __m256 curve = _mm256_fmsub_ps(
+        _mm256_set1_ps(1.055f), exp2_256(log2_256(x) * _mm256_set1_ps(1.f / 2.4f)),
+        _mm256_set1_ps(0.055f));
+    const __m256 linear = x * _mm256_set1_ps(12.92f);
+    // the curve is garbage for 0, but that's on the linear side anyway
+    return _mm256_blendv_ps(curve, linear,
+                            _mm256_cmp_ps(x, _mm256_set1_ps(0.0031308f), _CMP_LE_OQ));
+  }
+
+  // squeezes linear values into [0, 1] with config::tone_map
+  [[nodiscard, gnu::always_inline]] inline __m256 tone_map_256(const __m256& x) noexcept {
+    __m256 mapped;
+    if constexpr (config::tone_map == ToneMap::reinhard) {
+      mapped = _mm256_div_ps(x, x + global::ones);
+    } else if constexpr (config::tone_map == ToneMap::aces) {
+      const __m256 num = x * _mm256_fmadd_ps(x, _mm256_set1_ps(2.51f), _mm256_set1_ps(0.03f));
+      const __m256 den = _mm256_fmadd_ps(
+          x, _mm256_fmadd_ps(x, _mm256_set1_ps(2.43f), _mm256_set1_ps(0.59f)),
+          _mm256_set1_ps(0.14f));
+      mapped = _mm256_div_ps(num, den);
+    } else {
+      mapped = x;
+    }
+    return _mm256_min_ps(_mm256_max_ps(mapped, global::zeros), global::ones);
+  }
+
+  // Turns 8 channels of summed radiance into 8 bit channel values (before rounding and
+  // saturating), where `scale` is 255 over the sample count. Only a multiply unless
+  // global::output_transform.
+  [[nodiscard, gnu::always_inline]] inline __m256 encode_output_256(const __m256& sums,
+                                                                    const __m256& scale) noexcept {
+    if constexpr (!global::output_transform) {
+      return sums * scale * _mm256_set1_ps(config::exposure);
+    }
+
+    const __m256 radiance = sums * scale * _mm256_set1_ps(config::exposure / 255.f);
+    __m256 mapped = tone_map_256(radiance);
+    if constexpr (config::srgb_output) {
+      mapped = srgb_encode_256(mapped);
+    }
+    return mapped * _mm256_set1_ps(255.f);
+  }
+} // namespace
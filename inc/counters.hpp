@@ -0,0 +1,90 @@
+#pragma once
+#include "globals.hpp"
+#include <cstdint>
+
+// Hardware performance counters for config::perf_counters, from perf_event_open(2), counted
+// per thread and per stage of the render. Every thread opens its own group of counters the
+// first time it counts something. A Scope reads that group when it starts and when it ends,
+// one read() each, so scopes go around a worker's share of a job and never around anything
+// per cluster. report() prints what was counted since the last report and starts over.
+// Counting only needs perf_event_paranoid <= 2, since the kernel's share is left out.
+// With config::perf_counters off, none of this does anything and Scope compiles away.
+namespace counters {
+  // Tracing runs intersection and shading one bounce at a time for each cluster, far too
+  // finely to read counters around, so both count towards `trace`. So do the 8 bit colors
+  // that real-time frames and daemon tiles write out as they're traced.
+  enum class Stage : uint8_t {
+    trace,
+    preview,
+    resolve,
+    denoise,
+    write_out,
+    encode,
+  };
+  constexpr unsigned stage_count = 6;
+
+  enum Event : uint8_t {
+    cycles,
+    instructions,
+    l1d_misses, // L1 data cache read misses
+    llc_misses, // last level cache misses
+    branch_misses,
+  };
+  constexpr unsigned event_count = 5;
+
+  // counter values at some point, already scaled up for any time the group wasn't scheduled
+  struct Reading {
+    uint64_t values[event_count];
+  };
+
+  // reads the calling thread's counters, opening them first if it hasn't yet. Returns false
+  // if they couldn't be opened, which gets printed once.
+  bool read(Reading& reading) noexcept;
+  // adds what the calling thread counted between `start` and `end` to `stage`
+  void add(Stage stage, const Reading& start, const Reading& end) noexcept;
+  // what the calling thread shows up as in reports, `name` followed by `index` if it's >= 0
+  void set_thread_name(const char* name, int index);
+  // Prints every stage's totals and each thread's share of them, headed by `label` and
+  // `index`, then zeroes them. No scope may be open on another thread while it runs.
+  void print_report(const char* label, uint64_t index);
+
+  // counts the scope it lives in towards `stage`
+  class Scope {
+  public:
+    explicit Scope(const Stage stage) noexcept {
+      if constexpr (config::perf_counters) {
+        this->stage = stage;
+        counting = read(start);
+      }
+    }
+
+    ~Scope() {
+      if constexpr (config::perf_counters) {
+        Reading end;
+        if (counting && read(end)) {
+          add(stage, start, end);
+        }
+      }
+    }
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+  private:
+    Stage stage;
+    bool counting;
+    Reading start;
+  };
+
+  inline void name_thread(const char* const name, const int index = -1) {
+    if constexpr (config::perf_counters) {
+      set_thread_name(name, index);
+    }
+  }
+
+  inline void report(const char* const label, const uint64_t index) {
+    if constexpr (config::perf_counters) {
+      print_report(label, index);
+    }
+  }
+} // namespace counters
@@ -0,0 +1,103 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Renders into memory the caller owns, for programs that embed the tracer instead of running
+// it. Link against the crack-tracer-lib target, which doesn't need SDL, and compile with the
+// same config:: the library was built with: the image size, tone mapping, denoiser and such
+// are all fixed at build time. Nothing here needs the tracer's own headers.
+namespace crack_tracer {
+  enum class MaterialKind {
+    metallic,
+    lambertian,
+    dielectric,
+    emissive,
+  };
+
+  struct MaterialDesc {
+    MaterialKind kind = MaterialKind::lambertian;
+    float albedo[3] = {0.5f, 0.5f, 0.5f};
+    float fuzz = 0.f;                // metallic only, how far reflections get scattered
+    float ir = 1.5f;                 // dielectric only, index of refraction
+    float emit[3] = {0.f, 0.f, 0.f}; // emissive only, emitted radiance
+  };
+
+  struct SphereDesc {
+    float center[3];
+    float radius;
+    uint32_t material; // index into SceneDesc::materials
+  };
+
+  struct MeshDesc {
+    std::span<const float> verts;      // x, y, z of each vertex
+    std::span<const uint32_t> indices; // 3 vertex indices per triangle
+    uint32_t material;                 // index into SceneDesc::materials
+  };
+
+  // Spheres placed around their own origin, drawn wherever an InstanceDesc puts a copy of
+  // them. Emissive materials aren't allowed, since the lights have to be listed one by one.
+  struct PrototypeDesc {
+    std::span<const SphereDesc> spheres;
+  };
+
+  // A copy of a prototype scaled by `scale` around its origin and then moved by `offset`. Each
+  // one costs 32 bytes however many spheres the prototype has.
+  struct InstanceDesc {
+    uint32_t prototype; // index into SceneDesc::prototypes
+    float offset[3] = {0.f, 0.f, 0.f};
+    float scale = 1.f;
+  };
+
+  // Only read during set_scene(), so none of it has to outlive the call. Emissive spheres are
+  // the lights, along with config::env_map_path if the library was built with one.
+  struct SceneDesc {
+    std::span<const MaterialDesc> materials;
+    std::span<const SphereDesc> spheres;
+    std::span<const MeshDesc> meshes;
+    std::span<const PrototypeDesc> prototypes;
+    std::span<const InstanceDesc> instances;
+    bool ground_plane = true; // the y = 0 plane, facing up
+    uint32_t ground_material = 0;
+  };
+
+  // Where the camera is and which way it faces. The axes have to be unit length and at right
+  // angles to each other. The defaults look down -z with +y up, like the tracer's own camera.
+  struct CameraDesc {
+    float origin[3] = {0.f, 0.f, 0.f};
+    float right[3] = {1.f, 0.f, 0.f};
+    float up[3] = {0.f, 1.f, 0.f};
+    float back[3] = {0.f, 0.f, 1.f};
+  };
+
+  // Starts the workers once and keeps them, the scene and the frame buffers around between
+  // renders, so each call only costs the tracing. The tracer keeps all of that in globals, so
+  // only one Renderer can exist at a time in a process. Renders run one at a time.
+  class Renderer {
+  public:
+    // 0 threads goes by config::thread_count
+    explicit Renderer(unsigned threads = 0);
+    ~Renderer();
+    Renderer(const Renderer&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+
+    // size of every image rendered, in pixels
+    [[nodiscard]] static uint32_t width() noexcept;
+    [[nodiscard]] static uint32_t height() noexcept;
+
+    // Replaces the scene and rebuilds its acceleration structures. Returns false and keeps the
+    // old scene if the new one refers to materials or vertices it doesn't have.
+    bool set_scene(const SceneDesc& scene);
+
+    // Renders `sample_groups` * 8 samples per pixel and writes the image as 8 bit RGB, after
+    // tone mapping and sRGB encoding if config asks for them. Row r starts at
+    // pixels + r * stride, where stride is in bytes and at least width() * 3. Returns false if
+    // the arguments don't make sense.
+    bool render_rgb8(const CameraDesc& camera, uint32_t sample_groups, uint8_t* pixels,
+                     size_t stride);
+    // render_rgb8() that writes linear RGB radiance as 32 bit floats instead, stride again in
+    // bytes and at least width() * 12
+    bool render_rgb32f(const CameraDesc& camera, uint32_t sample_groups, float* pixels,
+                       size_t stride);
+  };
+} // namespace crack_tracer
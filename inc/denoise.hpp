@@ -0,0 +1,237 @@
+#pragma once
+#include "counters.hpp"
+#include "framebuffer.hpp"
+#include "globals.hpp"
+#include "vec.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010).
+//
+// Each pass is a 5x5 B3-spline blur whose taps are spread `1 << pass` pixels apart, so a few
+// passes cover a large footprint with only 25 taps each. Taps are weighted down when their
+// color, normal or depth differ from the center pixel, which keeps edges sharp. The filter
+// runs on color divided by first hit albedo so texture doesn't get smeared, and multiplies
+// the albedo back in at the end.
+namespace denoise {
+  // taps reach 2 * step pixels to either side, so pad every row with enough zeroed pixels that
+  // no pass ever has to clamp its columns. Zeroed normals also mark the pad as "don't use".
+  constexpr unsigned max_reach = 2u << (config::denoise_passes - 1);
+  constexpr unsigned pad = (max_reach + 7) & ~7u;
+  constexpr unsigned stride = config::img_width + 2 * pad;
+
+  // how quickly each edge stopping term kills a tap. Smaller is stricter.
+  constexpr float color_phi = 1.f; // halved every pass, as noise drops
+  constexpr float norm_phi = 0.1f;
+  constexpr float depth_phi = 0.01f; // on depth difference relative to the center's depth
+
+  // keeps demodulation from blowing up on near black surfaces
+  constexpr float min_albedo = 1e-3f;
+
+  constexpr float kernel[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+
+  static_assert(config::img_width % 8 == 0, "Denoiser works on 8 pixels at a time.");
+} // namespace denoise
+
+// planar (one float per plane per pixel) copies of the frame, padded by denoise::pad
+struct DenoiseBuffers {
+  float* irr[2][3]; // demodulated color, ping-ponged between passes
+  float* norm[3];
+  float* depth;
+};
+
+static DenoiseBuffers denoise_bufs;
+
+namespace {
+  // must be called after init_workers(). See alloc_first_touched() for `on_workers`.
+  inline void init_denoiser(const bool on_workers = true) {
+    const auto alloc_plane = [on_workers]() {
+      return static_cast<float*>(alloc_first_touched(denoise::stride * sizeof(float), on_workers));
+    };
+
+    for (auto& ping_pong : denoise_bufs.irr) {
+      for (float*& plane : ping_pong) {
+        plane = alloc_plane();
+      }
+    }
+    for (float*& plane : denoise_bufs.norm) {
+      plane = alloc_plane();
+    }
+    denoise_bufs.depth = alloc_plane();
+  }
+
+  inline void free_denoiser() noexcept {
+    for (auto& ping_pong : denoise_bufs.irr) {
+      for (float*& plane : ping_pong) {
+        free(plane);
+      }
+    }
+    for (float*& plane : denoise_bufs.norm) {
+      free(plane);
+    }
+    free(denoise_bufs.depth);
+    denoise_bufs = DenoiseBuffers{};
+  }
+
+  // splits the frame into planes and divides out the albedo
+  inline void denoise_prepare(const FrameBuffers frame, const unsigned worker) noexcept {
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      const size_t src_row = size_t{row} * config::img_width;
+      const size_t dst_row = size_t{row} * denoise::stride + denoise::pad;
+
+      for (uint32_t col = 0; col < config::img_width; col++) {
+        const Color& color = frame.color[src_row + col];
+        const Color& albedo = frame.albedo[src_row + col];
+        const Vec3& norm = frame.norm[src_row + col];
+        const size_t dst = dst_row + col;
+
+        denoise_bufs.irr[0][0][dst] = color.x / std::max(albedo.x, denoise::min_albedo);
+        denoise_bufs.irr[0][1][dst] = color.y / std::max(albedo.y, denoise::min_albedo);
+        denoise_bufs.irr[0][2][dst] = color.z / std::max(albedo.z, denoise::min_albedo);
+        denoise_bufs.norm[0][dst] = norm.x;
+        denoise_bufs.norm[1][dst] = norm.y;
+        denoise_bufs.norm[2][dst] = norm.z;
+        denoise_bufs.depth[dst] = frame.depth[src_row + col];
+      }
+    });
+  }
+
+  // one à-trous pass over this thread's rows. Reads from irr[pass & 1] and writes the other.
+  inline void denoise_pass(const unsigned pass, const unsigned worker) noexcept {
+    const int step = 1 << pass;
+    float* const* src = denoise_bufs.irr[pass & 1];
+    float* const* dst = denoise_bufs.irr[(pass + 1) & 1];
+
+    const float color_phi = denoise::color_phi / static_cast<float>(1 << pass);
+    const __m256 rcp_color_phi = _mm256_set1_ps(1.f / color_phi);
+    const __m256 rcp_norm_phi = _mm256_set1_ps(1.f / denoise::norm_phi);
+    const __m256 rcp_depth_phi = _mm256_set1_ps(1.f / denoise::depth_phi);
+    // averaged normals shrink where a pixel only partially covers a surface. Anything this
+    // short is mostly sky (or padding) and shouldn't be filtered or used as a tap.
+    const __m256 min_norm_2 = _mm256_set1_ps(0.25f);
+    const __m256 center_weight = _mm256_set1_ps(denoise::kernel[2] * denoise::kernel[2]);
+
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      for (uint32_t col = 0; col < config::img_width; col += 8) {
+        const size_t center = size_t{row} * denoise::stride + denoise::pad + col;
+
+        const Color_256 center_irr{
+            _mm256_load_ps(src[0] + center),
+            _mm256_load_ps(src[1] + center),
+            _mm256_load_ps(src[2] + center),
+        };
+        const Vec3_256 center_norm{
+            _mm256_load_ps(denoise_bufs.norm[0] + center),
+            _mm256_load_ps(denoise_bufs.norm[1] + center),
+            _mm256_load_ps(denoise_bufs.norm[2] + center),
+        };
+        const __m256 center_depth = _mm256_load_ps(denoise_bufs.depth + center);
+        const __m256 rcp_center_depth = _mm256_rcp_ps(center_depth);
+
+        Color_256 sum = center_irr * center_weight;
+        __m256 weight_sum = center_weight;
+
+        for (int dy = -2; dy <= 2; dy++) {
+          const int tap_row = static_cast<int>(row) + dy * step;
+          if (tap_row < 0 || tap_row >= static_cast<int>(config::img_height)) {
+            continue;
+          }
+
+          for (int dx = -2; dx <= 2; dx++) {
+            if (dx == 0 && dy == 0) {
+              continue;
+            }
+            const size_t tap = static_cast<size_t>(tap_row) * denoise::stride + denoise::pad +
+                               col + static_cast<size_t>(dx * step);
+
+            const Color_256 tap_irr{
+                _mm256_loadu_ps(src[0] + tap),
+                _mm256_loadu_ps(src[1] + tap),
+                _mm256_loadu_ps(src[2] + tap),
+            };
+            const Vec3_256 tap_norm{
+                _mm256_loadu_ps(denoise_bufs.norm[0] + tap),
+                _mm256_loadu_ps(denoise_bufs.norm[1] + tap),
+                _mm256_loadu_ps(denoise_bufs.norm[2] + tap),
+            };
+            const __m256 tap_depth = _mm256_loadu_ps(denoise_bufs.depth + tap);
+
+            const Color_256 irr_diff = center_irr - tap_irr;
+            const Vec3_256 norm_diff = center_norm - tap_norm;
+            const __m256 depth_diff = (center_depth - tap_depth) * rcp_center_depth;
+
+            __m256 dist = irr_diff.dot(irr_diff) * rcp_color_phi;
+            dist = _mm256_fmadd_ps(norm_diff.dot(norm_diff), rcp_norm_phi, dist);
+            dist = _mm256_fmadd_ps(depth_diff * depth_diff, rcp_depth_phi, dist);
+
+            const float kernel_weight = denoise::kernel[dy + 2] * denoise::kernel[dx + 2];
+            const __m256 tap_valid =
+                _mm256_cmp_ps(tap_norm.dot(tap_norm), min_norm_2, _CMP_GE_OQ);
+            const __m256 weight =
+                _mm256_and_ps(exp_neg_256(dist) * _mm256_set1_ps(kernel_weight), tap_valid);
+
+            sum.x = _mm256_fmadd_ps(tap_irr.x, weight, sum.x);
+            sum.y = _mm256_fmadd_ps(tap_irr.y, weight, sum.y);
+            sum.z = _mm256_fmadd_ps(tap_irr.z, weight, sum.z);
+            weight_sum = _mm256_add_ps(weight_sum, weight);
+          }
+        }
+
+        const __m256 center_valid =
+            _mm256_cmp_ps(center_norm.dot(center_norm), min_norm_2, _CMP_GE_OQ);
+        const Color_256 filtered{
+            _mm256_div_ps(sum.x, weight_sum),
+            _mm256_div_ps(sum.y, weight_sum),
+            _mm256_div_ps(sum.z, weight_sum),
+        };
+        const Color_256 out = center_irr.blend_vec256(filtered, center_valid);
+
+        _mm256_store_ps(dst[0] + center, out.x);
+        _mm256_store_ps(dst[1] + center, out.y);
+        _mm256_store_ps(dst[2] + center, out.z);
+      }
+    });
+  }
+
+  // multiplies the albedo back in and writes the result over the frame's color
+  inline void denoise_finish(const FrameBuffers frame, const unsigned worker) noexcept {
+    float* const* src = denoise_bufs.irr[config::denoise_passes & 1];
+
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      const size_t dst_row = size_t{row} * config::img_width;
+      const size_t src_row = size_t{row} * denoise::stride + denoise::pad;
+
+      for (uint32_t col = 0; col < config::img_width; col++) {
+        const Color& albedo = frame.albedo[dst_row + col];
+        const size_t idx = src_row + col;
+
+        frame.color[dst_row + col] = Color{
+            .x = src[0][idx] * std::max(albedo.x, denoise::min_albedo),
+            .y = src[1][idx] * std::max(albedo.y, denoise::min_albedo),
+            .z = src[2][idx] * std::max(albedo.z, denoise::min_albedo),
+        };
+      }
+    });
+  }
+
+  // denoises frame.color in place. Every stage is split across the workers the same way
+  // render() splits rows, with a join in between since each pass reads its neighbors' rows.
+  inline void denoise_frame(const FrameBuffers frame) {
+    run_on_workers([frame](const unsigned worker) {
+      const counters::Scope counting(counters::Stage::denoise);
+      denoise_prepare(frame, worker);
+    });
+    for (unsigned pass = 0; pass < config::denoise_passes; pass++) {
+      run_on_workers([pass](const unsigned worker) {
+        const counters::Scope counting(counters::Stage::denoise);
+        denoise_pass(pass, worker);
+      });
+    }
+    run_on_workers([frame](const unsigned worker) {
+      const counters::Scope counting(counters::Stage::denoise);
+      denoise_finish(frame, worker);
+    });
+  }
+} // namespace
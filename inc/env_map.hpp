@@ -0,0 +1,247 @@
+#pragma once
+#include "colors.hpp"
+#include "globals.hpp"
+#include "lights.hpp"
+#include "rand.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include <bit>
+#include <cfloat>
+#include <cstdint>
+#include <cstdio>
+#include <immintrin.h>
+#include <limits>
+#include <vector>
+
+// Radiance arriving from infinitely far away in every direction, stored as an equirectangular
+// image, for config::env_map_path. Texel columns go around the y axis starting from +z, with
+// -z in the middle, and rows go from +y down to -y.
+// Directions are picked in proportion to each texel's luminance and solid angle, by walking a
+// CDF over the rows and then one over the picked row's texels.
+struct EnvMap {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  // texel radiance, row major from the top row down, SoA so each channel is one gather
+  std::vector<float> r, g, b;
+  // height + 1 entries from 0 to 1, where row i is picked for anything in [row_cdf[i],
+  // row_cdf[i + 1])
+  std::vector<float> row_cdf;
+  // the same for the texels of each row, width + 1 entries per row
+  std::vector<float> col_cdf;
+  // solid angle pdf of picking a direction in each texel, times the sine of its angle from +y
+  std::vector<float> texel_pdf;
+
+  // Loads a color PFM and scales it by `intensity`. Returns false and keeps the old map if it
+  // can't be read.
+  bool load(const char* path, float intensity);
+  // a map that's `color` in every direction
+  void fill(const Color& color);
+
+private:
+  void build_distribution();
+};
+
+static EnvMap env_map;
+
+namespace {
+  // loads config::env_map_path, if there is one
+  inline void init_env_map() {
+    if constexpr (global::env_lighting) {
+      if (!env_map.load(config::env_map_path, config::env_intensity)) {
+        printf("falling back to a white background\n");
+        env_map.fill(colors::white);
+      }
+    }
+  }
+
+  // atan2(y, x) to within ~1e-5 radians, which is well under a texel of any map
+  [[nodiscard, gnu::always_inline]] inline __m256 atan2_256(const __m256& y,
+                                                            const __m256& x) noexcept {
+    const __m256 sign_bit = (__m256)_mm256_set1_epi32(static_cast<int>(0x80000000));
+    const __m256 abs_x = _mm256_andnot_ps(sign_bit, x);
+    const __m256 abs_y = _mm256_andnot_ps(sign_bit, y);
+    const __m256 a = _mm256_min_ps(abs_x, abs_y) /
+                     _mm256_max_ps(_mm256_max_ps(abs_x, abs_y), _mm256_set1_ps(FLT_MIN));
+    const __m256 a_2 = a * a;
+
+    // minimax polynomial for atan on [0, 1]
+    __m256 poly = _mm256_fmadd_ps(_mm256_set1_ps(-0.0464964749f), a_2, _mm256_set1_ps(0.15931422f));
+    poly = _mm256_fmadd_ps(poly, a_2, _mm256_set1_ps(-0.327622764f));
+    __m256 angle = _mm256_fmadd_ps(poly * a_2, a, a);
+
+    // back out of the octant the ratio was folded into
+    angle = _mm256_blendv_ps(angle, _mm256_set1_ps(global::pi / 2) - angle,
+                             _mm256_cmp_ps(abs_y, abs_x, _CMP_GT_OQ));
+    angle = _mm256_blendv_ps(angle, _mm256_set1_ps(global::pi) - angle, x);
+    return _mm256_xor_ps(angle, _mm256_and_ps(y, sign_bit));
+  }
+
+  // where `dir` (of any length) lands on the map, both in [0, 1]
+  [[gnu::always_inline]] inline void env_uv(const Vec3_256& dir, __m256& u, __m256& v) noexcept {
+    const __m256 horizontal = _mm256_sqrt_ps(_mm256_fmadd_ps(dir.x, dir.x, dir.z * dir.z));
+    u = _mm256_fmadd_ps(atan2_256(dir.x, -dir.z), _mm256_set1_ps(0.5f * global::rcp_pi),
+                        _mm256_set1_ps(0.5f));
+    v = atan2_256(horizontal, dir.y) * global::rcp_pi_vec;
+  }
+
+  // the unit direction at (u, v) on the map, the inverse of env_uv()
+  [[nodiscard, gnu::always_inline]] inline Vec3_256 env_dir(const __m256& u,
+                                                            const __m256& v) noexcept {
+    __m256 cos_theta, sin_theta, cos_phi, sin_phi;
+    unit_circle_256(v * _mm256_set1_ps(0.5f), cos_theta, sin_theta);
+    unit_circle_256(u, cos_phi, sin_phi);
+    return Vec3_256{-(sin_theta * sin_phi), cos_theta, sin_theta * cos_phi};
+  }
+
+  // Radiance arriving from `dir`, bilinearly filtered between the 4 nearest texels. Columns
+  // wrap around, rows clamp at the poles.
+  [[nodiscard, gnu::always_inline]] inline Color_256 env_radiance(const Vec3_256& dir) noexcept {
+    const __m256i width = _mm256_set1_epi32(static_cast<int>(env_map.width));
+    const __m256i last_col = _mm256_set1_epi32(static_cast<int>(env_map.width - 1));
+    const __m256i last_row = _mm256_set1_epi32(static_cast<int>(env_map.height - 1));
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+
+    __m256 u, v;
+    env_uv(dir, u, v);
+    const __m256 fx =
+        _mm256_fmsub_ps(u, _mm256_set1_ps(static_cast<float>(env_map.width)), _mm256_set1_ps(0.5f));
+    const __m256 fy = _mm256_fmsub_ps(v, _mm256_set1_ps(static_cast<float>(env_map.height)),
+                                      _mm256_set1_ps(0.5f));
+    const __m256 floor_x = _mm256_floor_ps(fx);
+    const __m256 floor_y = _mm256_floor_ps(fy);
+    const __m256 tx = fx - floor_x;
+    const __m256 ty = fy - floor_y;
+
+    __m256i x0 = _mm256_cvttps_epi32(floor_x);
+    x0 = _mm256_add_epi32(x0, _mm256_and_si256(_mm256_cmpgt_epi32(zero, x0), width));
+    x0 = _mm256_min_epi32(x0, last_col);
+    __m256i x1 = _mm256_add_epi32(x0, one);
+    x1 = _mm256_andnot_si256(_mm256_cmpgt_epi32(x1, last_col), x1);
+
+    const __m256i y = _mm256_cvttps_epi32(floor_y);
+    const __m256i y0 = _mm256_min_epi32(_mm256_max_epi32(y, zero), last_row);
+    const __m256i y1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y, one), zero), last_row);
+    const __m256i row0 = _mm256_mullo_epi32(y0, width);
+    const __m256i row1 = _mm256_mullo_epi32(y1, width);
+
+    const __m256i idx00 = _mm256_add_epi32(row0, x0);
+    const __m256i idx01 = _mm256_add_epi32(row0, x1);
+    const __m256i idx10 = _mm256_add_epi32(row1, x0);
+    const __m256i idx11 = _mm256_add_epi32(row1, x1);
+
+    const auto filter = [&](const float* const channel) {
+      const __m256 top = _mm256_fmadd_ps(
+          _mm256_i32gather_ps(channel, idx01, 4) - _mm256_i32gather_ps(channel, idx00, 4), tx,
+          _mm256_i32gather_ps(channel, idx00, 4));
+      const __m256 bottom = _mm256_fmadd_ps(
+          _mm256_i32gather_ps(channel, idx11, 4) - _mm256_i32gather_ps(channel, idx10, 4), tx,
+          _mm256_i32gather_ps(channel, idx10, 4));
+      return _mm256_fmadd_ps(bottom - top, ty, top);
+    };
+    return Color_256{filter(env_map.r.data()), filter(env_map.g.data()), filter(env_map.b.data())};
+  }
+
+  // index of the texel `dir` lands in
+  [[nodiscard, gnu::always_inline]] inline __m256i env_texel(const Vec3_256& dir) noexcept {
+    __m256 u, v;
+    env_uv(dir, u, v);
+    const __m256i width = _mm256_set1_epi32(static_cast<int>(env_map.width));
+    const __m256i col =
+        _mm256_min_epi32(_mm256_cvttps_epi32(u * _mm256_set1_ps(static_cast<float>(env_map.width))),
+                         _mm256_sub_epi32(width, _mm256_set1_epi32(1)));
+    const __m256i row = _mm256_min_epi32(
+        _mm256_cvttps_epi32(v * _mm256_set1_ps(static_cast<float>(env_map.height))),
+        _mm256_set1_epi32(static_cast<int>(env_map.height - 1)));
+    return _mm256_add_epi32(_mm256_mullo_epi32(row, width), col);
+  }
+
+  // solid angle pdf of sample_env() picking `dir`, of any length
+  [[nodiscard, gnu::always_inline]] inline __m256 env_pdf(const Vec3_256& dir) noexcept {
+    const __m256 sin_theta = _mm256_sqrt_ps(_mm256_fmadd_ps(dir.x, dir.x, dir.z * dir.z) *
+                                            _mm256_rcp_ps(dir.dot(dir)));
+    return _mm256_i32gather_ps(env_map.texel_pdf.data(), env_texel(dir), 4) *
+           _mm256_rcp_ps(_mm256_max_ps(sin_theta, _mm256_set1_ps(1e-6f)));
+  }
+
+  // For each lane, the last of the `count` entries of cdf starting at `first` that's <= u,
+  // where the first entry is 0. Binary search, one gather per step.
+  [[nodiscard, gnu::always_inline]] inline __m256i search_cdf(const float* const cdf,
+                                                              const __m256i& first,
+                                                              const uint32_t count,
+                                                              const __m256& u) noexcept {
+    const __m256i last = _mm256_set1_epi32(static_cast<int>(count - 1));
+    __m256i found = _mm256_setzero_si256();
+    for (uint32_t step = std::bit_floor(count); step > 0; step >>= 1) {
+      const __m256i probe = _mm256_add_epi32(found, _mm256_set1_epi32(static_cast<int>(step)));
+      const __m256i clamped = _mm256_min_epi32(probe, last);
+      const __m256 entry = _mm256_i32gather_ps(cdf, _mm256_add_epi32(first, clamped), 4);
+      const __m256i take = _mm256_andnot_si256(_mm256_cmpgt_epi32(probe, last),
+                                               (__m256i)_mm256_cmp_ps(entry, u, _CMP_LE_OQ));
+      found = (__m256i)_mm256_blendv_ps((__m256)found, (__m256)probe, (__m256)take);
+    }
+    return found;
+  }
+
+  // where in [cdf[first + i], cdf[first + i + 1]) u lies, from 0 to 1
+  [[nodiscard, gnu::always_inline]] inline __m256 cdf_offset(const float* const cdf,
+                                                             const __m256i& idx,
+                                                             const __m256& u) noexcept {
+    const __m256 lo = _mm256_i32gather_ps(cdf, idx, 4);
+    const __m256 hi = _mm256_i32gather_ps(cdf + 1, idx, 4);
+    return _mm256_min_ps((u - lo) / _mm256_max_ps(hi - lo, _mm256_set1_ps(FLT_MIN)),
+                         _mm256_set1_ps(0x1.fffffep-1f));
+  }
+
+  // Next event estimation against the environment for the lanes in `mask`, which must all sit
+  // on lambertian surfaces of the given albedo, like sample_lights(). Picks a direction from
+  // the map's distribution and traces a shadow ray out of the scene along it. Returns the MIS
+  // weighted light, not yet multiplied by the path throughput.
+  [[nodiscard, gnu::always_inline]] inline Color_256 sample_env(const HitRecords& hit_rec,
+                                                                const Color_256& albedo,
+                                                                const __m256& mask,
+                                                                Sampler& sampler) {
+    __m256 u, v;
+    sampler.get_2d(sample_dim::env_dir, u, v);
+
+    const __m256i row =
+        search_cdf(env_map.row_cdf.data(), _mm256_setzero_si256(), env_map.height, v);
+    const __m256i row_first =
+        _mm256_mullo_epi32(row, _mm256_set1_epi32(static_cast<int>(env_map.width + 1)));
+    const __m256i col = search_cdf(env_map.col_cdf.data(), row_first, env_map.width, u);
+
+    const __m256 map_v = (_mm256_cvtepi32_ps(row) + cdf_offset(env_map.row_cdf.data(), row, v)) *
+                         _mm256_set1_ps(1.f / static_cast<float>(env_map.height));
+    const __m256 map_u = (_mm256_cvtepi32_ps(col) +
+                          cdf_offset(env_map.col_cdf.data(), _mm256_add_epi32(row_first, col), u)) *
+                         _mm256_set1_ps(1.f / static_cast<float>(env_map.width));
+
+    const RayCluster shadow_rays{.dir = env_dir(map_u, map_v), .orig = hit_rec.orig};
+    const __m256i texel = _mm256_add_epi32(
+        _mm256_mullo_epi32(row, _mm256_set1_epi32(static_cast<int>(env_map.width))), col);
+    const __m256 sin_theta = _mm256_sqrt_ps(_mm256_fmadd_ps(
+        shadow_rays.dir.x, shadow_rays.dir.x, shadow_rays.dir.z * shadow_rays.dir.z));
+    const __m256 pdf_env = _mm256_i32gather_ps(env_map.texel_pdf.data(), texel, 4) *
+                           _mm256_rcp_ps(_mm256_max_ps(sin_theta, _mm256_set1_ps(1e-6f)));
+
+    const __m256 cos_surface = shadow_rays.dir.dot(hit_rec.norm);
+    __m256 valid = _mm256_and_ps(mask, _mm256_cmp_ps(cos_surface, global::zeros, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(pdf_env, global::zeros, _CMP_GT_OQ));
+    if (_mm256_testz_ps(valid, valid)) {
+      return Color_256{global::zeros, global::zeros, global::zeros};
+    }
+
+    const __m256 occluded =
+        find_occlusion(shadow_rays, _mm256_set1_ps(std::numeric_limits<float>::max()), valid);
+    valid = _mm256_andnot_ps(occluded, valid);
+
+    const __m256 pdf_bsdf = cos_surface * global::rcp_pi_vec;
+
+    // albedo / pi * Le * cos / pdf_env * w_env
+    const __m256 scale =
+        _mm256_and_ps(pdf_bsdf * _mm256_rcp_ps(pdf_env) * mis_weight(pdf_env, pdf_bsdf), valid);
+    return albedo * env_radiance(shadow_rays.dir) * scale;
+  }
+} // namespace
@@ -0,0 +1,55 @@
+#pragma once
+#include "colors.hpp"
+#include "globals.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+  // must be called after init_workers(), each worker first touches its own rows unless
+  // `on_workers` is false, see alloc_first_touched()
+  [[nodiscard]] inline FrameBuffers alloc_frame_buffers(const bool on_workers = true) {
+    constexpr size_t width = config::img_width;
+    FrameBuffers frame{
+        .color = static_cast<Color*>(alloc_first_touched(width * sizeof(Color), on_workers)),
+    };
+    if constexpr (config::denoise) {
+      frame.albedo =
+          static_cast<Color*>(alloc_first_touched(width * sizeof(Color), on_workers));
+      frame.norm = static_cast<Vec3*>(alloc_first_touched(width * sizeof(Vec3), on_workers));
+      frame.depth = static_cast<float*>(alloc_first_touched(width * sizeof(float), on_workers));
+    }
+    if constexpr (global::track_noise) {
+      frame.lum_sq =
+          static_cast<float*>(alloc_first_touched(width * sizeof(float), on_workers));
+    }
+    return frame;
+  }
+
+  // zeroes this worker's rows of every buffer in `frame`, so it can start over on new sums
+  inline void clear_frame_buffers(const FrameBuffers frame, const unsigned worker) noexcept {
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      const size_t first = size_t{row} * config::img_width;
+      std::fill_n(frame.color + first, config::img_width, Color{});
+      if constexpr (config::denoise) {
+        std::fill_n(frame.albedo + first, config::img_width, Color{});
+        std::fill_n(frame.norm + first, config::img_width, Vec3{});
+        std::fill_n(frame.depth + first, config::img_width, 0.f);
+      }
+      if constexpr (global::track_noise) {
+        std::fill_n(frame.lum_sq + first, config::img_width, 0.f);
+      }
+    });
+  }
+
+  inline void free_frame_buffers(FrameBuffers& frame) noexcept {
+    free(frame.color);
+    free(frame.albedo);
+    free(frame.norm);
+    free(frame.depth);
+    free(frame.lum_sq);
+    frame = FrameBuffers{};
+  }
+} // namespace
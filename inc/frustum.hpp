@@ -0,0 +1,108 @@
+#pragma once
+#include "globals.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <cmath>
+#include <immintrin.h>
+
+// A cone that contains every ray of a cluster: rays start somewhere inside a ball around
+// `apex` and point at most `spread` radians away from `axis`. Clusters of sub-samples of one
+// pixel (and their mirror bounces) fit in a very thin cone, which lets a single scalar test
+// throw out a sphere for all 8 lanes before paying for the full 8 lane quadratic.
+struct RayCone {
+  Vec3 apex;
+  Vec3 axis;
+  float apex_r;
+  float cos_spread;
+  float sin_spread;
+};
+
+namespace cull {
+  // wider clusters than this (~8 degrees) hit most of what's in front of them anyway, so
+  // testing the cone first would only add work
+  constexpr float min_cos_spread = 0.99f;
+  // covers float error in the normalized directions and in the cone test itself
+  constexpr float sin_slack = 1e-4f;
+  constexpr float r_slack = 1e-4f;
+} // namespace cull
+
+namespace {
+  // Fits a cone around the rays in `active`. Returns false if the rays aren't coherent enough
+  // for culling to be worth it, in which case `cone` shouldn't be used.
+  [[nodiscard, gnu::always_inline]] inline bool
+  build_ray_cone(const RayCluster& rays, const __m256& active, RayCone& cone) noexcept {
+    const __m256 len_2 = rays.dir.dot(rays.dir);
+    // zero length directions (absorbed rays) can't hit anything, leave them out
+    const __m256 lanes = _mm256_and_ps(active, _mm256_cmp_ps(len_2, global::zeros, _CMP_GT_OQ));
+    const int lane_mask = _mm256_movemask_ps(lanes);
+    if (lane_mask == 0) {
+      return false;
+    }
+    const float lane_count = static_cast<float>(__builtin_popcount(lane_mask));
+
+    // exact normalize, rsqrt error would be larger than the spread of a primary cluster
+    const Vec3_256 dir = (rays.dir * _mm256_div_ps(global::ones, _mm256_sqrt_ps(len_2))) & lanes;
+
+    Vec3 axis{hsum_256(dir.x), hsum_256(dir.y), hsum_256(dir.z)};
+    const float axis_len = std::sqrt(axis.x * axis.x + axis.y * axis.y + axis.z * axis.z);
+    if (axis_len < 1e-6f) {
+      return false;
+    }
+    axis = {axis.x / axis_len, axis.y / axis_len, axis.z / axis_len};
+    const Vec3_256 axis_vec = Vec3_256::broadcast_vec(axis);
+
+    const __m256 cos_vals = _mm256_blendv_ps(global::ones, dir.dot(axis_vec), lanes);
+    if (hmin_256(cos_vals) < cull::min_cos_spread) {
+      return false;
+    }
+
+    // the spread itself comes from |dir x axis|, since 1 - cos is mostly rounding error this
+    // close to 1. cos is then derived from the padded sin so the two describe the same cone.
+    const Vec3_256 cross = dir.cross(axis_vec);
+    const __m256 sin_vals = _mm256_and_ps(_mm256_sqrt_ps(cross.dot(cross)), lanes);
+    cone.sin_spread = hmax_256(sin_vals) + cull::sin_slack;
+    cone.cos_spread = std::sqrt(1.f - cone.sin_spread * cone.sin_spread);
+    cone.axis = axis;
+
+    const Vec3_256 orig = rays.orig & lanes;
+    const float rcp_count = 1.f / lane_count;
+    cone.apex = {
+        hsum_256(orig.x) * rcp_count,
+        hsum_256(orig.y) * rcp_count,
+        hsum_256(orig.z) * rcp_count,
+    };
+    const Vec3_256 to_orig = rays.orig - Vec3_256::broadcast_vec(cone.apex);
+    cone.apex_r = std::sqrt(hmax_256(_mm256_and_ps(to_orig.dot(to_orig), lanes)));
+
+    return true;
+  }
+
+  // false only if no ray of the cone can hit the sphere
+  [[nodiscard, gnu::always_inline]] inline bool
+  cone_may_hit(const RayCone& cone, const Vec3& center, const float r) noexcept {
+    // grow the sphere by the origin ball so the cone can be treated as having a single apex
+    const float grown_r = (r + cone.apex_r) * (1.f + cull::r_slack);
+    const Vec3 to_center{center.x - cone.apex.x, center.y - cone.apex.y, center.z - cone.apex.z};
+    const float dist_2 =
+        to_center.x * to_center.x + to_center.y * to_center.y + to_center.z * to_center.z;
+    if (dist_2 <= grown_r * grown_r) {
+      return true;
+    }
+
+    // distance along the axis, and away from it
+    const float along =
+        to_center.x * cone.axis.x + to_center.y * cone.axis.y + to_center.z * cone.axis.z;
+    const float away = std::sqrt(std::max(dist_2 - along * along, 0.f));
+
+    // distance from the center to the cone's side
+    if (away * cone.cos_spread - along * cone.sin_spread > grown_r) {
+      return false;
+    }
+    // nearest point of the cone is its apex, which is already known to be out of reach
+    if (along * cone.cos_spread + away * cone.sin_spread < 0.f) {
+      return false;
+    }
+    return true;
+  }
+} // namespace
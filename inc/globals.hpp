@@ -6,6 +6,28 @@
 enum class RenderMode {
   png,
   real_time,
+  pin_bench,    // compares frame times with and without pinned, first touched workers
+  layout_bench, // compares png pass times of the two packet layouts
+  daemon,       // keeps everything loaded and renders requests from config::listen_address
+  // Renders every view of config::view_set in one job, a png each. Only about 9% faster than
+  // rendering the views one at a time, the views share the scene's cache footprint but no work.
+  multi_view,
+};
+
+enum class PacketLayout {
+  pixel_samples, // each ray cluster is 8 samples of the same pixel
+  pixel_quads,   // each ray cluster is one sample each of a 4 wide, 2 tall block of pixels
+};
+
+enum class ViewSet {
+  stereo,  // a left and a right eye, stereo_separation apart
+  cubemap, // the 6 faces of a cube around the camera, which needs a square image
+};
+
+enum class ToneMap {
+  clamp,    // scales and clips, so anything brighter than white saturates
+  reinhard, // x / (1 + x) per channel, never quite reaches white
+  aces,     // Narkowicz's fit of the ACES filmic curve, with a toe and a soft shoulder
 };
 
 /**
@@ -15,10 +37,133 @@ namespace config {
   constexpr RenderMode render_mode = RenderMode::png;
   constexpr unsigned img_width = 1920;
   constexpr unsigned img_height = 1080;
-  constexpr unsigned thread_count = 12;
+  // 0 starts one worker per cpu found at startup (or per physical core without use_smt).
+  constexpr unsigned thread_count = 0;
+  constexpr bool use_smt = true;
+  // pin each worker to its own cpu and have it first touch the part of the image it renders
+  constexpr bool pin_threads = true;
   constexpr unsigned ray_depth = 20;
+  // test coherent ray clusters against a bounding cone before intersecting each sphere
+  constexpr bool packet_culling = true;
+  // Quads keep every lane's sums in its own pixel, so there are no horizontal adds per pixel,
+  // but their rays spread out over more of the scene. Which one wins depends on the scene, see
+  // RenderMode::layout_bench.
+  constexpr PacketLayout packet_layout = PacketLayout::pixel_samples;
+  // Owen scrambled Sobol sample positions and bounce directions instead of a fixed sub-pixel
+  // grid and plain lcg_rand draws. Converges faster for the same sample count.
+  constexpr bool low_discrepancy = true;
+  // bounce the small spheres around and orbit the light in real-time mode
+  constexpr bool animate = true;
+  // while the camera moves, real-time mode shows a cheap one ray per pixel preview instead of
+  // path tracing, and goes back to full frames as soon as it stops
+  constexpr bool preview_while_moving = true;
+  // previews trace one ray per preview_scale x preview_scale pixels, 1 or 2
+  constexpr unsigned preview_scale = 2;
+  // Memory for the first hits of camera rays, which real-time frames and library renders
+  // reuse while neither the camera nor the scene moves. It holds as many whole sample groups
+  // as fit, at 20 bytes per sample, so 1920 x 1080 needs 316 MiB per group. 0 turns it off.
+  // Only allocated once the same view of a static scene comes up twice, so never with animate.
+  constexpr unsigned visibility_cache_mb = 320;
+
+  // The small random spheres sit on a grid 2 * sphere_field_size cells wide each way, one per
+  // cell. The same seed always gives the same scene, however many threads generate it.
+  constexpr unsigned sphere_field_size = 11;
+  constexpr uint32_t scene_seed = 0;
+  // Places (2 * molecule_grid_size)^2 small molecules of 7 spheres behind the field. They're
+  // all instances of one prototype, so they cost memory for 7 spheres however many there are.
+  constexpr unsigned molecule_grid_size = 0;
+  // Sphere BVH nodes that look smaller than lod_pixels pixels in radius from where a ray starts
+  // get hit as one fuzzy sphere instead of being traversed, with the material of one of their
+  // spheres picked by size. The cutoff is jittered per ray over a factor of 2, so nodes fade
+  // from one level to the next instead of popping. Lights are never merged.
+  constexpr bool sphere_lod = false;
+  constexpr float lod_pixels = 1.f;
+
+  // optional Wavefront .obj mesh to add to the scene, scaled and then offset into place.
+  // Leave empty to render just the spheres.
+  constexpr const char* mesh_path = "";
+  constexpr float mesh_scale = 1.f;
+  constexpr float mesh_offset[3] = {0.f, 0.f, 0.f};
+
+  // runs an edge-aware filter over the image before writing it out. Lets you get away with
+  // a much lower global::sample_group_num.
+  constexpr bool denoise = false;
+  constexpr unsigned denoise_passes = 4;
+
+  // png renders save their running sums here every checkpoint_interval seconds. With resume
+  // the next run picks them back up, so a killed render doesn't start over, as long as it
+  // renders the same scene from the same camera. Empty turns saving off.
+  constexpr const char* checkpoint_path = "out.ckpt";
+  constexpr float checkpoint_interval = 60.f;
+  constexpr bool resume = false;
+  // sample groups each png pass adds to every pixel. Checkpoints are only taken between passes.
+  constexpr unsigned pass_groups = 1;
+
+  // Png renders normally stop after global::sample_group_num sample groups. With a time budget
+  // (in seconds) or a noise target they keep adding passes until one of them is reached
+  // instead. Noise is the standard error of pixel luminance averaged over the image, where 1 is
+  // full white. A noise target alone runs until it's met, however long that takes.
+  constexpr float time_budget = 0.f;
+  constexpr float noise_target = 0.f;
+  // writes the (undenoised) image so far every snapshot_interval seconds. 0 turns it off.
+  constexpr const char* snapshot_path = "snapshot.png";
+  constexpr float snapshot_interval = 0.f;
 
-  static_assert(img_height % thread_count == 0, "Thread count must divide rows equally.");
+  // How averaged radiance gets turned into 8 bit pixels: scaled by exposure, squeezed into
+  // [0, 1] by the tone map and then optionally sRGB encoded. ToneMap::clamp at exposure 1
+  // without sRGB writes linear values, like before these settings existed.
+  constexpr ToneMap tone_map = ToneMap::clamp;
+  constexpr float exposure = 1.f;
+  constexpr bool srgb_output = false;
+  // png renders also write the unclipped linear image here as a 32 bit float PFM, for grading
+  // elsewhere. Empty turns it off.
+  constexpr const char* hdr_path = "";
+
+  // Equirectangular (latitude-longitude) color PFM that lights the scene from every direction
+  // rays escape in, scaled by env_intensity. Its top row is straight up (+y) and its middle is
+  // straight ahead (-z). Diffuse bounces aim an extra shadow ray at its bright parts, so small
+  // bright areas like a sun don't turn into fireflies. Empty keeps the flat white background.
+  constexpr const char* env_map_path = "";
+  constexpr float env_intensity = 1.f;
+
+  // Built spheres and their BVH are saved here and mapped straight back in on later runs, instead
+  // of generating and building them again. Empty turns it off, which is fine for scenes small
+  // enough to build in a few ms, like the default one.
+  constexpr const char* scene_cache_path = "";
+
+  // what RenderMode::multi_view renders. Stereo separation is in scene units.
+  constexpr ViewSet view_set = ViewSet::stereo;
+  constexpr float stereo_separation = 0.1f;
+
+  // Where RenderMode::daemon listens for render requests, see protocol.hpp. A Unix socket path,
+  // or host:port for TCP. Can be changed with --listen. Requests aren't authenticated, so
+  // anyone who can reach the address can have the daemon render (and shut it down). ":port"
+  // stays on loopback. Only give a host like 0.0.0.0 on a network you trust.
+  constexpr const char* listen_address = "/tmp/crack-tracer.sock";
+
+  // Records what every thread spends its time on (rows, passes, frames, uploads, writes, ...)
+  // and writes it to trace_path as Chrome trace JSON when the render ends. Load it in
+  // chrome://tracing or ui.perfetto.dev. Each thread keeps its last trace_capacity spans.
+  constexpr bool trace = false;
+  constexpr const char* trace_path = "trace.json";
+  constexpr unsigned trace_capacity = 1 << 16;
+
+  // Counts cycles, instructions, cache misses and branch mispredicts of every thread with
+  // perf_event_open(2), per stage of the render (tracing, resolve, denoise, write out, png
+  // encode, ...), and prints them with IPC and misses per thousand instructions after every
+  // png job, real-time frame and daemon request.
+  constexpr bool perf_counters = false;
+
+  static_assert(img_width % 32 == 0, "Image is written out 32 pixels at a time.");
+  static_assert(img_height % 2 == 0, "Pixel quads cover two rows at a time.");
+  static_assert(denoise_passes > 0 && denoise_passes <= 6, "Denoiser supports 1 to 6 passes.");
+  static_assert(pass_groups > 0, "Each pass has to add at least one sample group.");
+  static_assert(preview_scale == 1 || preview_scale == 2, "Previews are full or half res.");
+  static_assert(render_mode != RenderMode::multi_view || view_set != ViewSet::cubemap ||
+                    img_width == img_height,
+                "Cubemap faces only meet up at the edges with a square image.");
+  static_assert(lod_pixels > 0.f, "Merged spheres have to cover some of the screen.");
+  static_assert(trace_capacity > 0, "Tracing threads need room for at least one span.");
 } // namespace config
 
 namespace global {
@@ -36,12 +181,21 @@ namespace global {
   constexpr float sample_dv = pix_dv / (sample_group_num + 1);
   constexpr float focal_len = 1.0; // TODO move to camera?
   constexpr float color_multiplier = 255.f / (sample_group_num * 8);
+  // radius over distance of something config::lod_pixels pixels in radius
+  constexpr float lod_angle = config::lod_pixels * pix_du / focal_len;
+
+  // whether 8 bit output needs more than a multiply, see config::tone_map
+  constexpr bool output_transform = config::tone_map != ToneMap::clamp || config::srgb_output;
+
+  // escaped rays see config::env_map_path instead of a flat background
+  constexpr bool env_lighting = config::env_map_path[0] != '\0';
 
-  // index of refraction
+  // png renders keep going until the time budget or noise target in config is reached
+  constexpr bool progressive = config::time_budget > 0.f || config::noise_target > 0.f;
+  constexpr bool track_noise = config::noise_target > 0.f;
+
+  // default index of refraction for dielectric materials
   constexpr float ir = 1.5;
-  constexpr __m256 ir_vec = {ir, ir, ir, ir, ir, ir, ir, ir};
-  constexpr float rcp_ir = 1.f / ir;
-  constexpr __m256 rcp_ir_vec = {rcp_ir, rcp_ir, rcp_ir, rcp_ir, rcp_ir, rcp_ir, rcp_ir, rcp_ir};
   alignas(32) constexpr float cam_origin[4] = {0.f, 0.f, 0.0f, 0.f};
   constexpr float t_min = 0.0013f;
   constexpr __m256 t_min_vec = {t_min, t_min, t_min, t_min, t_min, t_min, t_min, t_min};
@@ -49,6 +203,10 @@ namespace global {
   constexpr __m256 zeros = {0, 0, 0, 0, 0, 0, 0, 0};
   constexpr __m256 ones = {1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f};
 
+  constexpr float pi = 3.14159265f;
+  constexpr float rcp_pi = 1.f / pi;
+  constexpr __m256 rcp_pi_vec = {rcp_pi, rcp_pi, rcp_pi, rcp_pi, rcp_pi, rcp_pi, rcp_pi, rcp_pi};
+
   const __m256i all_set =
       (__m256i)_mm256_cmp_ps(_mm256_setzero_ps(), _mm256_setzero_ps(),
                              _CMP_EQ_OQ); // TODO replace with the predefined ones (cmpeq)
@@ -0,0 +1,35 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+
+// FNV-1a, for keys that tell whether something saved to disk (a scene cache, a checkpoint)
+// still matches what the current build and settings would produce. Not for anything that
+// has to be fast or hard to collide on purpose.
+namespace {
+  constexpr uint64_t fnv_basis = 0xcbf29ce484222325u;
+  constexpr uint64_t fnv_prime = 0x100000001b3u;
+
+  // folds each of `inputs` into `key` as one 64 bit word
+  [[nodiscard]] constexpr uint64_t hash_words(const std::initializer_list<uint64_t> inputs,
+                                              uint64_t key = fnv_basis) noexcept {
+    for (const uint64_t input : inputs) {
+      key = (key ^ input) * fnv_prime;
+    }
+    return key;
+  }
+
+  // folds the bytes of `text` into `key`, then its length so "ab", "c" and "a", "bc" differ
+  [[nodiscard]] constexpr uint64_t hash_text(const std::string_view text,
+                                             uint64_t key = fnv_basis) noexcept {
+    for (const char c : text) {
+      key = (key ^ static_cast<uint8_t>(c)) * fnv_prime;
+    }
+    return hash_words({text.size()}, key);
+  }
+
+  [[nodiscard]] constexpr uint64_t float_word(const float value) noexcept {
+    return std::bit_cast<uint32_t>(value);
+  }
+} // namespace
@@ -0,0 +1,341 @@
+#pragma once
+#include "bvh.hpp"
+#include "globals.hpp"
+#include "materials.hpp"
+#include "rand.hpp"
+#include "sampler.hpp"
+#include "sphere.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <immintrin.h>
+#include <limits>
+#include <span>
+#include <vector>
+
+// A group of spheres stored once, however many times it's placed in the scene. Its spheres are
+// the run [first, first + count) of proto_spheres, in the group's own space and in the leaf
+// order of its own BVH.
+struct SpherePrototype {
+  uint32_t first;
+  uint32_t count;
+  Aabb bounds;
+  Bvh bvh;
+};
+
+// One placement of a prototype: its spheres scaled by `scale` and then moved by `offset`. Rays
+// get the inverse applied instead, so the prototype's spheres and BVH are used as they are.
+struct alignas(32) SphereInstance {
+  Vec3 offset;
+  float scale;
+  float rcp_scale;
+  uint32_t proto;
+};
+
+static std::vector<Sphere> proto_spheres;
+static std::vector<SpherePrototype> prototypes;
+// kept in the leaf order of instance_bvh
+static std::vector<SphereInstance> sphere_instances;
+static Bvh instance_bvh;
+
+namespace {
+  // Adds a group of spheres that instances can place, and returns its id. The group can't be
+  // empty. Emissive spheres don't belong in one, since only plain spheres are sampled as lights.
+  inline uint32_t add_sphere_prototype(const std::span<const Sphere> group) {
+    std::vector<Aabb> boxes(group.size());
+    for (size_t i = 0; i < group.size(); i++) {
+      boxes[i] = sphere_box(group[i]);
+    }
+
+    SpherePrototype& proto = prototypes.emplace_back(SpherePrototype{
+        .first = static_cast<uint32_t>(proto_spheres.size()),
+        .count = static_cast<uint32_t>(group.size()),
+        .bounds = {},
+        .bvh = {},
+    });
+    proto.bvh.build(boxes);
+    for (size_t i = 0; i < group.size(); i++) {
+      proto_spheres.push_back(group[proto.bvh.prim_order[i]]);
+    }
+    if (!boxes.empty()) {
+      proto.bounds = boxes[0];
+      for (const Aabb& box : boxes) {
+        proto.bounds = merge(proto.bounds, box);
+      }
+    }
+    return static_cast<uint32_t>(prototypes.size() - 1);
+  }
+
+  // build_instance_bvh() must be called once every instance has been added
+  inline void add_sphere_instance(const uint32_t proto, const Vec3 offset, const float scale) {
+    sphere_instances.push_back(SphereInstance{
+        .offset = offset, .scale = scale, .rcp_scale = 1.f / scale, .proto = proto});
+  }
+
+  // builds instance_bvh over every instance's bounds and reorders them into its leaf order
+  inline void build_instance_bvh() {
+    std::vector<Aabb> boxes(sphere_instances.size());
+    for (size_t i = 0; i < sphere_instances.size(); i++) {
+      const SphereInstance& inst = sphere_instances[i];
+      const Aabb& bounds = prototypes[inst.proto].bounds;
+      boxes[i] = Aabb{
+          .min = {bounds.min.x * inst.scale + inst.offset.x,
+                  bounds.min.y * inst.scale + inst.offset.y,
+                  bounds.min.z * inst.scale + inst.offset.z},
+          .max = {bounds.max.x * inst.scale + inst.offset.x,
+                  bounds.max.y * inst.scale + inst.offset.y,
+                  bounds.max.z * inst.scale + inst.offset.z},
+      };
+    }
+
+    instance_bvh.build(boxes);
+
+    std::vector<SphereInstance> sorted(sphere_instances.size());
+    for (size_t i = 0; i < sphere_instances.size(); i++) {
+      sorted[i] = sphere_instances[instance_bvh.prim_order[i]];
+    }
+    sphere_instances = std::move(sorted);
+  }
+
+  // A big atom with six small ones around it, resting on y = 0 with its middle above the
+  // origin.
+  [[nodiscard]] inline std::vector<Sphere> molecule() {
+    const uint32_t core = add_material(red_lambertian);
+    const uint32_t shell = add_material(silver_metallic);
+    constexpr float core_y = 0.65f;
+    constexpr float reach = 0.45f;
+    return {
+        {.center = {0.f, core_y, 0.f}, .mat_id = core, .r = 0.35f},
+        {.center = {reach, core_y, 0.f}, .mat_id = shell, .r = 0.2f},
+        {.center = {-reach, core_y, 0.f}, .mat_id = shell, .r = 0.2f},
+        {.center = {0.f, core_y + reach, 0.f}, .mat_id = shell, .r = 0.2f},
+        {.center = {0.f, core_y - reach, 0.f}, .mat_id = shell, .r = 0.2f},
+        {.center = {0.f, core_y, reach}, .mat_id = shell, .r = 0.2f},
+        {.center = {0.f, core_y, -reach}, .mat_id = shell, .r = 0.2f},
+    };
+  }
+
+  // Places the molecules of config::molecule_grid_size behind the sphere field, all of them
+  // instances of the same prototype.
+  inline void init_instances() {
+    proto_spheres.clear();
+    prototypes.clear();
+    sphere_instances.clear();
+
+    constexpr uint32_t side = 2 * config::molecule_grid_size;
+    if constexpr (side > 0) {
+      constexpr float spacing = 1.5f;
+      constexpr float back = -static_cast<float>(config::sphere_field_size) - 1.f;
+      const uint32_t proto = add_sphere_prototype(molecule());
+      LCGRand place_rand(sobol::hash(config::scene_seed + 2));
+      for (uint32_t row = 0; row < side; row++) {
+        for (uint32_t col = 0; col < side; col++) {
+          const float x = (static_cast<float>(col) - static_cast<float>(side) / 2) * spacing;
+          const float z = back - static_cast<float>(row) * spacing;
+          add_sphere_instance(proto,
+                              Vec3{x + place_rand.rand_in_range(-0.2f, 0.2f), 0.f,
+                                   z + place_rand.rand_in_range(-0.2f, 0.2f)},
+                              place_rand.rand_in_range(0.4f, 1.f));
+        }
+      }
+      printf("%zu sphere instances of %zu spheres each\n", sphere_instances.size(),
+             proto_spheres.size());
+    }
+
+    build_instance_bvh();
+  }
+
+  // rays moved into the space of an instance's prototype. Directions are scaled along with
+  // positions, so t means the same in both spaces.
+  [[nodiscard, gnu::always_inline]] inline RayCluster
+  instance_space(const RayCluster& rays, const SphereInstance& inst) noexcept {
+    const __m256 rcp_scale = _mm256_broadcast_ss(&inst.rcp_scale);
+    return RayCluster{
+        .dir = rays.dir * rcp_scale,
+        .orig = (rays.orig - Vec3_256::broadcast_vec(inst.offset)) * rcp_scale,
+    };
+  }
+
+  // Walks instance_bvh and every prototype BVH it leads to, and replaces the lanes of hit_rec
+  // where an instanced sphere is closer than what's already there. A t of 0 in hit_rec means
+  // nothing was hit yet.
+  [[gnu::always_inline]] inline void find_instance_hits(HitRecords& hit_rec,
+                                                        const RayCluster& rays, const float t_max,
+                                                        const __m256& active) noexcept {
+    if (instance_bvh.empty()) {
+      return;
+    }
+
+    constexpr float flt_max = std::numeric_limits<float>::max();
+    const __m256 no_hit = _mm256_cmp_ps(hit_rec.t, global::zeros, _CMP_EQ_OQ);
+    __m256 closest_t = _mm256_blendv_ps(hit_rec.t, _mm256_broadcast_ss(&flt_max), no_hit);
+    closest_t = _mm256_min_ps(closest_t, _mm256_broadcast_ss(&t_max));
+    __m256i closest_inst = _mm256_set1_epi32(-1);
+    __m256i closest_sphere = _mm256_setzero_si256();
+
+    const Vec3_256 rcp_dirs = rcp_dir(rays.dir);
+    uint32_t stack[Bvh::max_depth];
+    unsigned stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+      const BvhNode& node = instance_bvh.nodes[stack[--stack_size]];
+      const __m256 box_hit =
+          _mm256_and_ps(ray_box_hit(rays.orig, rcp_dirs, node, closest_t), active);
+      if (_mm256_testz_ps(box_hit, box_hit)) {
+        continue;
+      }
+
+      if (node.count == 0) {
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+        continue;
+      }
+
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const SphereInstance& inst = sphere_instances[i];
+        const SpherePrototype& proto = prototypes[inst.proto];
+        const RayCluster local = instance_space(rays, inst);
+        const Vec3_256 local_rcp_dirs = rcp_dirs * _mm256_broadcast_ss(&inst.scale);
+
+        uint32_t proto_stack[Bvh::max_depth];
+        unsigned proto_stack_size = 0;
+        proto_stack[proto_stack_size++] = 0;
+        while (proto_stack_size > 0) {
+          const BvhNode& proto_node = proto.bvh.nodes[proto_stack[--proto_stack_size]];
+          const __m256 proto_box_hit = _mm256_and_ps(
+              ray_box_hit(local.orig, local_rcp_dirs, proto_node, closest_t), active);
+          if (_mm256_testz_ps(proto_box_hit, proto_box_hit)) {
+            continue;
+          }
+
+          if (proto_node.count == 0) {
+            proto_stack[proto_stack_size++] = proto_node.first + 1;
+            proto_stack[proto_stack_size++] = proto_node.first;
+            continue;
+          }
+
+          for (uint32_t s = proto.first + proto_node.first;
+               s < proto.first + proto_node.first + proto_node.count; s++) {
+            const __m256 t_vals = sphere_hit(local, proto_spheres[s], closest_t);
+            const __m256 closer = _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ);
+            closest_t = _mm256_blendv_ps(closest_t, t_vals, closer);
+            closest_inst = (__m256i)_mm256_blendv_ps(
+                (__m256)closest_inst, (__m256)_mm256_set1_epi32(static_cast<int>(i)), closer);
+            closest_sphere = (__m256i)_mm256_blendv_ps(
+                (__m256)closest_sphere, (__m256)_mm256_set1_epi32(static_cast<int>(s)), closer);
+          }
+        }
+      }
+    }
+
+    const __m256 found = (__m256)_mm256_cmpgt_epi32(closest_inst, _mm256_set1_epi32(-1));
+    if (_mm256_testz_ps(found, found)) {
+      return;
+    }
+
+    // gather the winning spheres and their instances, and put the spheres where the instances
+    // placed them. Lanes without a hit read instance 0.
+    constexpr int sphere_stride = sizeof(Sphere) / sizeof(float);
+    constexpr int center_at = offsetof(Sphere, center) / sizeof(float);
+    constexpr int mat_id_at = offsetof(Sphere, mat_id) / sizeof(float);
+    constexpr int r_at = offsetof(Sphere, r) / sizeof(float);
+    constexpr int inst_stride = sizeof(SphereInstance) / sizeof(float);
+    constexpr int offset_at = offsetof(SphereInstance, offset) / sizeof(float);
+    constexpr int scale_at = offsetof(SphereInstance, scale) / sizeof(float);
+    static_assert(sizeof(SphereInstance) % sizeof(float) == 0);
+
+    const float* const sphere_base = reinterpret_cast<const float*>(proto_spheres.data());
+    const __m256i sphere_idx = _mm256_mullo_epi32(
+        _mm256_and_si256(closest_sphere, (__m256i)found), _mm256_set1_epi32(sphere_stride));
+    const float* const inst_base = reinterpret_cast<const float*>(sphere_instances.data());
+    const __m256i inst_idx = _mm256_mullo_epi32(_mm256_and_si256(closest_inst, (__m256i)found),
+                                                _mm256_set1_epi32(inst_stride));
+
+    const __m256 scale = _mm256_i32gather_ps(inst_base + scale_at, inst_idx, 4);
+    const Vec3_256 center{
+        _mm256_fmadd_ps(_mm256_i32gather_ps(sphere_base + center_at, sphere_idx, 4), scale,
+                        _mm256_i32gather_ps(inst_base + offset_at, inst_idx, 4)),
+        _mm256_fmadd_ps(_mm256_i32gather_ps(sphere_base + center_at + 1, sphere_idx, 4), scale,
+                        _mm256_i32gather_ps(inst_base + offset_at + 1, inst_idx, 4)),
+        _mm256_fmadd_ps(_mm256_i32gather_ps(sphere_base + center_at + 2, sphere_idx, 4), scale,
+                        _mm256_i32gather_ps(inst_base + offset_at + 2, inst_idx, 4)),
+    };
+    const __m256 r = _mm256_i32gather_ps(sphere_base + r_at, sphere_idx, 4) * scale;
+    const __m256i mat_id = _mm256_i32gather_epi32(
+        reinterpret_cast<const int*>(sphere_base + mat_id_at), sphere_idx, 4);
+    hit_rec.blend(sphere_record(rays, closest_t, center, r, mat_id), found);
+  }
+
+  // lanes in `active` that hit any instanced sphere before their own t_max
+  [[nodiscard, gnu::always_inline]] inline __m256
+  find_instance_occlusion(const RayCluster& rays, const __m256& t_max,
+                          const __m256& active) noexcept {
+    __m256 occluded = global::zeros;
+    if (instance_bvh.empty()) {
+      return occluded;
+    }
+
+    const Vec3_256 rcp_dirs = rcp_dir(rays.dir);
+    uint32_t stack[Bvh::max_depth];
+    unsigned stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+      const BvhNode& node = instance_bvh.nodes[stack[--stack_size]];
+      // lanes that are already blocked don't need to look any further
+      const __m256 searching = _mm256_andnot_ps(occluded, active);
+      const __m256 box_hit =
+          _mm256_and_ps(ray_box_hit(rays.orig, rcp_dirs, node, t_max), searching);
+      if (_mm256_testz_ps(box_hit, box_hit)) {
+        continue;
+      }
+
+      if (node.count == 0) {
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+        continue;
+      }
+
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const SphereInstance& inst = sphere_instances[i];
+        const SpherePrototype& proto = prototypes[inst.proto];
+        const RayCluster local = instance_space(rays, inst);
+        const Vec3_256 local_rcp_dirs = rcp_dirs * _mm256_broadcast_ss(&inst.scale);
+
+        uint32_t proto_stack[Bvh::max_depth];
+        unsigned proto_stack_size = 0;
+        proto_stack[proto_stack_size++] = 0;
+        while (proto_stack_size > 0) {
+          const BvhNode& proto_node = proto.bvh.nodes[proto_stack[--proto_stack_size]];
+          const __m256 proto_searching = _mm256_andnot_ps(occluded, active);
+          const __m256 proto_box_hit = _mm256_and_ps(
+              ray_box_hit(local.orig, local_rcp_dirs, proto_node, t_max), proto_searching);
+          if (_mm256_testz_ps(proto_box_hit, proto_box_hit)) {
+            continue;
+          }
+
+          if (proto_node.count == 0) {
+            proto_stack[proto_stack_size++] = proto_node.first + 1;
+            proto_stack[proto_stack_size++] = proto_node.first;
+            continue;
+          }
+
+          for (uint32_t s = proto.first + proto_node.first;
+               s < proto.first + proto_node.first + proto_node.count; s++) {
+            const __m256 t_vals = sphere_hit(local, proto_spheres[s], t_max);
+            occluded = _mm256_or_ps(occluded, _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ));
+          }
+        }
+      }
+
+      // every lane we care about is already blocked
+      if (_mm256_testc_ps(occluded, active)) {
+        break;
+      }
+    }
+
+    return _mm256_and_ps(occluded, active);
+  }
+} // namespace
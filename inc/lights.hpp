@@ -0,0 +1,181 @@
+#pragma once
+#include "globals.hpp"
+#include "materials.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "sphere.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include <immintrin.h>
+#include <vector>
+
+// Every emissive sphere in the scene, stored SoA so a cluster of rays can gather
+// a different light per lane.
+struct LightList {
+  std::vector<float> x, y, z;
+  std::vector<float> r;
+  std::vector<float> emit_r, emit_g, emit_b;
+  std::vector<uint32_t> sphere_idx; // which sphere each light is, to follow it when it moves
+
+  [[nodiscard]] inline size_t size() const noexcept { return r.size(); }
+  [[nodiscard]] inline bool empty() const noexcept { return r.empty(); }
+};
+
+static LightList lights;
+
+namespace {
+  // must be called after init_scene()
+  inline void init_lights() noexcept {
+    lights = LightList{};
+    for (size_t i = 0; i < spheres.size(); i++) {
+      const Sphere& sphere = spheres[i];
+      if (materials.type[sphere.mat_id] != MatType::emissive) {
+        continue;
+      }
+      lights.sphere_idx.push_back(static_cast<uint32_t>(i));
+      lights.x.push_back(sphere.center.x);
+      lights.y.push_back(sphere.center.y);
+      lights.z.push_back(sphere.center.z);
+      lights.r.push_back(sphere.r);
+      lights.emit_r.push_back(materials.emit_r[sphere.mat_id]);
+      lights.emit_g.push_back(materials.emit_g[sphere.mat_id]);
+      lights.emit_b.push_back(materials.emit_b[sphere.mat_id]);
+    }
+  }
+
+  // copies the light spheres' positions back in after update_scene() moved them
+  inline void update_lights() noexcept {
+    for (size_t i = 0; i < lights.size(); i++) {
+      const Vec3& center = spheres[lights.sphere_idx[i]].center;
+      lights.x[i] = center.x;
+      lights.y[i] = center.y;
+      lights.z[i] = center.z;
+    }
+  }
+
+  // cosine of the half angle of the cone a sphere subtends from a point.
+  // dist_2 is the squared distance from the point to the sphere's center.
+  [[nodiscard, gnu::always_inline]] inline __m256 cone_cos_max(const __m256& r,
+                                                               const __m256& dist_2) noexcept {
+    const __m256 sin_2_max = (r * r) * _mm256_rcp_ps(dist_2);
+    return _mm256_sqrt_ps(_mm256_max_ps(global::ones - sin_2_max, global::zeros));
+  }
+
+  // solid angle pdf of picking a direction with light sampling (uniform light choice followed
+  // by uniform sampling of the light's cone).
+  [[nodiscard, gnu::always_inline]] inline __m256 light_pdf(const __m256& cos_max) noexcept {
+    const float rcp_light_count = 1.f / static_cast<float>(lights.size());
+    const __m256 cone_solid_angle = _mm256_set1_ps(2.f * global::pi) * (global::ones - cos_max);
+    return _mm256_broadcast_ss(&rcp_light_count) * _mm256_rcp_ps(cone_solid_angle);
+  }
+
+  // power heuristic (beta = 2) weight for the strategy that produced pdf_a.
+  [[nodiscard, gnu::always_inline]] inline __m256 mis_weight(const __m256& pdf_a,
+                                                             const __m256& pdf_b) noexcept {
+    const __m256 a_2 = pdf_a * pdf_a;
+    return a_2 * _mm256_rcp_ps(_mm256_fmadd_ps(pdf_b, pdf_b, a_2));
+  }
+
+  // MIS weight for emission picked up by a bsdf sampled ray leaving a lambertian surface at
+  // `prev_orig`. The light's center is recovered from the hit point and its outward normal.
+  [[nodiscard, gnu::always_inline]] inline __m256 emission_mis_weight(const HitRecords& hit_rec,
+                                                                      const Vec3_256& prev_orig,
+                                                                      const __m256& bsdf_pdf) {
+    const Vec3_256 outward_norm = (-hit_rec.norm).blend_vec256(hit_rec.norm, hit_rec.front_face);
+    const Vec3_256 center{
+        _mm256_fnmadd_ps(outward_norm.x, hit_rec.r, hit_rec.orig.x),
+        _mm256_fnmadd_ps(outward_norm.y, hit_rec.r, hit_rec.orig.y),
+        _mm256_fnmadd_ps(outward_norm.z, hit_rec.r, hit_rec.orig.z),
+    };
+    const Vec3_256 to_center = center - prev_orig;
+    const __m256 cos_max = cone_cos_max(hit_rec.r, to_center.dot(to_center));
+
+    return mis_weight(bsdf_pdf, light_pdf(cos_max));
+  }
+
+  // Next event estimation for the lanes in `mask`, which must all sit on lambertian surfaces
+  // of the given albedo.
+  // Picks one light per lane, samples a direction inside the cone it subtends, and traces a
+  // shadow ray towards it. Returns the MIS weighted direct lighting, not yet multiplied by the
+  // path throughput.
+  [[nodiscard, gnu::always_inline]] inline Color_256 sample_lights(const HitRecords& hit_rec,
+                                                                   const Color_256& albedo,
+                                                                   const __m256& mask,
+                                                                   Sampler& sampler) {
+    const float light_count = static_cast<float>(lights.size());
+    const __m256i last_light = _mm256_set1_epi32(static_cast<int>(lights.size() - 1));
+    __m256i idx = _mm256_cvttps_epi32(sampler.get_1d(sample_dim::light_pick) *
+                                      _mm256_broadcast_ss(&light_count));
+    idx = _mm256_min_epi32(idx, last_light);
+
+    const Vec3_256 center{
+        _mm256_i32gather_ps(lights.x.data(), idx, 4),
+        _mm256_i32gather_ps(lights.y.data(), idx, 4),
+        _mm256_i32gather_ps(lights.z.data(), idx, 4),
+    };
+    const __m256 r = _mm256_i32gather_ps(lights.r.data(), idx, 4);
+    const Color_256 emission{
+        _mm256_i32gather_ps(lights.emit_r.data(), idx, 4),
+        _mm256_i32gather_ps(lights.emit_g.data(), idx, 4),
+        _mm256_i32gather_ps(lights.emit_b.data(), idx, 4),
+    };
+
+    Vec3_256 to_center = center - hit_rec.orig;
+    const __m256 dist_2 = to_center.dot(to_center);
+    to_center *= _mm256_rsqrt_ps(dist_2);
+    const __m256 cos_max = cone_cos_max(r, dist_2);
+
+    // uniform direction in the cone around to_center
+    __m256 u, v;
+    sampler.get_2d(sample_dim::light_cone, u, v);
+    const __m256 cos_theta = _mm256_fnmadd_ps(u, global::ones - cos_max, global::ones);
+    const __m256 sin_theta =
+        _mm256_sqrt_ps(_mm256_max_ps(global::ones - cos_theta * cos_theta, global::zeros));
+    __m256 cos_phi, sin_phi;
+    unit_circle_256(v, cos_phi, sin_phi);
+
+    // branchless orthonormal basis (Duff et al. 2017)
+    const __m256 sign_bit = (__m256)_mm256_set1_epi32(static_cast<int>(0x80000000));
+    const __m256 sign = _mm256_or_ps(_mm256_and_ps(to_center.z, sign_bit), global::ones);
+    const __m256 a = -_mm256_rcp_ps(sign + to_center.z);
+    const __m256 b = to_center.x * to_center.y * a;
+    const Vec3_256 tangent{
+        _mm256_fmadd_ps(sign * to_center.x * to_center.x, a, global::ones),
+        sign * b,
+        -(sign * to_center.x),
+    };
+    const Vec3_256 bitangent{
+        b,
+        _mm256_fmadd_ps(to_center.y * to_center.y, a, sign),
+        -to_center.y,
+    };
+
+    RayCluster shadow_rays{
+        .dir = tangent * (cos_phi * sin_theta) + bitangent * (sin_phi * sin_theta) +
+               to_center * cos_theta,
+        .orig = hit_rec.orig,
+    };
+
+    const __m256 cos_surface = shadow_rays.dir.dot(hit_rec.norm);
+    __m256 valid = _mm256_and_ps(mask, _mm256_cmp_ps(cos_surface, global::zeros, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(cos_max, global::ones, _CMP_LT_OQ));
+    if (_mm256_testz_ps(valid, valid)) {
+      return Color_256{global::zeros, global::zeros, global::zeros};
+    }
+
+    // nothing on the light can be closer than dist - r, so anything hit before that blocks it.
+    // Solving for the exact hit on the light here cancels badly with rsqrt precision directions.
+    const __m256 t_light = (_mm256_sqrt_ps(dist_2) - r) * _mm256_set1_ps(0.999f);
+
+    const __m256 occluded = find_occlusion(shadow_rays, t_light, valid);
+    valid = _mm256_andnot_ps(occluded, valid);
+
+    const __m256 pdf_light = light_pdf(cos_max);
+    const __m256 pdf_bsdf = cos_surface * global::rcp_pi_vec;
+
+    // albedo / pi * Le * cos / pdf_light * w_light
+    const __m256 scale = _mm256_and_ps(
+        pdf_bsdf * _mm256_rcp_ps(pdf_light) * mis_weight(pdf_light, pdf_bsdf), valid);
+    return albedo * emission * scale;
+  }
+} // namespace
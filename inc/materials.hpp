@@ -2,22 +2,77 @@
 #include "colors.hpp"
 #include "globals.hpp"
 #include "rand.hpp"
+#include "sampler.hpp"
 #include "types.hpp"
 #include <cmath>
 #include <cstdlib>
+#include <cstdint>
 #include <immintrin.h>
+#include <vector>
 
 enum MatType {
   metallic,
   lambertian,
   dielectric,
+  emissive,
 };
 
-struct alignas(16) Material {
+// Describes a material when building a scene. Primitives only keep the id add_material()
+// gives back for it.
+struct Material {
   Color atten;
   MatType type;
+  float fuzz = 0.f;       // metallic only, how far reflections get scattered
+  float ir = global::ir; // dielectric only, index of refraction
+  Color emit = {};        // emissive only, emitted radiance
 };
 
+// Every material in the scene, SoA so a cluster of hits can gather each parameter for its
+// lanes' material ids at once.
+struct MaterialTable {
+  std::vector<float> atten_r, atten_g, atten_b;
+  std::vector<int> type;
+  std::vector<float> fuzz;
+  std::vector<float> ir;
+  std::vector<float> emit_r, emit_g, emit_b;
+
+  [[nodiscard]] inline size_t size() const noexcept { return type.size(); }
+
+  // makes room for materials up to `count`, to be filled in with set(), e.g. from several
+  // threads at once
+  inline void resize(const size_t count) {
+    for (std::vector<float>* column :
+         {&atten_r, &atten_g, &atten_b, &fuzz, &ir, &emit_r, &emit_g, &emit_b}) {
+      column->resize(count);
+    }
+    type.resize(count);
+  }
+
+  inline void set(const uint32_t id, const Material& mat) noexcept {
+    atten_r[id] = mat.atten.x;
+    atten_g[id] = mat.atten.y;
+    atten_b[id] = mat.atten.z;
+    type[id] = mat.type;
+    fuzz[id] = mat.fuzz;
+    ir[id] = mat.ir;
+    emit_r[id] = mat.emit.x;
+    emit_g[id] = mat.emit.y;
+    emit_b[id] = mat.emit.z;
+  }
+
+  [[nodiscard]] inline Material get(const uint32_t id) const noexcept {
+    return Material{
+        .atten = {atten_r[id], atten_g[id], atten_b[id]},
+        .type = static_cast<MatType>(type[id]),
+        .fuzz = fuzz[id],
+        .ir = ir[id],
+        .emit = {emit_r[id], emit_g[id], emit_b[id]},
+    };
+  }
+};
+
+static MaterialTable materials;
+
 namespace {
 
   using namespace colors;
@@ -36,6 +91,42 @@ namespace {
 
   constexpr Material glass = {.atten = white, .type = MatType::dielectric};
 
+  constexpr Material moon_emissive = {.atten = {}, .type = MatType::emissive, .emit = moon};
+
+  // adds a material to the table and returns the id primitives refer to it by
+  inline uint32_t add_material(const Material& mat) {
+    const uint32_t id = static_cast<uint32_t>(materials.size());
+    materials.resize(id + 1);
+    materials.set(id, mat);
+    return id;
+  }
+
+  // everything shading needs to know about each lane's material, except emission which only
+  // lights need (see gather_emission)
+  [[nodiscard, gnu::always_inline]] inline Material_256
+  gather_materials(const __m256i& mat_id) noexcept {
+    return Material_256{
+        .atten =
+            {
+                _mm256_i32gather_ps(materials.atten_r.data(), mat_id, 4),
+                _mm256_i32gather_ps(materials.atten_g.data(), mat_id, 4),
+                _mm256_i32gather_ps(materials.atten_b.data(), mat_id, 4),
+            },
+        .type = _mm256_i32gather_epi32(materials.type.data(), mat_id, 4),
+        .fuzz = _mm256_i32gather_ps(materials.fuzz.data(), mat_id, 4),
+        .ir = _mm256_i32gather_ps(materials.ir.data(), mat_id, 4),
+    };
+  }
+
+  [[nodiscard, gnu::always_inline]] inline Color_256
+  gather_emission(const __m256i& mat_id) noexcept {
+    return Color_256{
+        _mm256_i32gather_ps(materials.emit_r.data(), mat_id, 4),
+        _mm256_i32gather_ps(materials.emit_g.data(), mat_id, 4),
+        _mm256_i32gather_ps(materials.emit_b.data(), mat_id, 4),
+    };
+  }
+
   alignas(32) constexpr int metallic_types[8] = {
       MatType::metallic, MatType::metallic, MatType::metallic, MatType::metallic,
       MatType::metallic, MatType::metallic, MatType::metallic, MatType::metallic,
@@ -51,16 +142,10 @@ namespace {
       MatType::dielectric, MatType::dielectric, MatType::dielectric, MatType::dielectric,
   };
 
-  LCGRand lcg_rand; // TODO move this someplace else? Why is it here? Is it thread_local?
-
-  [[gnu::always_inline]] inline void scatter_metallic(RayCluster& rays, const HitRecords& hit_rec) {
-    Vec3_256 reflected = rays.dir.reflect(hit_rec.norm);
-    reflected.normalize();
-
-    __m256 dp = reflected.dot(hit_rec.norm);
-    __m256 greater_than_zero = _mm256_cmp_ps(dp, global::zeros, _CMP_NLE_US);
-    rays.dir = reflected & greater_than_zero;
-  }
+  alignas(32) constexpr int emissive_types[8] = {
+      MatType::emissive, MatType::emissive, MatType::emissive, MatType::emissive,
+      MatType::emissive, MatType::emissive, MatType::emissive, MatType::emissive,
+  };
 
   [[nodiscard, gnu::always_inline]] inline __m256 near_zero(const Vec3_256* vec) {
     __m256 near_x = _mm256_cmp_ps(abs_256(vec->x), global::t_min_vec, _CMP_LT_OS);
@@ -70,15 +155,6 @@ namespace {
     return _mm256_and_ps(near_x, _mm256_and_ps(near_y, near_z));
   }
 
-  [[gnu::always_inline]] inline void scatter_lambertian(RayCluster& rays,
-                                                        const HitRecords& hit_rec) {
-    Vec3_256 rand_vec = lcg_rand.random_unit_vec();
-    Vec3_256 scatter_dir = rand_vec + hit_rec.norm;
-
-    //  rays->dir = blend_vec256(&scatter_dir, &hit_rec->norm, near_zero(&scatter_dir));
-    rays.dir = scatter_dir;
-  }
-
   [[nodiscard, gnu::always_inline]] inline __m256 reflectance(__m256 cos, __m256 ref_idx) {
     __m256 ref_low = global::ones - ref_idx;
     __m256 ref_high = global::ones + ref_idx;
@@ -97,10 +173,11 @@ namespace {
     return _mm256_fmadd_ps(ref_sub, cos_5, ref);
   }
 
-  [[gnu::always_inline]] inline void scatter_dielectric(RayCluster& rays,
-                                                        const HitRecords& hit_rec) {
+  [[gnu::always_inline]] inline void scatter_dielectric(RayCluster& rays, const HitRecords& hit_rec,
+                                                        const Material_256& mat,
+                                                        Sampler& sampler) {
 
-    __m256 ri = _mm256_blendv_ps(global::ir_vec, global::rcp_ir_vec, hit_rec.front_face);
+    __m256 ri = _mm256_blendv_ps(mat.ir, _mm256_div_ps(global::ones, mat.ir), hit_rec.front_face);
     Vec3_256 unit_dir = rays.dir;
     unit_dir.normalize();
 
@@ -115,7 +192,7 @@ namespace {
     can_refract = _mm256_cmp_ps(can_refract, global::ones, _CMP_LE_OS);
 
     __m256 ref = reflectance(cos_theta, ri);
-    __m256 rand_vec = lcg_rand.rand_in_range_256(0.f, 1.f);
+    __m256 rand_vec = sampler.get_1d(sample_dim::fresnel);
     __m256 low_reflectance_loc = _mm256_cmp_ps(ref, rand_vec, _CMP_LE_OS);
     __m256 refraction_loc = _mm256_and_ps(can_refract, low_reflectance_loc);
     __m256 reflection_loc = _mm256_xor_ps(refraction_loc, (__m256)global::all_set);
@@ -132,45 +209,47 @@ namespace {
     }
   }
 
-  [[gnu::always_inline]] inline void scatter(RayCluster& rays, const HitRecords& hit_rec) {
+  // Lambertian and metallic lanes share one random unit vector and are resolved with blends,
+  // so only glass, which is comparatively rare and expensive, gets its own branch. Returns the
+  // lanes that got absorbed instead, which are left with a zero direction and have to retire.
+  [[nodiscard, gnu::always_inline]] inline __m256 scatter(RayCluster& rays,
+                                                          const HitRecords& hit_rec,
+                                                          const Material_256& mat,
+                                                          Sampler& sampler) {
     __m256i metallic_type = _mm256_load_si256((__m256i*)metallic_types);
-    __m256i lambertian_type = _mm256_load_si256((__m256i*)lambertian_types);
     __m256i dielectric_type = _mm256_load_si256((__m256i*)dielectric_types);
 
-    __m256i metallic_loc = _mm256_cmpeq_epi32(hit_rec.mat.type, metallic_type);
-    __m256i lambertian_loc = _mm256_cmpeq_epi32(hit_rec.mat.type, lambertian_type);
-    __m256i dielectric_loc = _mm256_cmpeq_epi32(hit_rec.mat.type, dielectric_type);
+    __m256 metallic_loc = (__m256)_mm256_cmpeq_epi32(mat.type, metallic_type);
+    __m256 dielectric_loc = (__m256)_mm256_cmpeq_epi32(mat.type, dielectric_type);
 
-    if (!_mm256_testz_si256(metallic_loc, metallic_loc)) {
-      RayCluster metallic_rays = {
-          .dir = rays.dir,
-          .orig = hit_rec.orig,
-      };
-      scatter_metallic(metallic_rays, hit_rec);
+    __m256 u, v;
+    sampler.get_2d(sample_dim::scatter, u, v);
+    const Vec3_256 rand_vec = unit_sphere_256(u, v);
 
-      rays.dir = rays.dir.blend_vec256(metallic_rays.dir, (__m256)metallic_loc);
-      rays.orig = rays.orig.blend_vec256(metallic_rays.orig, (__m256)metallic_loc);
-    }
-    if (!_mm256_testz_si256(lambertian_loc, lambertian_loc)) {
-      RayCluster lambertian_rays = {
-          .dir = rays.dir,
-          .orig = hit_rec.orig,
-      };
-      scatter_lambertian(lambertian_rays, hit_rec);
+    //  rays->dir = blend_vec256(&scatter_dir, &hit_rec->norm, near_zero(&scatter_dir));
+    const Vec3_256 lambertian_dir = rand_vec + hit_rec.norm;
 
-      rays.dir = rays.dir.blend_vec256(lambertian_rays.dir, (__m256)lambertian_loc);
-      rays.orig = rays.orig.blend_vec256(lambertian_rays.orig, (__m256)lambertian_loc);
-    }
-    if (!_mm256_testz_si256(dielectric_loc, dielectric_loc)) {
+    Vec3_256 reflected = rays.dir.reflect(hit_rec.norm);
+    reflected.normalize();
+    reflected += rand_vec * mat.fuzz;
+    // fuzzed below the surface means absorbed
+    const __m256 above = _mm256_cmp_ps(reflected.dot(hit_rec.norm), global::zeros, _CMP_NLE_US);
+    const Vec3_256 metallic_dir = reflected & above;
+
+    const Vec3_256 in_dir = rays.dir;
+    rays.orig = hit_rec.orig;
+    rays.dir = lambertian_dir.blend_vec256(metallic_dir, metallic_loc);
+
+    if (!_mm256_testz_ps(dielectric_loc, dielectric_loc)) {
       RayCluster dielectric_rays = {
-          .dir = rays.dir,
+          .dir = in_dir,
           .orig = hit_rec.orig,
       };
-      scatter_dielectric(dielectric_rays, hit_rec);
+      scatter_dielectric(dielectric_rays, hit_rec, mat, sampler);
 
-      rays.dir = rays.dir.blend_vec256(dielectric_rays.dir, (__m256)dielectric_loc);
-      rays.orig = rays.orig.blend_vec256(dielectric_rays.orig, (__m256)dielectric_loc);
+      rays.dir = rays.dir.blend_vec256(dielectric_rays.dir, dielectric_loc);
     }
+    return _mm256_andnot_ps(above, metallic_loc);
   }
 
 } // namespace
@@ -0,0 +1,283 @@
+#pragma once
+#include "bvh.hpp"
+#include "globals.hpp"
+#include "materials.hpp"
+#include "obj.hpp"
+#include "sphere.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <immintrin.h>
+#include <limits>
+#include <span>
+#include <vector>
+
+// Every triangle in the scene, SoA so traversal streams through each component.
+// Triangles are stored in BVH leaf order, so a leaf is a contiguous run of indices.
+struct TriangleSoup {
+  std::vector<float> v0_x, v0_y, v0_z;
+  std::vector<float> e1_x, e1_y, e1_z; // v1 - v0
+  std::vector<float> e2_x, e2_y, e2_z; // v2 - v0
+  std::vector<float> n_x, n_y, n_z;    // unit geometric normal
+  std::vector<int> mat_id;
+
+  Bvh bvh;
+
+  [[nodiscard]] inline size_t size() const noexcept { return v0_x.size(); }
+  [[nodiscard]] inline bool empty() const noexcept { return v0_x.empty(); }
+};
+
+static TriangleSoup triangles;
+
+namespace {
+  // adds a triangle mesh, placed by scaling its vertices then offsetting them.
+  // build_mesh_bvh() must be called once every mesh has been added.
+  inline void add_mesh(std::span<const Vec3> verts, std::span<const uint32_t> tri_indices,
+                       const uint32_t material, const float scale = 1.f,
+                       const Vec3 offset = {0.f, 0.f, 0.f}) {
+    const int mat_id = static_cast<int>(material);
+
+    const auto place = [&](const Vec3& v) {
+      return Vec3{v.x * scale + offset.x, v.y * scale + offset.y, v.z * scale + offset.z};
+    };
+
+    for (size_t i = 0; i + 2 < tri_indices.size(); i += 3) {
+      const Vec3 v0 = place(verts[tri_indices[i]]);
+      const Vec3 v1 = place(verts[tri_indices[i + 1]]);
+      const Vec3 v2 = place(verts[tri_indices[i + 2]]);
+      const Vec3 e1{v1.x - v0.x, v1.y - v0.y, v1.z - v0.z};
+      const Vec3 e2{v2.x - v0.x, v2.y - v0.y, v2.z - v0.z};
+
+      Vec3 n{e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x};
+      const float n_len = std::sqrt(n.x * n.x + n.y * n.y + n.z * n.z);
+      if (n_len == 0.f) {
+        continue; // degenerate, can never be hit
+      }
+      n = {n.x / n_len, n.y / n_len, n.z / n_len};
+
+      triangles.v0_x.push_back(v0.x);
+      triangles.v0_y.push_back(v0.y);
+      triangles.v0_z.push_back(v0.z);
+      triangles.e1_x.push_back(e1.x);
+      triangles.e1_y.push_back(e1.y);
+      triangles.e1_z.push_back(e1.z);
+      triangles.e2_x.push_back(e2.x);
+      triangles.e2_y.push_back(e2.y);
+      triangles.e2_z.push_back(e2.z);
+      triangles.n_x.push_back(n.x);
+      triangles.n_y.push_back(n.y);
+      triangles.n_z.push_back(n.z);
+      triangles.mat_id.push_back(mat_id);
+    }
+  }
+
+  // add_mesh() with a material of its own
+  inline void add_mesh(std::span<const Vec3> verts, std::span<const uint32_t> tri_indices,
+                       const Material& mat, const float scale = 1.f,
+                       const Vec3 offset = {0.f, 0.f, 0.f}) {
+    add_mesh(verts, tri_indices, add_material(mat), scale, offset);
+  }
+
+  // builds the triangle BVH and reorders every triangle array into its leaf order
+  inline void build_mesh_bvh() {
+    std::vector<Aabb> boxes(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+      const Vec3 v0{triangles.v0_x[i], triangles.v0_y[i], triangles.v0_z[i]};
+      const Vec3 v1{v0.x + triangles.e1_x[i], v0.y + triangles.e1_y[i], v0.z + triangles.e1_z[i]};
+      const Vec3 v2{v0.x + triangles.e2_x[i], v0.y + triangles.e2_y[i], v0.z + triangles.e2_z[i]};
+      boxes[i] = Aabb{
+          .min = {std::min({v0.x, v1.x, v2.x}), std::min({v0.y, v1.y, v2.y}),
+                  std::min({v0.z, v1.z, v2.z})},
+          .max = {std::max({v0.x, v1.x, v2.x}), std::max({v0.y, v1.y, v2.y}),
+                  std::max({v0.z, v1.z, v2.z})},
+      };
+    }
+
+    triangles.bvh.build(boxes);
+
+    const auto reorder = [](auto& vec) {
+      auto sorted = vec;
+      for (size_t i = 0; i < vec.size(); i++) {
+        sorted[i] = vec[triangles.bvh.prim_order[i]];
+      }
+      vec = std::move(sorted);
+    };
+    for (auto* component : {&triangles.v0_x, &triangles.v0_y, &triangles.v0_z, &triangles.e1_x,
+                            &triangles.e1_y, &triangles.e1_z, &triangles.e2_x, &triangles.e2_y,
+                            &triangles.e2_z, &triangles.n_x, &triangles.n_y, &triangles.n_z}) {
+      reorder(*component);
+    }
+    reorder(triangles.mat_id);
+  }
+
+  inline void init_meshes() {
+    triangles = TriangleSoup{};
+
+    if (config::mesh_path[0] != '\0') {
+      std::vector<Vec3> verts;
+      std::vector<uint32_t> tri_indices;
+      if (load_obj(config::mesh_path, verts, tri_indices)) {
+        add_mesh(verts, tri_indices, gold_metallic, config::mesh_scale,
+                 Vec3{config::mesh_offset[0], config::mesh_offset[1], config::mesh_offset[2]});
+      }
+    }
+
+    build_mesh_bvh();
+  }
+
+  // Möller–Trumbore, one triangle against all 8 rays.
+  // Returns hit t values or 0 depending on if this ray hit this triangle or not
+  [[nodiscard, gnu::always_inline]] inline __m256 triangle_hit(const RayCluster& rays,
+                                                               const size_t tri,
+                                                               const __m256& t_max) noexcept {
+    const Vec3_256 v0{
+        _mm256_broadcast_ss(&triangles.v0_x[tri]),
+        _mm256_broadcast_ss(&triangles.v0_y[tri]),
+        _mm256_broadcast_ss(&triangles.v0_z[tri]),
+    };
+    const Vec3_256 e1{
+        _mm256_broadcast_ss(&triangles.e1_x[tri]),
+        _mm256_broadcast_ss(&triangles.e1_y[tri]),
+        _mm256_broadcast_ss(&triangles.e1_z[tri]),
+    };
+    const Vec3_256 e2{
+        _mm256_broadcast_ss(&triangles.e2_x[tri]),
+        _mm256_broadcast_ss(&triangles.e2_y[tri]),
+        _mm256_broadcast_ss(&triangles.e2_z[tri]),
+    };
+
+    const Vec3_256 p_vec = rays.dir.cross(e2);
+    const __m256 rcp_det = _mm256_div_ps(global::ones, e1.dot(p_vec));
+
+    const Vec3_256 t_vec = rays.orig - v0;
+    const __m256 u = t_vec.dot(p_vec) * rcp_det;
+
+    const Vec3_256 q_vec = t_vec.cross(e1);
+    const __m256 v = rays.dir.dot(q_vec) * rcp_det;
+    const __m256 t = e2.dot(q_vec) * rcp_det;
+
+    // rays parallel to the triangle end up with inf/nan, which fail the ordered compares
+    __m256 hit_loc = _mm256_cmp_ps(u, global::zeros, _CMP_GE_OQ);
+    hit_loc = _mm256_and_ps(hit_loc, _mm256_cmp_ps(v, global::zeros, _CMP_GE_OQ));
+    hit_loc = _mm256_and_ps(hit_loc, _mm256_cmp_ps(u + v, global::ones, _CMP_LE_OQ));
+    hit_loc = _mm256_and_ps(hit_loc, _mm256_cmp_ps(t, global::t_min_vec, _CMP_GE_OQ));
+    hit_loc = _mm256_and_ps(hit_loc, _mm256_cmp_ps(t, t_max, _CMP_LT_OQ));
+
+    return _mm256_and_ps(t, hit_loc);
+  }
+
+  // Walks the triangle BVH and replaces the lanes of hit_rec where a triangle is closer than
+  // what's already there. A t of 0 in hit_rec means nothing was hit yet.
+  [[gnu::always_inline]] inline void find_mesh_hits(HitRecords& hit_rec, const RayCluster& rays,
+                                                    const float t_max,
+                                                    const __m256& active) noexcept {
+    if (triangles.empty()) {
+      return;
+    }
+
+    constexpr float flt_max = std::numeric_limits<float>::max();
+    const __m256 no_hit = _mm256_cmp_ps(hit_rec.t, global::zeros, _CMP_EQ_OQ);
+    __m256 closest_t = _mm256_blendv_ps(hit_rec.t, _mm256_broadcast_ss(&flt_max), no_hit);
+    closest_t = _mm256_min_ps(closest_t, _mm256_broadcast_ss(&t_max));
+    __m256i closest_tri = _mm256_set1_epi32(-1);
+
+    const Vec3_256 rcp_dirs = rcp_dir(rays.dir);
+    uint32_t stack[Bvh::max_depth];
+    unsigned stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+      const BvhNode& node = triangles.bvh.nodes[stack[--stack_size]];
+      const __m256 box_hit =
+          _mm256_and_ps(ray_box_hit(rays.orig, rcp_dirs, node, closest_t), active);
+      if (_mm256_testz_ps(box_hit, box_hit)) {
+        continue;
+      }
+
+      if (node.count == 0) {
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+        continue;
+      }
+
+      for (uint32_t tri = node.first; tri < node.first + node.count; tri++) {
+        const __m256 t_vals = triangle_hit(rays, tri, closest_t);
+        const __m256 closer = _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ);
+        closest_t = _mm256_blendv_ps(closest_t, t_vals, closer);
+        closest_tri = (__m256i)_mm256_blendv_ps(
+            (__m256)closest_tri, (__m256)_mm256_set1_epi32(static_cast<int>(tri)), closer);
+      }
+    }
+
+    const __m256 found = (__m256)_mm256_cmpgt_epi32(closest_tri, _mm256_set1_epi32(-1));
+    if (_mm256_testz_ps(found, found)) {
+      return;
+    }
+
+    // gather the winners' normals and material ids. Lanes without a hit read triangle 0.
+    const __m256i tri_idx = _mm256_and_si256(closest_tri, (__m256i)found);
+    const Vec3_256 outward_norm{
+        _mm256_i32gather_ps(triangles.n_x.data(), tri_idx, 4),
+        _mm256_i32gather_ps(triangles.n_y.data(), tri_idx, 4),
+        _mm256_i32gather_ps(triangles.n_z.data(), tri_idx, 4),
+    };
+
+    HitRecords mesh_rec{
+        .orig =
+            {
+                _mm256_fmadd_ps(rays.dir.x, closest_t, rays.orig.x),
+                _mm256_fmadd_ps(rays.dir.y, closest_t, rays.orig.y),
+                _mm256_fmadd_ps(rays.dir.z, closest_t, rays.orig.z),
+            },
+        .norm = {},
+        .mat_id = _mm256_i32gather_epi32(triangles.mat_id.data(), tri_idx, 4),
+        .front_face = {},
+        .t = closest_t,
+        .r = global::zeros,
+    };
+    set_face_normal(rays, mesh_rec, outward_norm);
+    hit_rec.blend(mesh_rec, found);
+  }
+
+  // lanes in `active` that hit any triangle before their own t_max
+  [[nodiscard, gnu::always_inline]] inline __m256
+  find_mesh_occlusion(const RayCluster& rays, const __m256& t_max, const __m256& active) noexcept {
+    __m256 occluded = global::zeros;
+    if (triangles.empty()) {
+      return occluded;
+    }
+
+    const Vec3_256 rcp_dirs = rcp_dir(rays.dir);
+    uint32_t stack[Bvh::max_depth];
+    unsigned stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+      const BvhNode& node = triangles.bvh.nodes[stack[--stack_size]];
+      // lanes that are already blocked don't need to look any further
+      const __m256 searching = _mm256_andnot_ps(occluded, active);
+      const __m256 box_hit =
+          _mm256_and_ps(ray_box_hit(rays.orig, rcp_dirs, node, t_max), searching);
+      if (_mm256_testz_ps(box_hit, box_hit)) {
+        continue;
+      }
+
+      if (node.count == 0) {
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+        continue;
+      }
+
+      for (uint32_t tri = node.first; tri < node.first + node.count; tri++) {
+        const __m256 t_vals = triangle_hit(rays, tri, t_max);
+        occluded = _mm256_or_ps(occluded, _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ));
+      }
+      if (_mm256_testc_ps(occluded, active)) {
+        break;
+      }
+    }
+
+    return _mm256_and_ps(occluded, active);
+  }
+} // namespace
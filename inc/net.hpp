@@ -0,0 +1,26 @@
+#pragma once
+#include <cstddef>
+
+// Thin wrappers over stream sockets. An address is either a Unix domain socket path, or
+// host:port for TCP, so daemons can serve other machines too. All of them print what went
+// wrong and return -1 or false on failure.
+
+// listening socket at `address`. Replaces any socket file a previous server left behind.
+// A TCP address without a host (":port") only listens on loopback.
+int listen_on(const char* address);
+
+int connect_to(const char* address);
+
+// makes recv_message() on `sock` give up after waiting `secs` for the peer to send anything
+bool set_recv_timeout(int sock, float secs);
+
+// closes a socket from listen_on(), and removes its socket file if it had one
+void stop_listening(int sock, const char* address);
+
+// sends all `size` bytes, with `fd` attached if it isn't -1. Only Unix sockets can carry fds.
+bool send_message(int sock, const void* data, size_t size, int fd = -1);
+
+// Receives exactly `size` bytes. An fd attached to them ends up in `fd`, which is -1
+// otherwise. Also returns false, without printing, when the peer hung up before sending
+// anything, and with a message when it timed out (see set_recv_timeout()).
+bool recv_message(int sock, void* data, size_t size, int& fd);
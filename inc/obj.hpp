@@ -0,0 +1,10 @@
+#pragma once
+#include "vec.hpp"
+#include <cstdint>
+#include <vector>
+
+// Reads the vertex positions and faces of a Wavefront .obj file, triangulating polygons as
+// fans. Everything else (normals, uvs, materials, groups) is ignored.
+// Returns false if the file can't be opened, has no faces or a face refers to a vertex that
+// isn't there (printing which line).
+bool load_obj(const char* path, std::vector<Vec3>& verts, std::vector<uint32_t>& tri_indices);
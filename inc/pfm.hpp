@@ -0,0 +1,13 @@
+#pragma once
+#include "types.hpp"
+#include <cstdint>
+#include <vector>
+
+// Writes linear float colors as a color PFM (Portable Float Map), top row first in `pixels`.
+// Viewers and grading tools read PFMs as is, without any clipping or transfer curve.
+// Returns false if the file couldn't be written.
+bool write_pfm(const char* path, const Color* pixels, uint32_t width, uint32_t height);
+
+// Reads a color PFM into `pixels`, top row first, whichever way the file was written. Returns
+// false, printing why, if it isn't one.
+bool read_pfm(const char* path, std::vector<Color>& pixels, uint32_t& width, uint32_t& height);
@@ -0,0 +1,91 @@
+#pragma once
+#include "globals.hpp"
+#include "materials.hpp"
+#include "sphere.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include <immintrin.h>
+#include <vector>
+
+// infinite plane of every point p where dot(norm, p) == dist
+struct alignas(32) Plane {
+  Vec3 norm; // unit length
+  float dist;
+  uint32_t mat_id;
+};
+
+static std::vector<Plane> planes;
+
+namespace {
+  inline void init_planes() {
+    planes = {
+        {.norm = {.x = 0.f, .y = 1.f, .z = 0.f},
+         .dist = 0.f,
+         .mat_id = add_material(silver_lambertian)},
+    };
+  }
+
+  // Returns hit t values or 0 depending on if this ray hit this plane or not
+  [[nodiscard, gnu::always_inline]]
+  inline __m256 plane_hit(const RayCluster& rays, const Plane& plane,
+                          const __m256& t_max) noexcept {
+    const Vec3_256 norm = Vec3_256::broadcast_vec(plane.norm);
+    const __m256 dist = _mm256_broadcast_ss(&plane.dist);
+
+    const __m256 denom = rays.dir.dot(norm);
+    const __m256 t = _mm256_div_ps(dist - rays.orig.dot(norm), denom);
+
+    // parallel rays give inf or nan here, which fail both comparisons
+    const __m256 hit_loc = _mm256_and_ps(_mm256_cmp_ps(t, global::t_min_vec, _CMP_GE_OQ),
+                                         _mm256_cmp_ps(t, t_max, _CMP_LT_OQ));
+    return _mm256_and_ps(t, hit_loc);
+  }
+
+  // Replaces the lanes of hit_rec where a plane is closer than what's already there.
+  // A t of 0 in hit_rec means nothing was hit yet.
+  [[gnu::always_inline]] inline void find_plane_hits(HitRecords& hit_rec, const RayCluster& rays,
+                                                     const float t_max) noexcept {
+    constexpr float flt_max = std::numeric_limits<float>::max();
+    const __m256 no_hit = _mm256_cmp_ps(hit_rec.t, global::zeros, _CMP_EQ_OQ);
+    __m256 closest_t = _mm256_blendv_ps(hit_rec.t, _mm256_broadcast_ss(&flt_max), no_hit);
+    closest_t = _mm256_min_ps(closest_t, _mm256_broadcast_ss(&t_max));
+
+    for (const Plane& plane : planes) {
+      const __m256 t_vals = plane_hit(rays, plane, closest_t);
+      const __m256 closer = _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ);
+      if (_mm256_testz_ps(closer, closer)) {
+        continue;
+      }
+
+      const Vec3_256 outward_norm = Vec3_256::broadcast_vec(plane.norm);
+      HitRecords plane_rec{
+          .orig =
+              {
+                  _mm256_fmadd_ps(rays.dir.x, t_vals, rays.orig.x),
+                  _mm256_fmadd_ps(rays.dir.y, t_vals, rays.orig.y),
+                  _mm256_fmadd_ps(rays.dir.z, t_vals, rays.orig.z),
+              },
+          .norm = {},
+          .mat_id = _mm256_set1_epi32(static_cast<int>(plane.mat_id)),
+          .front_face = {},
+          .t = t_vals,
+          .r = global::zeros,
+      };
+      set_face_normal(rays, plane_rec, outward_norm);
+      hit_rec.blend(plane_rec, closer);
+
+      closest_t = _mm256_blendv_ps(closest_t, t_vals, closer);
+    }
+  }
+
+  // lanes in `active` that hit any plane before their own t_max
+  [[nodiscard, gnu::always_inline]] inline __m256
+  find_plane_occlusion(const RayCluster& rays, const __m256& t_max, const __m256& active) noexcept {
+    __m256 occluded = global::zeros;
+    for (const Plane& plane : planes) {
+      const __m256 t_vals = plane_hit(rays, plane, t_max);
+      occluded = _mm256_or_ps(occluded, _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ));
+    }
+    return _mm256_and_ps(occluded, active);
+  }
+} // namespace
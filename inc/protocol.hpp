@@ -0,0 +1,41 @@
+#pragma once
+#include "types.hpp"
+#include <cstdint>
+
+// Messages between a RenderMode::daemon server and its clients, over a Unix domain or TCP
+// socket (see net.hpp). Each request gets exactly one reply, in order.
+//
+// Tiles come back as 8 bit RGB pixels, row after row. Local clients can send a shared memory
+// fd along with a render request (as SCM_RIGHTS ancillary data), which the server writes the
+// pixels into before replying. Without one, the pixels follow an ok reply on the socket.
+namespace protocol {
+  constexpr uint32_t version = 1;
+
+  enum class RequestKind : uint32_t {
+    render,
+    shutdown, // stops the server once it has replied
+  };
+
+  enum class Status : uint32_t {
+    ok,
+    bad_request, // wrong version or kind, or a tile that isn't valid_tile()
+    bad_buffer,  // no fd, or one too small to hold the tile
+  };
+
+  struct Request {
+    uint32_t version;
+    RequestKind kind;
+    float cam_origin[3];
+    // Part of the server's image to render, which has its compiled in size. Has to line up
+    // with 32 pixel columns and pairs of rows.
+    Tile tile;
+    uint32_t sample_groups; // 8 samples per pixel each
+  };
+
+  struct Reply {
+    Status status;
+    uint32_t samples_per_pixel = 0;
+    float render_ms = 0.f; // from receiving the request to the pixels being in place
+    uint64_t rays = 0;
+  };
+} // namespace protocol
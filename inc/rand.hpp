@@ -1,14 +1,78 @@
 #pragma once
 #include "comptime.hpp"
+#include "globals.hpp"
+#include "vec.hpp"
+#include <immintrin.h>
+
+namespace {
+  // Maps u in [0, 1) to the point at angle 2 * pi * u on the unit circle, returned as
+  // (cos, sin). The angle within a quadrant goes through polynomials that are only accurate
+  // on [0, pi/2], and the quadrant is applied afterwards with swaps and sign flips.
+  [[gnu::always_inline]] inline void unit_circle_256(const __m256& u, __m256& cos,
+                                                     __m256& sin) noexcept {
+    constexpr float half_pi = 1.57079633f;
+    const __m256 quarters = u * _mm256_set1_ps(4.f);
+    const __m256 quadrant = _mm256_floor_ps(quarters);
+    const __m256 angle = (quarters - quadrant) * _mm256_set1_ps(half_pi);
+    const __m256 angle_2 = angle * angle;
+
+    // taylor series out to x^9 / x^10, worst case error is ~4e-6 at pi/2
+    __m256 sin_poly = _mm256_set1_ps(1.f / 362880.f);
+    sin_poly = _mm256_fmadd_ps(sin_poly, angle_2, _mm256_set1_ps(-1.f / 5040.f));
+    sin_poly = _mm256_fmadd_ps(sin_poly, angle_2, _mm256_set1_ps(1.f / 120.f));
+    sin_poly = _mm256_fmadd_ps(sin_poly, angle_2, _mm256_set1_ps(-1.f / 6.f));
+    sin_poly = _mm256_fmadd_ps(sin_poly, angle_2, global::ones);
+    const __m256 base_sin = sin_poly * angle;
+
+    __m256 cos_poly = _mm256_set1_ps(-1.f / 3628800.f);
+    cos_poly = _mm256_fmadd_ps(cos_poly, angle_2, _mm256_set1_ps(1.f / 40320.f));
+    cos_poly = _mm256_fmadd_ps(cos_poly, angle_2, _mm256_set1_ps(-1.f / 720.f));
+    cos_poly = _mm256_fmadd_ps(cos_poly, angle_2, _mm256_set1_ps(1.f / 24.f));
+    cos_poly = _mm256_fmadd_ps(cos_poly, angle_2, _mm256_set1_ps(-0.5f));
+    const __m256 base_cos = _mm256_fmadd_ps(cos_poly, angle_2, global::ones);
+
+    // rotating by quadrant * 90 degrees: odd quadrants swap cos and sin, quadrants 1 and 2
+    // negate cos, and quadrants 2 and 3 negate sin.
+    const __m256i q = _mm256_cvttps_epi32(quadrant);
+    const __m256 odd = (__m256)_mm256_slli_epi32(q, 31);
+    const __m256i q_plus_1 = _mm256_add_epi32(q, _mm256_set1_epi32(1));
+    const __m256 sign_bit = (__m256)_mm256_set1_epi32(static_cast<int>(0x80000000));
+    const __m256 cos_sign = _mm256_and_ps((__m256)_mm256_slli_epi32(q_plus_1, 30), sign_bit);
+    const __m256 sin_sign = _mm256_and_ps((__m256)_mm256_slli_epi32(q, 30), sign_bit);
+
+    cos = _mm256_xor_ps(_mm256_blendv_ps(base_cos, base_sin, odd), cos_sign);
+    sin = _mm256_xor_ps(_mm256_blendv_ps(base_sin, base_cos, odd), sin_sign);
+  }
+
+  // maps (u, v) in [0, 1)^2 uniformly onto the unit sphere
+  [[nodiscard, gnu::always_inline]] inline Vec3_256 unit_sphere_256(const __m256& u,
+                                                                    const __m256& v) noexcept {
+    const __m256 z = _mm256_fnmadd_ps(u, _mm256_set1_ps(2.f), global::ones);
+    const __m256 r = _mm256_sqrt_ps(_mm256_max_ps(global::ones - z * z, global::zeros));
+    __m256 cos, sin;
+    unit_circle_256(v, cos, sin);
+    return Vec3_256{r * cos, r * sin, z};
+  }
+} // namespace
 
 class LCGRand {
 public:
+  LCGRand() = default;
+  // Starts the scalar stream at `seed`. Every instance has its own scalar stream, so several
+  // threads can each draw from their own. The vector stream is shared.
+  explicit LCGRand(const uint32_t seed) : rseed(seed & RAND_MAX) {}
+
+  // uniformly distributed on the unit sphere, so adding it to a normal gives a cosine
+  // weighted direction
   [[nodiscard, gnu::always_inline]] inline Vec3_256 random_unit_vec() {
-    Vec3_256 rand_vec = rand_vec_in_cube();
-    rand_vec.normalize();
-    return rand_vec;
+    return unit_sphere_256(rand_in_range_256(0.f, 1.f), rand_in_range_256(0.f, 1.f));
   };
 
+  // uniformly distributed point on the unit circle, returned as (cos, sin) of a random angle.
+  [[gnu::always_inline]] inline void random_unit_circle(__m256& cos, __m256& sin) {
+    unit_circle_256(rand_in_range_256(0.f, 1.f), cos, sin);
+  }
+
   [[nodiscard, gnu::always_inline]] inline float rand_in_range(const float min, const float max) {
     const float scale = static_cast<float>(lcg_rand()) * rcp_rand_max;
     const float f = min + scale * (max - min);
@@ -30,23 +94,12 @@ public:
 
 private:
   static inline __m256i rseed_vec = comptime::init_rseed_arr();
-  static inline uint32_t rseed = 0;
+  uint32_t rseed = 0;
   const __m256i r_a = _mm256_set1_epi32(static_cast<int>(11035152453));
   const __m256i r_b = _mm256_set1_epi32(12345u);
   const __m256i rand_max_vec = _mm256_set1_epi32(RAND_MAX);
   static constexpr float rcp_rand_max = 1.f / static_cast<float>(RAND_MAX);
 
-  [[nodiscard, gnu::always_inline]] inline Vec3_256 rand_vec_in_cube() {
-    constexpr float min = -1.0;
-    constexpr float max = 1.0;
-
-    return Vec3_256{
-        rand_in_range_256(min, max),
-        rand_in_range_256(min, max),
-        rand_in_range_256(min, max),
-    };
-  }
-
   [[nodiscard, gnu::always_inline]] inline __m256i lcg_rand_256() {
     rseed_vec = _mm256_mullo_epi32(rseed_vec, r_a);
     rseed_vec = _mm256_add_epi32(rseed_vec, r_b);
@@ -59,3 +112,7 @@ private:
     return rseed = (rseed * 1103515245 + 12345) & RAND_MAX;
   }
 };
+
+namespace {
+  LCGRand lcg_rand; // TODO Is it thread_local?
+} // namespace
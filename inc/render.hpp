@@ -1,17 +1,27 @@
 #pragma once
 #include "comptime.hpp"
+#include "counters.hpp"
+#include "env_map.hpp"
+#include "framebuffer.hpp"
 #include "globals.hpp"
+#include "lights.hpp"
 #include "materials.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
 #include "sphere.hpp"
+#include "trace.hpp"
 #include "types.hpp"
 #include "vec.hpp"
-#include <SDL2/SDL.h>
+#include "visibility_cache.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <immintrin.h>
 #include <limits>
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb_image_write.h>
+#include <span>
 
 namespace {
   [[gnu::always_inline]] inline void
@@ -25,62 +35,165 @@ namespace {
     curr_colors *= ((new_colors & update_mask) + preserve_curr);
   }
 
-  [[gnu::always_inline]] inline Color_256 ray_cluster_colors(RayCluster& rays) {
-    // will be used to add a sky tint to rays that at some point bounce off into space.
-    // if a ray never bounces away (within amount of bounces set by depth), the
-    // hit_mask will be all set (packed floats) and the sky tint will not affect its final color
-    __m256 no_hit_mask = global::zeros;
-
-    HitRecords hit_rec;
-    hit_rec.front_face = global::zeros;
-
-    Color_256 colors{
+  // first_hit is only written to when the denoiser is enabled. Every ray traced (bounces and
+  // shadow rays) is added to ray_count. With a `cached` slot, the camera rays' hits are read
+  // from it if `hits_cached`, and stored into it otherwise.
+  [[gnu::always_inline]] inline Color_256 ray_cluster_colors(RayCluster& rays,
+                                                             FirstHit_256& first_hit,
+                                                             Sampler& sampler,
+                                                             uint64_t& ray_count,
+                                                             CachedHits* const cached = nullptr,
+                                                             const bool hits_cached = false) {
+    // lanes that are still bouncing around the scene. A lane retires once it escapes into
+    // the sky or lands on a light.
+    __m256 active = (__m256)global::all_set;
+
+    // zeroed since lanes that miss everything keep whatever was here before
+    HitRecords hit_rec{};
+
+    // light gathered so far, and how much of the next bounce's light will make it back
+    Color_256 radiance{
+        global::zeros,
+        global::zeros,
+        global::zeros,
+    };
+    Color_256 throughput{
         global::ones,
         global::ones,
         global::ones,
     };
 
+    // lanes whose last bounce was off a lambertian surface, which means the light they
+    // might hit next was also sampled directly and needs an MIS weight.
+    __m256 prev_lambertian = global::zeros;
+    Vec3_256 prev_orig = rays.orig;
+    __m256 prev_bsdf_pdf = global::zeros;
+
+    const __m256i emissive_type = _mm256_load_si256((__m256i*)emissive_types);
+    const __m256i lambertian_type = _mm256_load_si256((__m256i*)lambertian_types);
+
     for (unsigned i = 0; i < config::ray_depth; i++) {
+      sampler.start_bounce(i);
+
+      if (i == 0 && hits_cached) {
+        load_cached_hits(hit_rec, *cached, rays);
+      } else {
+        ray_count += static_cast<uint64_t>(__builtin_popcount(_mm256_movemask_ps(active)));
+        find_closest_hits(hit_rec, rays, std::numeric_limits<float>::max(), active);
+        if (i == 0 && cached != nullptr) {
+          store_cached_hits(*cached, hit_rec);
+        }
+      }
+
+      const __m256 new_hit_mask =
+          _mm256_and_ps(_mm256_cmp_ps(hit_rec.t, global::zeros, _CMP_NLE_US), active);
+      const __m256 new_no_hit_mask = _mm256_andnot_ps(new_hit_mask, active);
+
+      if constexpr (global::env_lighting) {
+        if (!_mm256_testz_ps(new_no_hit_mask, new_no_hit_mask)) {
+          // like emission, what diffuse bounces find was also sampled directly by sample_env()
+          __m256 weight = global::ones;
+          const __m256 weighted_loc = _mm256_and_ps(new_no_hit_mask, prev_lambertian);
+          if (!_mm256_testz_ps(weighted_loc, weighted_loc)) {
+            weight = _mm256_blendv_ps(weight, mis_weight(prev_bsdf_pdf, env_pdf(rays.dir)),
+                                      weighted_loc);
+          }
+          radiance += throughput * env_radiance(rays.dir) * weight & new_no_hit_mask;
+        }
+      } else {
+        radiance += throughput * background_color & new_no_hit_mask;
+      }
+      active = new_hit_mask;
+
+      // one gather per parameter for the whole cluster. Lanes that missed read material 0.
+      const __m256i mat_id = _mm256_and_si256(hit_rec.mat_id, (__m256i)active);
+      const Material_256 mat = gather_materials(mat_id);
+
+      const __m256 emissive_loc =
+          _mm256_and_ps((__m256)_mm256_cmpeq_epi32(mat.type, emissive_type), active);
+      if (!_mm256_testz_ps(emissive_loc, emissive_loc)) {
+        // camera rays and specular bounces can't sample lights, so they keep all the emission
+        __m256 weight = global::ones;
+        const __m256 weighted_loc = _mm256_and_ps(emissive_loc, prev_lambertian);
+        if (!_mm256_testz_ps(weighted_loc, weighted_loc)) {
+          weight = _mm256_blendv_ps(weight, emission_mis_weight(hit_rec, prev_orig, prev_bsdf_pdf),
+                                    weighted_loc);
+        }
+        radiance += throughput * gather_emission(mat_id) * _mm256_and_ps(weight, emissive_loc);
+        active = _mm256_andnot_ps(emissive_loc, active);
+      }
 
-      find_sphere_hits(hit_rec, rays, std::numeric_limits<float>::max());
+      if constexpr (config::denoise) {
+        if (i == 0) {
+          // lights and the sky have no texture to preserve, so leave them at an albedo of 1
+          const Color_256 ones{global::ones, global::ones, global::ones};
+          first_hit.albedo = ones.blend_vec256(mat.atten, active);
+          first_hit.norm = hit_rec.norm & new_hit_mask;
+          first_hit.depth = _mm256_and_ps(hit_rec.t, new_hit_mask);
+        }
+      }
+
+      if (_mm256_testz_ps(active, active)) {
+        break;
+      }
 
-      // or a mask when a value is not a hit, at any point.
-      // if all are zero, break
-      const __m256 new_hit_mask = _mm256_cmp_ps(hit_rec.t, global::zeros, _CMP_NLE_US);
-      const __m256 new_no_hit_mask = _mm256_xor_ps(new_hit_mask, (__m256)global::all_set);
+      const __m256 lambertian_loc =
+          _mm256_and_ps((__m256)_mm256_cmpeq_epi32(mat.type, lambertian_type), active);
+      if (!lights.empty() && !_mm256_testz_ps(lambertian_loc, lambertian_loc)) {
+        ray_count +=
+            static_cast<uint64_t>(__builtin_popcount(_mm256_movemask_ps(lambertian_loc)));
+        radiance += throughput * sample_lights(hit_rec, mat.atten, lambertian_loc, sampler);
+      }
+      if constexpr (global::env_lighting) {
+        if (!_mm256_testz_ps(lambertian_loc, lambertian_loc)) {
+          ray_count +=
+              static_cast<uint64_t>(__builtin_popcount(_mm256_movemask_ps(lambertian_loc)));
+          radiance += throughput * sample_env(hit_rec, mat.atten, lambertian_loc, sampler);
+        }
+      }
 
-      no_hit_mask = _mm256_or_ps(no_hit_mask, new_no_hit_mask);
-      if (_mm256_testz_ps(new_hit_mask, new_hit_mask)) {
-        update_colors(colors, background_color, no_hit_mask);
+      const __m256 absorbed = scatter(rays, hit_rec, mat, sampler);
+      active = _mm256_andnot_ps(absorbed, active);
+      if (_mm256_testz_ps(active, active)) {
         break;
       }
 
-      scatter(rays, hit_rec);
+      update_colors(throughput, mat.atten, active);
 
-      update_colors(colors, hit_rec.mat.atten, new_hit_mask);
+      // cosine weighted hemisphere sampling, so pdf = cos / pi. Lambertian directions can come
+      // out (nearly) zero too, which would be 0 * inf.
+      prev_lambertian = lambertian_loc;
+      prev_orig = hit_rec.orig;
+      const __m256 len_sq = _mm256_max_ps(rays.dir.dot(rays.dir),
+                                          _mm256_set1_ps(std::numeric_limits<float>::min()));
+      prev_bsdf_pdf = rays.dir.dot(hit_rec.norm) * _mm256_rsqrt_ps(len_sq) * global::rcp_pi_vec;
     }
 
-    return colors;
+    return radiance;
   };
 
-  // writes a color buffer of 32 Color values to an image buffer
-  // uses non temporal writes to avoid filling data cache
-  [[gnu::always_inline]] inline void write_out_color_buf(const Color* color_buf, CharColor* img_buf,
-                                                         uint32_t write_pos) {
-
-    const __m256 cm = _mm256_broadcast_ss(&global::color_multiplier);
-    const __m256 colors_1_f32 = _mm256_load_ps((float*)color_buf) * cm;
-    const __m256 colors_2_f32 = _mm256_load_ps((float*)(color_buf) + 8) * cm;
-    const __m256 colors_3_f32 = _mm256_load_ps((float*)(color_buf) + 16) * cm;
-    const __m256 colors_4_f32 = _mm256_load_ps((float*)(color_buf) + 24) * cm;
-    const __m256 colors_5_f32 = _mm256_load_ps((float*)(color_buf) + 32) * cm;
-    const __m256 colors_6_f32 = _mm256_load_ps((float*)(color_buf) + 40) * cm;
-    const __m256 colors_7_f32 = _mm256_load_ps((float*)(color_buf) + 48) * cm;
-    const __m256 colors_8_f32 = _mm256_load_ps((float*)(color_buf) + 56) * cm;
-    const __m256 colors_9_f32 = _mm256_load_ps((float*)(color_buf) + 64) * cm;
-    const __m256 colors_10_f32 = _mm256_load_ps((float*)(color_buf) + 72) * cm;
-    const __m256 colors_11_f32 = _mm256_load_ps((float*)(color_buf) + 80) * cm;
-    const __m256 colors_12_f32 = _mm256_load_ps((float*)(color_buf) + 88) * cm;
+  // the 96 bytes of 32 CharColor values, in order
+  struct PackedColors {
+    __m256i bytes[3];
+  };
+
+  // turns a color buffer of 32 Color values into 8 bit pixels
+  [[nodiscard, gnu::always_inline]] inline PackedColors
+  pack_color_buf(const Color* color_buf, const float color_multiplier) noexcept {
+
+    const __m256 cm = _mm256_broadcast_ss(&color_multiplier);
+    const __m256 colors_1_f32 = encode_output_256(_mm256_load_ps((float*)color_buf), cm);
+    const __m256 colors_2_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 8), cm);
+    const __m256 colors_3_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 16), cm);
+    const __m256 colors_4_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 24), cm);
+    const __m256 colors_5_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 32), cm);
+    const __m256 colors_6_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 40), cm);
+    const __m256 colors_7_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 48), cm);
+    const __m256 colors_8_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 56), cm);
+    const __m256 colors_9_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 64), cm);
+    const __m256 colors_10_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 72), cm);
+    const __m256 colors_11_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 80), cm);
+    const __m256 colors_12_f32 = encode_output_256(_mm256_load_ps((float*)(color_buf) + 88), cm);
 
     const __m256i colors_1_i32 = _mm256_cvtps_epi32(colors_1_f32);
     const __m256i colors_2_i32 = _mm256_cvtps_epi32(colors_2_f32);
@@ -140,6 +253,19 @@ namespace {
     __m256i colors_2_u8 = _mm256_packus_epi16(temp_permute_3, temp_permute_4);
     __m256i colors_3_u8 = _mm256_packus_epi16(temp_permute_5, temp_permute_6);
 
+    return PackedColors{{colors_1_u8, colors_2_u8, colors_3_u8}};
+  }
+
+  // writes a color buffer of 32 Color values to an image buffer
+  // uses non temporal writes to avoid filling data cache
+  [[gnu::always_inline]] inline void
+  write_out_color_buf(const Color* color_buf, CharColor* img_buf, uint32_t write_pos,
+                      const float color_multiplier = global::color_multiplier) {
+    const PackedColors packed = pack_color_buf(color_buf, color_multiplier);
+    const __m256i colors_1_u8 = packed.bytes[0];
+    const __m256i colors_2_u8 = packed.bytes[1];
+    const __m256i colors_3_u8 = packed.bytes[2];
+
     // SDL offsets our img pointer to a location that might not be aligned to 32 bytes.
     // Therefore we can't just stream from the registers to memory... :(
     write_pos *= 3;
@@ -165,75 +291,614 @@ namespace {
     }
   }
 
-  [[gnu::always_inline]] inline void render(CharColor* const img_buf, const Vec3 cam_origin,
-                                            const uint32_t pix_offset) noexcept {
+  // Traces sample groups [first_group, first_group + group_count) of one pixel and returns
+  // the sum of their radiance. With the denoiser on, the first hits are summed into aov_sum.
+  [[gnu::always_inline]] inline Color trace_pixel(const uint32_t row, const uint32_t col,
+                                                  const View& view,
+                                                  const uint32_t first_group,
+                                                  const uint32_t group_count,
+                                                  FirstHit_256& aov_sum,
+                                                  uint64_t& ray_count) noexcept {
     // comptime generated
     constexpr Vec3_256 base_dirs = comptime::init_ray_directions();
+    // top left corner of the viewport
+    constexpr float view_left = global::cam_origin[0] - global::viewport_width / 2;
+    constexpr float view_top = global::cam_origin[1] + global::viewport_height / 2;
+
     RayCluster base_rays = {
         .dir = base_dirs,
-        .orig = Vec3_256::broadcast_vec(cam_origin),
+        .orig = Vec3_256::broadcast_vec(view.origin),
     };
 
-    Color_256 sample_color;
-    alignas(32) Color color_buf[32];
+    Color_256 sample_color{global::zeros, global::zeros, global::zeros};
+    FirstHit_256 first_hit;
 
+    if constexpr (config::denoise) {
+      aov_sum = FirstHit_256{
+          .albedo = {global::zeros, global::zeros, global::zeros},
+          .norm = {global::zeros, global::zeros, global::zeros},
+          .depth = global::zeros,
+      };
+    }
+
+    for (uint32_t sample_group = first_group; sample_group < first_group + group_count;
+         sample_group++) {
+      RayCluster samples = base_rays;
+      Sampler sampler(row * config::img_width + col, sample_group * 8u);
+
+      if constexpr (config::low_discrepancy) {
+        __m256 u, v;
+        sampler.get_pixel_2d(u, v);
+        const float x_start = view_left + global::pix_du * static_cast<float>(col);
+        const float y_start = view_top + global::pix_dv * static_cast<float>(row);
+        samples.dir.x =
+            _mm256_fmadd_ps(u, _mm256_set1_ps(global::pix_du), _mm256_set1_ps(x_start));
+        samples.dir.y =
+            _mm256_fmadd_ps(v, _mm256_set1_ps(global::pix_dv), _mm256_set1_ps(y_start));
+      } else {
+        float x_scale = global::pix_du * static_cast<float>(col);
+        __m256 x_scale_vec = _mm256_broadcast_ss(&x_scale);
+        samples.dir.x = samples.dir.x + x_scale_vec;
+
+        // the grid only has sample_group_num rows
+        const uint32_t grid_row = sample_group % global::sample_group_num;
+        float y_scale = (global::pix_dv * static_cast<float>(row)) +
+                        (static_cast<float>(grid_row) * global::sample_dv);
+        __m256 y_scale_vec = _mm256_broadcast_ss(&y_scale);
+        samples.dir.y += y_scale_vec;
+      }
+      samples.dir = view.turn(samples.dir);
+
+      CachedHits* const cached =
+          cached_hits_slot(row * config::img_width + col, sample_group, 0, 1);
+      sample_color += ray_cluster_colors(samples, first_hit, sampler, ray_count, cached,
+                                         sample_group < visibility_cache.read_groups);
+
+      if constexpr (config::denoise) {
+        aov_sum.albedo += first_hit.albedo;
+        aov_sum.norm += first_hit.norm;
+        aov_sum.depth = _mm256_add_ps(aov_sum.depth, first_hit.depth);
+      }
+    }
+
+    // sum all 8 lanes of each channel. A chain of hadds would only sum within each 128 bit
+    // half, which throws away half the samples.
+    return Color{
+        .x = hsum_256(sample_color.x),
+        .y = hsum_256(sample_color.y),
+        .z = hsum_256(sample_color.z),
+    };
+  }
+
+  // Traces samples [first_group * 8, (first_group + group_count) * 8) of each pixel in the 4
+  // wide, 2 tall block whose top left pixel is (row, col). Lane i is pixel
+  // (row + i / 4, col + i % 4), and gets that pixel's sums, so nothing has to be added up
+  // across lanes. With the denoiser on, the first hits are summed into aov_sum.
+  [[gnu::always_inline]] inline Color_256 trace_quad(const uint32_t row, const uint32_t col,
+                                                     const View& view,
+                                                     const uint32_t first_group,
+                                                     const uint32_t group_count,
+                                                     FirstHit_256& aov_sum,
+                                                     uint64_t& ray_count) noexcept {
+    // top left corner of the viewport
+    constexpr float view_left = global::cam_origin[0] - global::viewport_width / 2;
+    constexpr float view_top = global::cam_origin[1] + global::viewport_height / 2;
+    constexpr float dir_z = global::cam_origin[2] - global::focal_len;
+    constexpr int width = config::img_width;
+
+    const __m256 lane_col = _mm256_setr_ps(0.f, 1.f, 2.f, 3.f, 0.f, 1.f, 2.f, 3.f);
+    const __m256 lane_row = _mm256_setr_ps(0.f, 0.f, 0.f, 0.f, 1.f, 1.f, 1.f, 1.f);
+    const __m256 pix_du = _mm256_set1_ps(global::pix_du);
+    const __m256 pix_dv = _mm256_set1_ps(global::pix_dv);
+
+    // where each lane's pixel starts on the viewport
+    const __m256 x_start = _mm256_fmadd_ps(lane_col + _mm256_set1_ps(static_cast<float>(col)),
+                                           pix_du, _mm256_set1_ps(view_left));
+    const __m256 y_start = _mm256_fmadd_ps(lane_row + _mm256_set1_ps(static_cast<float>(row)),
+                                           pix_dv, _mm256_set1_ps(view_top));
+    const __m256i pixels =
+        _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(row * config::img_width + col)),
+                         _mm256_setr_epi32(0, 1, 2, 3, width, width + 1, width + 2, width + 3));
+    const uint32_t quad = row / 2 * (config::img_width / 4) + col / 4;
+
+    const RayCluster base_rays = {
+        .dir = {x_start, y_start, _mm256_set1_ps(dir_z)},
+        .orig = Vec3_256::broadcast_vec(view.origin),
+    };
+
+    Color_256 sample_color{global::zeros, global::zeros, global::zeros};
+    FirstHit_256 first_hit;
+
+    if constexpr (config::denoise) {
+      aov_sum = FirstHit_256{
+          .albedo = {global::zeros, global::zeros, global::zeros},
+          .norm = {global::zeros, global::zeros, global::zeros},
+          .depth = global::zeros,
+      };
+    }
+
+    for (uint32_t sample = first_group * 8; sample < (first_group + group_count) * 8; sample++) {
+      RayCluster samples = base_rays;
+      Sampler sampler(pixels, sample);
+
+      __m256 u, v;
+      if constexpr (config::low_discrepancy) {
+        sampler.get_pixel_2d(u, v);
+      } else {
+        // the same 8 wide, sample_group_num tall grid the other layout uses
+        const uint32_t grid_row = (sample / 8) % global::sample_group_num;
+        u = _mm256_set1_ps(static_cast<float>(sample % 8 + 1) / 9.f);
+        v = _mm256_set1_ps(static_cast<float>(grid_row + 1) /
+                           static_cast<float>(global::sample_group_num + 1));
+      }
+      samples.dir.x = _mm256_fmadd_ps(u, pix_du, x_start);
+      samples.dir.y = _mm256_fmadd_ps(v, pix_dv, y_start);
+      samples.dir = view.turn(samples.dir);
+
+      CachedHits* const cached = cached_hits_slot(quad, sample / 8, sample % 8, 8);
+      sample_color += ray_cluster_colors(samples, first_hit, sampler, ray_count, cached,
+                                         sample / 8 < visibility_cache.read_groups);
+
+      if constexpr (config::denoise) {
+        aov_sum.albedo += first_hit.albedo;
+        aov_sum.norm += first_hit.norm;
+        aov_sum.depth = _mm256_add_ps(aov_sum.depth, first_hit.depth);
+      }
+    }
+
+    return sample_color;
+  }
+
+  // Previews trace one ray per preview_scale x preview_scale block of pixels, 8 of them at a
+  // time. Each cluster covers a block of preview_block_cols x 2 pixels.
+  constexpr uint32_t preview_lane_cols = 4 * config::preview_scale;
+  constexpr uint32_t preview_block_cols = preview_lane_cols * config::preview_scale;
+
+  // Cheap stand-in for trace_quad() while the camera moves: one ray through the middle of each
+  // lane's part of the preview block at (row, col), and no bounces. Lanes go row major. Surfaces
+  // get their albedo lit by the sky, all of it on the ones facing up and none on the ones
+  // facing down, or by the environment map in the direction they face. Emitters show their
+  // emission and misses the background.
+  [[gnu::always_inline]] inline Color_256 preview_cluster(const uint32_t row, const uint32_t col,
+                                                          const View& view) noexcept {
+    constexpr float view_left = global::cam_origin[0] - global::viewport_width / 2;
+    constexpr float view_top = global::cam_origin[1] + global::viewport_height / 2;
+    constexpr float dir_z = global::cam_origin[2] - global::focal_len;
+    constexpr float scale = config::preview_scale;
+
+    // where each lane's ray goes through its block, in pixels
+    alignas(32) float lane_col[8];
+    alignas(32) float lane_row[8];
+    for (uint32_t lane = 0; lane < 8; lane++) {
+      lane_col[lane] = (static_cast<float>(lane % preview_lane_cols) + 0.5f) * scale;
+      lane_row[lane] = (static_cast<float>(lane / preview_lane_cols) + 0.5f) * scale;
+    }
+
+    const RayCluster rays = {
+        .dir = view.turn({
+            _mm256_fmadd_ps(_mm256_load_ps(lane_col) + _mm256_set1_ps(static_cast<float>(col)),
+                            _mm256_set1_ps(global::pix_du), _mm256_set1_ps(view_left)),
+            _mm256_fmadd_ps(_mm256_load_ps(lane_row) + _mm256_set1_ps(static_cast<float>(row)),
+                            _mm256_set1_ps(global::pix_dv), _mm256_set1_ps(view_top)),
+            _mm256_set1_ps(dir_z),
+        }),
+        .orig = Vec3_256::broadcast_vec(view.origin),
+    };
+
+    HitRecords hit_rec{};
+    find_closest_hits(hit_rec, rays, std::numeric_limits<float>::max(),
+                      (__m256)global::all_set);
+    const __m256 hit_mask = _mm256_cmp_ps(hit_rec.t, global::zeros, _CMP_NLE_US);
+
+    const __m256i mat_id = _mm256_and_si256(hit_rec.mat_id, (__m256i)hit_mask);
+    const Material_256 mat = gather_materials(mat_id);
+    Color_256 color;
+    if constexpr (global::env_lighting) {
+      color = mat.atten * env_radiance(hit_rec.norm);
+    } else {
+      const __m256 sky_light = _mm256_fmadd_ps(hit_rec.norm.y, _mm256_set1_ps(0.5f),
+                                               _mm256_set1_ps(0.5f));
+      color = mat.atten * sky_light;
+    }
+
+    const __m256i emissive_type = _mm256_load_si256((__m256i*)emissive_types);
+    const __m256 emissive_loc =
+        _mm256_and_ps((__m256)_mm256_cmpeq_epi32(mat.type, emissive_type), hit_mask);
+    if (!_mm256_testz_ps(emissive_loc, emissive_loc)) {
+      color = color.blend_vec256(gather_emission(mat_id), emissive_loc);
+    }
+    const Color_256 background = [&rays] {
+      if constexpr (global::env_lighting) {
+        return env_radiance(rays.dir);
+      } else {
+        return background_color;
+      }
+    }();
+    return color.blend_vec256(background, _mm256_xor_ps(hit_mask, (__m256)global::all_set));
+  }
+
+  template <PacketLayout layout>
+  constexpr uint32_t packet_rows = layout == PacketLayout::pixel_quads ? 2 : 1;
+  template <PacketLayout layout>
+  constexpr uint32_t packet_cols = layout == PacketLayout::pixel_quads ? 4 : 1;
+
+  // Traces the packet of pixels whose top left pixel is (row, col) and writes each pixel's sums
+  // to `sums`, row major.
+  template <PacketLayout layout>
+  [[gnu::always_inline]] inline void
+  trace_packet(const uint32_t row, const uint32_t col, const View& view,
+               const uint32_t first_group, const uint32_t group_count,
+               PixelSum (&sums)[packet_rows<layout> * packet_cols<layout>],
+               uint64_t& ray_count) noexcept {
+    FirstHit_256 aov_sum;
+
+    if constexpr (layout == PacketLayout::pixel_samples) {
+      sums[0].color =
+          trace_pixel(row, col, view, first_group, group_count, aov_sum, ray_count);
+      if constexpr (config::denoise) {
+        sums[0].albedo = {hsum_256(aov_sum.albedo.x), hsum_256(aov_sum.albedo.y),
+                          hsum_256(aov_sum.albedo.z)};
+        sums[0].norm = {hsum_256(aov_sum.norm.x), hsum_256(aov_sum.norm.y),
+                        hsum_256(aov_sum.norm.z)};
+        sums[0].depth = hsum_256(aov_sum.depth);
+      }
+    } else {
+      const Color_256 color =
+          trace_quad(row, col, view, first_group, group_count, aov_sum, ray_count);
+
+      // lanes are already in the same order as `sums`
+      alignas(32) float lanes[10][8];
+      const auto store = [&lanes](const unsigned plane, const Vec3_256& vec) {
+        _mm256_store_ps(lanes[plane], vec.x);
+        _mm256_store_ps(lanes[plane + 1], vec.y);
+        _mm256_store_ps(lanes[plane + 2], vec.z);
+      };
+      store(0, color);
+      if constexpr (config::denoise) {
+        store(3, aov_sum.albedo);
+        store(6, aov_sum.norm);
+        _mm256_store_ps(lanes[9], aov_sum.depth);
+      }
+
+      for (unsigned lane = 0; lane < 8; lane++) {
+        sums[lane].color = {lanes[0][lane], lanes[1][lane], lanes[2][lane]};
+        if constexpr (config::denoise) {
+          sums[lane].albedo = {lanes[3][lane], lanes[4][lane], lanes[5][lane]};
+          sums[lane].norm = {lanes[6][lane], lanes[7][lane], lanes[8][lane]};
+          sums[lane].depth = lanes[9][lane];
+        }
+      }
+    }
+  }
+
+  constexpr Tile full_frame{
+      .x = 0,
+      .y = 0,
+      .width = config::img_width,
+      .height = config::img_height,
+  };
+
+  // Tiles have to line up with the 32 pixel chunks the image is written out in, and with
+  // pixel quads.
+  [[nodiscard]] constexpr bool valid_tile(const Tile& tile) noexcept {
+    return tile.width > 0 && tile.height > 0 && tile.x % 32 == 0 && tile.width % 32 == 0 &&
+           tile.y % 2 == 0 && tile.height % 2 == 0 && tile.x + tile.width <= config::img_width &&
+           tile.y + tile.height <= config::img_height;
+  }
+
+  // Traces the pixels of `tile` in the packets whose top row is `row`, and calls
+  // fn(row, col, pixel_sum) for each of them. Pixels of a packet come in row major order.
+  template <PacketLayout layout, typename Fn>
+  [[gnu::always_inline]] inline void
+  trace_packet_row(const uint32_t row, const Tile& tile, const View& view,
+                   const uint32_t first_group, const uint32_t group_count, uint64_t& ray_count,
+                   const Fn& fn) noexcept {
+    constexpr uint32_t rows = packet_rows<layout>;
+    constexpr uint32_t cols = packet_cols<layout>;
+
+    for (uint32_t col = tile.x; col < tile.x + tile.width; col += cols) {
+      PixelSum sums[rows * cols];
+      trace_packet<layout>(row, col, view, first_group, group_count, sums, ray_count);
+      for (uint32_t packet_row = 0; packet_row < rows; packet_row++) {
+        for (uint32_t packet_col = 0; packet_col < cols; packet_col++) {
+          fn(row + packet_row, col + packet_col, sums[packet_row * cols + packet_col]);
+        }
+      }
+    }
+  }
+
+  // Traces every pixel of `tile` in this worker's rows a packet at a time, and calls
+  // fn(row, col, pixel_sum) for each of them. Pixels of a packet come in row major order.
+  template <PacketLayout layout, typename Fn>
+  [[gnu::always_inline]] inline void
+  trace_worker_rows(const unsigned worker, const Tile& tile, const View& view,
+                    const uint32_t first_group, const uint32_t group_count, uint64_t& ray_count,
+                    const Fn& fn) noexcept {
+    const counters::Scope counting(counters::Stage::trace);
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      // the rest of a packet's rows are traced along with its first one
+      if (row < tile.y || row >= tile.y + tile.height || row % packet_rows<layout> != 0) {
+        return;
+      }
+      const trace::Span span("row", "row", row);
+      trace_packet_row<layout>(row, tile, view, first_group, group_count, ray_count, fn);
+    });
+  }
+
+  // Renders the rows of `tile` that belong to `worker` with `group_count` sample groups per
+  // pixel, straight into the 8 bit image `img_buf`. It only holds the tile's pixels, row after
+  // row. The rays traced are added to ray_count.
+  template <PacketLayout layout = config::packet_layout>
+  inline void render_tile(CharColor* const img_buf, const Tile tile, const View view,
+                          const uint32_t group_count, const unsigned worker,
+                          uint64_t& ray_count) noexcept {
+    // one row of 32 pixels for every row a packet covers
+    alignas(32) Color color_buf[packet_rows<layout>][32];
+
+    const uint32_t write_chunk_size = tile.width / 32;
+    const float color_multiplier = 255.f / static_cast<float>(group_count * 8);
+    uint64_t worker_rays = 0;
+
+    trace_worker_rows<layout>(
+        worker, tile, view, 0, group_count, worker_rays,
+        [&](const uint32_t row, const uint32_t col, const PixelSum& pixel_sum) {
+          const uint32_t tile_col = col - tile.x;
+          Color* const row_buf = color_buf[row % packet_rows<layout>];
+          row_buf[tile_col % 32] = pixel_sum.color;
+          if (tile_col % 32 == 31) {
+            write_out_color_buf(row_buf, img_buf,
+                                (row - tile.y) * write_chunk_size + tile_col / 32,
+                                color_multiplier);
+          }
+        });
+
+    ray_count += worker_rays;
+  }
+
+  // renders every row that belongs to `worker`, see for_each_worker_row()
+  template <PacketLayout layout = config::packet_layout>
+  inline void render(CharColor* const img_buf, const FrameBuffers frame, const View view,
+                     const unsigned worker) noexcept {
+    uint64_t ray_count = 0; // nobody asks for it in this mode
+
+    if constexpr (!config::denoise) {
+      render_tile<layout>(img_buf, full_frame, view, global::sample_group_num, worker,
+                          ray_count);
+      return;
+    }
+
+    // the denoiser needs the whole frame, so hand it averages instead of writing out 8 bit
+    // colors as we go.
+    constexpr float rcp_sample_count = 1.f / (global::sample_group_num * 8);
+    trace_worker_rows<layout>(
+        worker, full_frame, view, 0, global::sample_group_num, ray_count,
+        [&](const uint32_t row, const uint32_t col, const PixelSum& pixel_sum) {
+          const uint32_t pix = row * config::img_width + col;
+          frame.color[pix] = Color{
+              .x = pixel_sum.color.x * rcp_sample_count,
+              .y = pixel_sum.color.y * rcp_sample_count,
+              .z = pixel_sum.color.z * rcp_sample_count,
+          };
+          frame.albedo[pix] = Color{
+              .x = pixel_sum.albedo.x * rcp_sample_count,
+              .y = pixel_sum.albedo.y * rcp_sample_count,
+              .z = pixel_sum.albedo.z * rcp_sample_count,
+          };
+          frame.norm[pix] = Vec3{
+              .x = pixel_sum.norm.x * rcp_sample_count,
+              .y = pixel_sum.norm.y * rcp_sample_count,
+              .z = pixel_sum.norm.z * rcp_sample_count,
+          };
+          frame.depth[pix] = pixel_sum.depth * rcp_sample_count;
+        });
+  }
+
+  // Renders this worker's rows with preview_cluster(), straight into the 8 bit image
+  // `img_buf`. Takes one ray per preview_scale x preview_scale pixels instead of render()'s
+  // sample_group_num * 8 paths per pixel, which is what real-time mode shows while the camera
+  // moves.
+  inline void render_preview(CharColor* const img_buf, const View view,
+                             const unsigned worker) noexcept {
+    const counters::Scope counting(counters::Stage::preview);
     constexpr uint32_t write_chunk_size = config::img_width / 32;
-    uint32_t row = pix_offset / config::img_width;
-    uint32_t write_pos = row * write_chunk_size;
-    uint16_t color_buf_idx = 0;
-    uint16_t sample_group;
-
-    for (; row < config::img_height; row += config::thread_count) {
-      for (uint32_t col = 0; col < config::img_width; col++) {
-        sample_color.x = _mm256_setzero_ps();
-        sample_color.y = _mm256_setzero_ps();
-        sample_color.z = _mm256_setzero_ps();
-
-        for (sample_group = 0; sample_group < global::sample_group_num; sample_group++) {
-          RayCluster samples = base_rays;
-
-          float x_scale = global::pix_du * static_cast<float>(col);
-          __m256 x_scale_vec = _mm256_broadcast_ss(&x_scale);
-          samples.dir.x = samples.dir.x + x_scale_vec;
-
-          float y_scale =
-              (global::pix_dv * static_cast<float>(row)) + (sample_group * global::sample_dv);
-          __m256 y_scale_vec = _mm256_broadcast_ss(&y_scale);
-          samples.dir.y += y_scale_vec;
-
-          sample_color += ray_cluster_colors(samples);
+    // the two rows of 32 pixels the blocks are filling in
+    alignas(32) Color color_buf[2][32];
+
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      // blocks cover this row and the next one, which always belongs to the same worker
+      if (row % 2 != 0) {
+        return;
+      }
+      const trace::Span span("preview row", "row", row);
+
+      for (uint32_t col = 0; col < config::img_width; col += preview_block_cols) {
+        alignas(32) float lanes[3][8];
+        const Color_256 color = preview_cluster(row, col, view);
+        _mm256_store_ps(lanes[0], color.x);
+        _mm256_store_ps(lanes[1], color.y);
+        _mm256_store_ps(lanes[2], color.z);
+        for (uint32_t block_row = 0; block_row < 2; block_row++) {
+          for (uint32_t block_col = 0; block_col < preview_block_cols; block_col++) {
+            const uint32_t lane = block_row / config::preview_scale * preview_lane_cols +
+                                  block_col / config::preview_scale;
+            color_buf[block_row][col % 32 + block_col] = {lanes[0][lane], lanes[1][lane],
+                                                          lanes[2][lane]};
+          }
+        }
+
+        if ((col + preview_block_cols) % 32 == 0) {
+          const uint32_t write_pos = row * write_chunk_size + col / 32;
+          write_out_color_buf(color_buf[0], img_buf, write_pos, 255.f);
+          write_out_color_buf(color_buf[1], img_buf, write_pos + write_chunk_size, 255.f);
         }
+      }
+    });
+  }
 
-        // accumulate all color channels into first float of vec
-        sample_color.x = _mm256_hadd_ps(sample_color.x, sample_color.x);
-        sample_color.x = _mm256_hadd_ps(sample_color.x, sample_color.x);
-        sample_color.x = _mm256_hadd_ps(sample_color.x, sample_color.x);
+  // adds what one pass traced for the pixel at (row, col) onto the running sums in `sums`,
+  // where rcp_pass_samples is 1 over the pass's samples per pixel
+  [[gnu::always_inline]] inline void add_pixel_sum(const FrameBuffers& sums, const uint32_t row,
+                                                   const uint32_t col, const PixelSum& pixel_sum,
+                                                   const float rcp_pass_samples) noexcept {
+    const uint32_t pix = row * config::img_width + col;
+    sums.color[pix].x += pixel_sum.color.x;
+    sums.color[pix].y += pixel_sum.color.y;
+    sums.color[pix].z += pixel_sum.color.z;
+
+    if constexpr (global::track_noise) {
+      const float pass_lum = luminance(pixel_sum.color) * rcp_pass_samples;
+      sums.lum_sq[pix] += pass_lum * pass_lum;
+    }
 
-        sample_color.y = _mm256_hadd_ps(sample_color.y, sample_color.y);
-        sample_color.y = _mm256_hadd_ps(sample_color.y, sample_color.y);
-        sample_color.y = _mm256_hadd_ps(sample_color.y, sample_color.y);
+    if constexpr (config::denoise) {
+      sums.albedo[pix].x += pixel_sum.albedo.x;
+      sums.albedo[pix].y += pixel_sum.albedo.y;
+      sums.albedo[pix].z += pixel_sum.albedo.z;
+      sums.norm[pix].x += pixel_sum.norm.x;
+      sums.norm[pix].y += pixel_sum.norm.y;
+      sums.norm[pix].z += pixel_sum.norm.z;
+      sums.depth[pix] += pixel_sum.depth;
+    }
+  }
 
-        sample_color.z = _mm256_hadd_ps(sample_color.z, sample_color.z);
-        sample_color.z = _mm256_hadd_ps(sample_color.z, sample_color.z);
-        sample_color.z = _mm256_hadd_ps(sample_color.z, sample_color.z);
+  // Adds sample groups [first_group, first_group + group_count) of every pixel in this
+  // worker's rows onto the running sums in `sums`. Its buffers hold sums rather than averages
+  // until resolve_frame() is called. The rays it traced are added to ray_count.
+  template <PacketLayout layout = config::packet_layout>
+  inline void accumulate_samples(const FrameBuffers sums, const View view,
+                                 const uint32_t first_group, const uint32_t group_count,
+                                 const unsigned worker, uint64_t& ray_count) noexcept {
+    uint64_t worker_rays = 0;
+    const float rcp_pass_samples = 1.f / static_cast<float>(group_count * 8);
+
+    trace_worker_rows<layout>(
+        worker, full_frame, view, first_group, group_count, worker_rays,
+        [&](const uint32_t row, const uint32_t col, const PixelSum& pixel_sum) {
+          add_pixel_sum(sums, row, col, pixel_sum, rcp_pass_samples);
+        });
+
+    ray_count += worker_rays;
+  }
 
-        _mm_store_ss(&color_buf[color_buf_idx].x, _mm256_castps256_ps128(sample_color.x));
-        _mm_store_ss(&color_buf[color_buf_idx].y, _mm256_castps256_ps128(sample_color.y));
-        _mm_store_ss(&color_buf[color_buf_idx].z, _mm256_castps256_ps128(sample_color.z));
+  // accumulate_samples() for several views at once, each onto its own sums in `view_sums`.
+  // Every packet row is traced for all the views before moving on to the next one, so the
+  // views share the parts of the scene and the BVH that row needs while they're in cache. No
+  // rays or hits are shared though, so this only costs about 0.91x of tracing the views apart.
+  template <PacketLayout layout = config::packet_layout>
+  inline void accumulate_views(const std::span<const FrameBuffers> view_sums,
+                               const std::span<const View> views, const uint32_t first_group,
+                               const uint32_t group_count, const unsigned worker,
+                               uint64_t& ray_count) noexcept {
+    const counters::Scope counting(counters::Stage::trace);
+    uint64_t worker_rays = 0;
+    const float rcp_pass_samples = 1.f / static_cast<float>(group_count * 8);
+
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      if (row % packet_rows<layout> != 0) {
+        return;
+      }
+      const trace::Span span("row", "row", row);
+      for (size_t view = 0; view < views.size(); view++) {
+        trace_packet_row<layout>(
+            row, full_frame, views[view], first_group, group_count, worker_rays,
+            [&](const uint32_t pix_row, const uint32_t col, const PixelSum& pixel_sum) {
+              add_pixel_sum(view_sums[view], pix_row, col, pixel_sum, rcp_pass_samples);
+            });
+      }
+    });
 
-        color_buf_idx++;
+    ray_count += worker_rays;
+  }
 
-        if (color_buf_idx != 32) {
-          continue;
+  // Sums up the standard error of each pixel's mean luminance over this worker's rows, from
+  // how much the `pass_count` passes accumulated so far differ from each other. Every pass has
+  // to have added `pass_groups` sample groups.
+  [[nodiscard]] inline double sum_noise(const FrameBuffers sums, const uint32_t pass_count,
+                                        const uint32_t pass_groups,
+                                        const unsigned worker) noexcept {
+    const float n = static_cast<float>(pass_count);
+    const float rcp_pass_samples = 1.f / static_cast<float>(pass_groups * 8);
+    double noise = 0.0;
+
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      float row_noise = 0.f;
+      for (uint32_t pix = row * config::img_width; pix < (row + 1) * config::img_width; pix++) {
+        // sum of the passes' mean luminances
+        const float lum_sum = luminance(sums.color[pix]) * rcp_pass_samples;
+        // variance of one pass's mean, divided by n again for the variance of the overall mean
+        const float var = (sums.lum_sq[pix] - lum_sum * lum_sum / n) / (n - 1.f);
+        row_noise += std::sqrt(std::max(var, 0.f) / n);
+      }
+      noise += row_noise;
+    });
+    return noise;
+  }
+
+  // turns accumulated sums of `group_count` sample groups into per pixel averages
+  inline void resolve_frame(const FrameBuffers frame, const uint32_t group_count,
+                            const unsigned worker) noexcept {
+    const counters::Scope counting(counters::Stage::resolve);
+    const float rcp_sample_count = 1.f / static_cast<float>(group_count * 8);
+    const auto scale = [rcp_sample_count](Vec3& vec) {
+      vec.x *= rcp_sample_count;
+      vec.y *= rcp_sample_count;
+      vec.z *= rcp_sample_count;
+    };
+
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      for (uint32_t pix = row * config::img_width; pix < (row + 1) * config::img_width; pix++) {
+        scale(frame.color[pix]);
+        if constexpr (config::denoise) {
+          scale(frame.albedo[pix]);
+          scale(frame.norm[pix]);
+          frame.depth[pix] *= rcp_sample_count;
         }
+      }
+    });
+  }
 
-        write_out_color_buf(color_buf, img_buf, write_pos);
-        write_pos++;
+  // writes the float frame out to the 8 bit image, for the rows this worker rendered
+  inline void write_out_frame(CharColor* const img_buf, const FrameBuffers frame,
+                              const unsigned worker) noexcept {
+    const counters::Scope counting(counters::Stage::write_out);
+    constexpr uint32_t write_chunk_size = config::img_width / 32;
 
-        color_buf_idx = 0;
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      for (uint32_t chunk = 0; chunk < write_chunk_size; chunk++) {
+        const uint32_t write_pos = row * write_chunk_size + chunk;
+        write_out_color_buf(frame.color + write_pos * 32, img_buf, write_pos, 255.f);
       }
-      write_pos += ((config::thread_count - 1) * write_chunk_size);
-    }
+    });
+  }
+
+  // write_out_frame() into an 8 bit RGB image that starts at `pixels` and has `stride` bytes
+  // between the starts of its rows, so rows can sit anywhere in someone else's memory. Plain
+  // unaligned stores, since whoever owns the image is about to read it.
+  inline void write_out_frame_strided(uint8_t* const pixels, const size_t stride,
+                                      const FrameBuffers frame, const unsigned worker) noexcept {
+    const counters::Scope counting(counters::Stage::write_out);
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      uint8_t* const dst = pixels + row * stride;
+      for (uint32_t col = 0; col < config::img_width; col += 32) {
+        const PackedColors packed =
+            pack_color_buf(frame.color + row * config::img_width + col, 255.f);
+        for (int i = 0; i < 3; i++) {
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + col * 3) + i, packed.bytes[i]);
+        }
+      }
+    });
+  }
+
+  // copies the float frame's averaged, linear radiance into an RGB float image that starts at
+  // `pixels` and has `stride` bytes between the starts of its rows
+  inline void copy_out_frame_strided(float* const pixels, const size_t stride,
+                                     const FrameBuffers frame, const unsigned worker) noexcept {
+    const counters::Scope counting(counters::Stage::write_out);
+    static_assert(sizeof(Color) == 3 * sizeof(float), "Rows are copied straight from memory.");
+    for_each_worker_row(worker, [&](const uint32_t row) {
+      std::memcpy(reinterpret_cast<uint8_t*>(pixels) + row * stride,
+                  frame.color + row * config::img_width, config::img_width * sizeof(Color));
+    });
   }
 
 } // namespace
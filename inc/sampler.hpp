@@ -0,0 +1,189 @@
+#pragma once
+#include "globals.hpp"
+#include "rand.hpp"
+#include <array>
+#include <cstdint>
+#include <immintrin.h>
+
+// Owen scrambled Sobol points, generated 8 sample indices at a time (Burley 2020, "Practical
+// Hash-based Owen Scrambling"). Only the first two Sobol dimensions are used. Every pattern
+// (pixel position, light choice, bounce direction, ...) gets them with its own shuffle of the
+// sample indices and its own scramble, which keeps each 2D pattern well stratified without
+// needing high dimensional Sobol direction numbers.
+namespace sobol {
+  consteval std::array<uint32_t, 32> init_dim_1_directions() {
+    std::array<uint32_t, 32> dirs;
+    dirs[0] = 1u << 31;
+    for (size_t bit = 1; bit < 32; bit++) {
+      dirs[bit] = dirs[bit - 1] ^ (dirs[bit - 1] >> 1);
+    }
+    return dirs;
+  }
+
+  alignas(32) constexpr std::array<uint32_t, 32> dim_1_directions = init_dim_1_directions();
+
+  // lowbias32 by Chris Wellons
+  [[nodiscard, gnu::always_inline]] constexpr uint32_t hash(uint32_t x) noexcept {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+  }
+
+  [[nodiscard, gnu::always_inline]] inline __m256i hash_256(__m256i x) noexcept {
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(0x7feb352d));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+    x = _mm256_mullo_epi32(x, _mm256_set1_epi32(static_cast<int>(0x846ca68bu)));
+    x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+    return x;
+  }
+
+  [[nodiscard, gnu::always_inline]] inline __m256i hash_combine_256(const __m256i& seed,
+                                                                    const uint32_t v) noexcept {
+    const __m256i mixed = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(v + 0x9e3779b9u)),
+                         _mm256_slli_epi32(seed, 6)),
+        _mm256_srli_epi32(seed, 2));
+    return _mm256_xor_si256(seed, mixed);
+  }
+
+  [[nodiscard, gnu::always_inline]] inline __m256i reverse_bits_256(const __m256i& x) noexcept {
+    const __m256i byte_reverse = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14,
+                                                  13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8,
+                                                  15, 14, 13, 12);
+    const __m256i nibble_reverse = _mm256_setr_epi8(0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3,
+                                                    11, 7, 15, 0, 8, 4, 12, 2, 10, 6, 14, 1, 9,
+                                                    5, 13, 3, 11, 7, 15);
+    const __m256i low_nibbles = _mm256_set1_epi8(0x0f);
+
+    const __m256i bytes = _mm256_shuffle_epi8(x, byte_reverse);
+    const __m256i low = _mm256_and_si256(bytes, low_nibbles);
+    const __m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_nibbles);
+    return _mm256_or_si256(_mm256_slli_epi16(_mm256_shuffle_epi8(nibble_reverse, low), 4),
+                           _mm256_shuffle_epi8(nibble_reverse, high));
+  }
+
+  // Laine-Karras style permutation, with the constants from Burley's paper. Each bit only
+  // depends on the bits below it, which is what makes it an Owen scramble once the bits are
+  // reversed. Each lane has its own seed.
+  [[nodiscard, gnu::always_inline]] inline __m256i laine_karras_256(__m256i x,
+                                                                    const __m256i& seed) noexcept {
+    x = _mm256_xor_si256(x, _mm256_mullo_epi32(x, _mm256_set1_epi32(0x3d20adea)));
+    x = _mm256_add_epi32(x, seed);
+    x = _mm256_mullo_epi32(
+        x, _mm256_or_si256(_mm256_srli_epi32(seed, 16), _mm256_set1_epi32(1)));
+    x = _mm256_xor_si256(x, _mm256_mullo_epi32(x, _mm256_set1_epi32(0x05526c56)));
+    x = _mm256_xor_si256(x, _mm256_mullo_epi32(x, _mm256_set1_epi32(0x53a22864)));
+    return x;
+  }
+
+  [[nodiscard, gnu::always_inline]] inline __m256i
+  nested_uniform_scramble_256(const __m256i& x, const __m256i& seed) noexcept {
+    return reverse_bits_256(laine_karras_256(reverse_bits_256(x), seed));
+  }
+
+  [[nodiscard, gnu::always_inline]] inline __m256i dim_1_256(const __m256i& index) noexcept {
+    __m256i result = _mm256_setzero_si256();
+    for (unsigned bit = 0; bit < 32; bit++) {
+      const __m256i set = _mm256_slli_epi32(_mm256_srli_epi32(index, static_cast<int>(bit)), 31);
+      const __m256i dir = _mm256_set1_epi32(static_cast<int>(dim_1_directions[bit]));
+      result = _mm256_xor_si256(result, _mm256_and_si256(_mm256_srai_epi32(set, 31), dir));
+    }
+    return result;
+  }
+
+  // top 24 bits as a float in [0, 1)
+  [[nodiscard, gnu::always_inline]] inline __m256 to_unit_float_256(const __m256i& x) noexcept {
+    constexpr float rcp_2_24 = 1.f / 16777216.f;
+    return _mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8)) * _mm256_set1_ps(rcp_2_24);
+  }
+} // namespace sobol
+
+// The patterns a path draws from. Each bounce has its own set, so the first diffuse bounce
+// of every sample in a pixel is stratified against the others, and so on down the path.
+namespace sample_dim {
+  constexpr uint32_t pixel = 0;
+  constexpr uint32_t first_bounce = 1;
+
+  // offsets from a bounce's first pattern
+  constexpr uint32_t light_pick = 0;
+  constexpr uint32_t light_cone = 1;
+  constexpr uint32_t scatter = 2;
+  constexpr uint32_t fresnel = 3;
+  constexpr uint32_t env_dir = 4; // only drawn with global::env_lighting
+  constexpr uint32_t per_bounce = global::env_lighting ? 5 : 4;
+} // namespace sample_dim
+
+// Hands out the random numbers for one cluster of paths. Lanes are either consecutive samples
+// of the same pixel's sequence, or the same sample of 8 different pixels' sequences, depending
+// on config::packet_layout. Without config::low_discrepancy everything comes from lcg_rand.
+class Sampler {
+public:
+  // lanes take samples first_index to first_index + 7 of the pixel's sequence
+  [[gnu::always_inline]] inline Sampler(const uint32_t pixel, const uint32_t first_index) noexcept
+      : index(_mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(first_index)),
+                               _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))),
+        pixel_seed(_mm256_set1_epi32(static_cast<int>(sobol::hash(pixel)))) {}
+
+  // each lane takes sample `index` of its own pixel's sequence
+  [[gnu::always_inline]] inline Sampler(const __m256i& pixels, const uint32_t index) noexcept
+      : index(_mm256_set1_epi32(static_cast<int>(index))), pixel_seed(sobol::hash_256(pixels)) {}
+
+  [[gnu::always_inline]] inline void start_bounce(const unsigned bounce) noexcept {
+    bounce_dim = sample_dim::first_bounce + bounce * sample_dim::per_bounce;
+  }
+
+  // position inside the pixel, both in [0, 1)
+  [[gnu::always_inline]] inline void get_pixel_2d(__m256& u, __m256& v) noexcept {
+    pattern_2d(sample_dim::pixel, u, v);
+  }
+
+  // `dim` is one of sample_dim's bounce offsets
+  [[nodiscard, gnu::always_inline]] inline __m256 get_1d(const uint32_t dim) noexcept {
+    if constexpr (!config::low_discrepancy) {
+      return lcg_rand.rand_in_range_256(0.f, 1.f);
+    }
+
+    // the first Sobol dimension is just the bit reversed index
+    const __m256i seed = pattern_seed(bounce_dim + dim);
+    const __m256i shuffled = sobol::nested_uniform_scramble_256(index, seed);
+    const __m256i x = sobol::nested_uniform_scramble_256(sobol::reverse_bits_256(shuffled),
+                                                         sobol::hash_combine_256(seed, 1));
+    return sobol::to_unit_float_256(x);
+  }
+
+  [[gnu::always_inline]] inline void get_2d(const uint32_t dim, __m256& u, __m256& v) noexcept {
+    pattern_2d(bounce_dim + dim, u, v);
+  }
+
+private:
+  __m256i index;
+  __m256i pixel_seed;
+  uint32_t bounce_dim = sample_dim::first_bounce;
+
+  [[nodiscard, gnu::always_inline]] inline __m256i
+  pattern_seed(const uint32_t pattern) const noexcept {
+    return sobol::hash_256(sobol::hash_combine_256(pixel_seed, pattern));
+  }
+
+  [[gnu::always_inline]] inline void pattern_2d(const uint32_t pattern, __m256& u,
+                                                __m256& v) noexcept {
+    if constexpr (!config::low_discrepancy) {
+      u = lcg_rand.rand_in_range_256(0.f, 1.f);
+      v = lcg_rand.rand_in_range_256(0.f, 1.f);
+      return;
+    }
+
+    const __m256i seed = pattern_seed(pattern);
+    const __m256i shuffled = sobol::nested_uniform_scramble_256(index, seed);
+    const __m256i x = sobol::nested_uniform_scramble_256(sobol::reverse_bits_256(shuffled),
+                                                         sobol::hash_combine_256(seed, 1));
+    const __m256i y = sobol::nested_uniform_scramble_256(sobol::dim_1_256(shuffled),
+                                                         sobol::hash_combine_256(seed, 2));
+    u = sobol::to_unit_float_256(x);
+    v = sobol::to_unit_float_256(y);
+  }
+};
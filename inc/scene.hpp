@@ -0,0 +1,74 @@
+#pragma once
+#include "instance.hpp"
+#include "mesh.hpp"
+#include "plane.hpp"
+#include "sphere.hpp"
+#include "types.hpp"
+#include "visibility_cache.hpp"
+#include "workers.hpp"
+#include <immintrin.h>
+
+namespace {
+  // must be called before init_lights()
+  inline void init_scene() {
+    materials = MaterialTable{};
+    init_spheres();
+    init_planes();
+    init_meshes();
+    init_instances();
+    invalidate_visibility_cache();
+  }
+
+  // Per frame hook for real-time mode. Moves everything that's animated to where it is `time`
+  // seconds in and refits the sphere BVH around it, splitting the leaves across the workers.
+  // Lights have to be updated separately afterwards.
+  inline void update_scene(const float time) {
+    const size_t node_count = sphere_bvh.nodes.size();
+    run_on_workers([node_count, time](const unsigned worker) {
+      const size_t begin = node_count * worker / worker_count();
+      const size_t end = node_count * (worker + 1) / worker_count();
+      sphere_bvh.refit_leaves(
+          [time](const uint32_t i) {
+            move_sphere(i, time);
+            return sphere_box(spheres[i]);
+          },
+          begin, end);
+    });
+    sphere_bvh.refit_inner();
+    build_sphere_proxies();
+    invalidate_visibility_cache();
+  }
+
+  // closest hit across every kind of primitive. Like find_sphere_hits, only lanes in `active`
+  // are guaranteed correct.
+  [[gnu::always_inline]] inline void find_closest_hits(HitRecords& hit_rec, const RayCluster& rays,
+                                                       const float t_max,
+                                                       const __m256& active) noexcept {
+    hit_rec.t = global::zeros;
+    // the ground is cheap and usually close, which lets the BVHs skip everything behind it
+    find_plane_hits(hit_rec, rays, t_max);
+    find_sphere_hits(hit_rec, rays, t_max, active);
+    find_mesh_hits(hit_rec, rays, t_max, active);
+    find_instance_hits(hit_rec, rays, t_max, active);
+  }
+
+  // lanes in `active` whose ray hits anything in the scene before its own t_max
+  [[nodiscard, gnu::always_inline]] inline __m256
+  find_occlusion(const RayCluster& rays, const __m256& t_max, const __m256& active) noexcept {
+    __m256 occluded = find_plane_occlusion(rays, t_max, active);
+    if (_mm256_testc_ps(occluded, active)) {
+      return occluded;
+    }
+    occluded = _mm256_or_ps(occluded, find_sphere_occlusion(rays, t_max, active));
+    if (_mm256_testc_ps(occluded, active)) {
+      return occluded;
+    }
+    occluded = _mm256_or_ps(occluded,
+                            find_mesh_occlusion(rays, t_max, _mm256_andnot_ps(occluded, active)));
+    if (_mm256_testc_ps(occluded, active)) {
+      return occluded;
+    }
+    return _mm256_or_ps(occluded,
+                        find_instance_occlusion(rays, t_max, _mm256_andnot_ps(occluded, active)));
+  }
+} // namespace
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+// Keeps built scene data (primitives in BVH leaf order, BVH nodes, ...) in a file so the next
+// run can map it instead of generating and building it again. The file is a list of raw
+// sections, tagged with a key that the caller derives from everything that went into the
+// scene, and a checksum over the sections. Sections are mapped copy-on-write, so they can be
+// used in place and still be changed (e.g. by animation) without touching the file.
+class SceneCache {
+public:
+  explicit SceneCache(std::string path);
+  ~SceneCache();
+  SceneCache(const SceneCache&) = delete;
+  SceneCache& operator=(const SceneCache&) = delete;
+
+  // Maps the file if it was saved with the same key and section count and isn't corrupted.
+  // Returns false (and prints why, unless there's simply no file) otherwise.
+  bool map(uint64_t key, size_t section_count);
+
+  // Section i of the mapped file. Stays valid for as long as the cache does.
+  template <typename T> [[nodiscard]] std::span<T> section(const size_t i) const {
+    const std::span<std::byte> bytes = raw_section(i);
+    return {reinterpret_cast<T*>(bytes.data()), bytes.size() / sizeof(T)};
+  }
+
+  // Writes `sections` out under `key`, replacing any older file through a rename.
+  bool save(uint64_t key, const std::vector<std::span<const std::byte>>& sections) const;
+
+private:
+  std::string path;
+  void* mapping = nullptr;
+  size_t mapping_size = 0;
+
+  [[nodiscard]] std::span<std::byte> raw_section(size_t i) const;
+  void unmap();
+};
@@ -0,0 +1,27 @@
+#pragma once
+#include "types.hpp"
+#include <cstdint>
+#include <future>
+#include <string>
+#include <vector>
+
+// Writes the image a png render has so far, while the workers keep going with the next pass.
+// Like the checkpoints, each snapshot is written next to `path` and renamed over it, so image
+// viewers watching the file never catch it half written.
+class Snapshotter {
+public:
+  explicit Snapshotter(std::string path);
+  ~Snapshotter();
+
+  // copies the color sums of `groups_done` sample groups out of `frame` and turns them into a
+  // png on a background thread. Waits for the previous snapshot first.
+  void save_async(const FrameBuffers& frame, uint32_t groups_done);
+
+  // blocks until the last save_async() is done. Returns false if it failed.
+  bool wait();
+
+private:
+  std::string path;
+  std::vector<Color> snapshot;
+  std::future<bool> pending;
+};
@@ -1,78 +1,501 @@
 #pragma once
+#include "bvh.hpp"
+#include "frustum.hpp"
+#include "hash.hpp"
 #include "materials.hpp"
 #include "rand.hpp"
+#include "sampler.hpp"
+#include "scene_cache.hpp"
 #include "types.hpp"
 #include "vec.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
 #include <cstdlib>
 #include <cwctype>
 #include <immintrin.h>
 #include <limits>
+#include <span>
+#include <utility>
 #include <vector>
 
 struct alignas(32) Sphere {
   Vec3 center;
-  Material mat;
+  uint32_t mat_id;
   float r;
 };
 
-struct SphereCluster {
-  Vec3_256 center;
-  Material_256 mat;
-  __m256 r;
+enum class Motion {
+  none,
+  bounce, // hops up and down off the ground
+  orbit,  // circles the y axis
+};
+
+// how a sphere moves in real-time mode, as a function of the seconds since startup
+struct SphereMotion {
+  Motion kind;
+  Vec3 base; // center at time 0
+  float height;
+  float speed; // radians per second
+  float phase;
+};
+
+// Stands in for every sphere under a node of sphere_bvh once config::sphere_lod finds the node
+// too small on screen to be worth traversing: a sphere around all of them that rays only stop
+// at with the odds they'd have hit one of them.
+struct alignas(32) SphereProxy {
+  Vec3 center;
+  float r;        // 0 for nodes that can't be merged, the ones with a light under them
+  float coverage; // the spheres' cross sections over the proxy's, at most 1
+  uint32_t first; // the spheres under the node are [first, end) of `spheres`
+  uint32_t end;
+  uint32_t pad;
 };
 
 // TODO make this more dynamic like in the original rt in a weekend
-static std::vector<Sphere> spheres;
+// Kept in the leaf order of sphere_bvh, sphere_motions runs parallel to it. Both point into
+// owned_spheres and owned_motions when the scene was built, or into sphere_cache when it was
+// mapped from config::scene_cache_path.
+static std::span<Sphere> spheres;
+static std::span<SphereMotion> sphere_motions;
+static Bvh sphere_bvh;
+static std::vector<Sphere> owned_spheres;
+static std::vector<SphereMotion> owned_motions;
+static SceneCache sphere_cache{config::scene_cache_path};
+// for config::sphere_lod, one proxy per node of sphere_bvh, and the running sum of r^2 over
+// `spheres` with a 0 in front, which proxies pick their material by
+static std::vector<SphereProxy> sphere_proxies;
+static std::vector<float> sphere_area_cdf;
+
+// Bump this whenever init_spheres() would come up with a different scene in a way that
+// sphere_cache_key() can't see from single spheres, e.g. a new order, so old caches of it get
+// rebuilt.
+constexpr uint64_t sphere_generator_version = 2;
 
 namespace {
-  [[gnu::always_inline]] inline void init_spheres() noexcept {
-    spheres.reserve(488);
-    spheres = {
-        {{.center = {.x = -1.f, .y = 1.f, .z = -2.5f}, .mat = red_lambertian, .r = 1.f},
-         {.center = {.x = 0.f, .y = 1.f, .z = 0.f}, .mat = glass, .r = 1.f},
-         {.center = {.x = 1.f, .y = 1.f, .z = 2.5f}, .mat = copper_metallic, .r = 1.f},
-         {.center = {.x = 0.f, .y = -1000.f, .z = 0.f}, .mat = silver_lambertian, .r = 1000.f}},
+  [[nodiscard, gnu::always_inline]] inline Aabb sphere_box(const Sphere& sphere) noexcept {
+    return Aabb{
+        .min = {sphere.center.x - sphere.r, sphere.center.y - sphere.r,
+                sphere.center.z - sphere.r},
+        .max = {sphere.center.x + sphere.r, sphere.center.y + sphere.r,
+                sphere.center.z + sphere.r},
+    };
+  }
+
+  // how `sphere` moves, drawing from `motion_rand` if it bounces
+  [[nodiscard]] inline SphereMotion sphere_motion(const Sphere& sphere, const bool emissive,
+                                                  LCGRand& motion_rand) {
+    SphereMotion motion{
+        .kind = Motion::none, .base = sphere.center, .height = 0.f, .speed = 0.f, .phase = 0.f};
+    if (emissive) {
+      motion.kind = Motion::orbit;
+      motion.speed = 0.3f;
+    } else if (sphere.r < 0.5f) {
+      motion.kind = Motion::bounce;
+      motion.height = motion_rand.rand_in_range(0.2f, 1.f);
+      motion.speed = motion_rand.rand_in_range(1.f, 4.f);
+      motion.phase = motion_rand.rand_in_range(0.f, global::pi);
+    }
+    return motion;
+  }
+
+  // the small spheres bounce and the light circles the scene. Uses its own generator so the
+  // scene itself looks the same with or without animation.
+  inline void init_sphere_motions() {
+    owned_motions.assign(owned_spheres.size(), SphereMotion{.kind = Motion::none,
+                                                            .base = {},
+                                                            .height = 0.f,
+                                                            .speed = 0.f,
+                                                            .phase = 0.f});
+    if constexpr (!config::animate) {
+      return;
+    }
+
+    LCGRand motion_rand(sobol::hash(config::scene_seed + 1));
+    for (size_t i = 0; i < owned_spheres.size(); i++) {
+      const bool emissive = materials.type[owned_spheres[i].mat_id] == MatType::emissive;
+      owned_motions[i] = sphere_motion(owned_spheres[i], emissive, motion_rand);
+    }
+  }
+
+  // builds sphere_bvh and reorders spheres (and their motions) into its leaf order
+  inline void build_sphere_bvh() {
+    std::vector<Aabb> boxes(owned_spheres.size());
+    for (size_t i = 0; i < owned_spheres.size(); i++) {
+      boxes[i] = sphere_box(owned_spheres[i]);
+    }
+
+    sphere_bvh.build(boxes);
+
+    std::vector<Sphere> sorted_spheres(owned_spheres.size());
+    std::vector<SphereMotion> sorted_motions(owned_spheres.size());
+    for (size_t i = 0; i < owned_spheres.size(); i++) {
+      sorted_spheres[i] = owned_spheres[sphere_bvh.prim_order[i]];
+      sorted_motions[i] = owned_motions[sphere_bvh.prim_order[i]];
+    }
+    owned_spheres = std::move(sorted_spheres);
+    owned_motions = std::move(sorted_motions);
+    spheres = owned_spheres;
+    sphere_motions = owned_motions;
+  }
+
+  // Fits a proxy around every node of sphere_bvh, children before their parents. Has to be
+  // called again whenever the spheres or the BVH change.
+  inline void build_sphere_proxies() {
+    if constexpr (!config::sphere_lod) {
+      return;
+    }
+
+    sphere_area_cdf.resize(spheres.size() + 1);
+    sphere_area_cdf[0] = 0.f;
+    double area_sum = 0.0;
+    for (size_t i = 0; i < spheres.size(); i++) {
+      area_sum += static_cast<double>(spheres[i].r) * spheres[i].r;
+      sphere_area_cdf[i + 1] = static_cast<float>(area_sum);
+    }
+
+    const auto distance = [](const Vec3& a, const Vec3& b) {
+      const Vec3 d{a.x - b.x, a.y - b.y, a.z - b.z};
+      return std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
     };
-    LCGRand lcg_rand;
-    for (int a = -11; a < 11; a++) {
-      for (int b = -11; b < 11; b++) {
-        float choose_mat = lcg_rand.rand_in_range(0, 1);
-        Vec3 center = {
-            .x = static_cast<float>(a) + lcg_rand.rand_in_range(0, 1),
-            .y = 0.2f,
-            .z = static_cast<float>(b) + 0.9f * lcg_rand.rand_in_range(0, 1),
-        };
-        if (choose_mat < 0.3) {
-          // diffuse
-          Color albedo = {
-              .x = lcg_rand.rand_in_range(0, 1),
-              .y = lcg_rand.rand_in_range(0, 1),
-              .z = lcg_rand.rand_in_range(0, 1),
-          };
-          Material new_mat = {.atten = albedo, .type = MatType::lambertian};
-          spheres.push_back(Sphere{.center = center, .mat = new_mat, .r = 0.2f});
-        } else if (choose_mat < 0.7) {
-          // metal
-          Color albedo = {
-              .x = lcg_rand.rand_in_range(0.5, 1),
-              .y = lcg_rand.rand_in_range(0.5, 1),
-              .z = lcg_rand.rand_in_range(0.5, 1),
-          };
-          Material new_mat = {.atten = albedo, .type = MatType::metallic};
-          spheres.push_back(Sphere{.center = center, .mat = new_mat, .r = 0.2f});
-        } else {
-          // glass
-          Material new_mat = {.atten = white, .type = MatType::dielectric};
-          spheres.push_back(Sphere{.center = center, .mat = new_mat, .r = 0.2f});
+
+    sphere_proxies.resize(sphere_bvh.nodes.size());
+    for (size_t n = sphere_bvh.nodes.size(); n-- > 0;) {
+      const BvhNode& node = sphere_bvh.nodes[n];
+      SphereProxy& proxy = sphere_proxies[n];
+      proxy.center = Vec3{(node.min.x + node.max.x) / 2, (node.min.y + node.max.y) / 2,
+                          (node.min.z + node.max.z) / 2};
+      proxy.r = 0.f;
+
+      bool mergeable = true;
+      if (node.count != 0) {
+        proxy.first = node.first;
+        proxy.end = node.first + node.count;
+        for (uint32_t i = proxy.first; i < proxy.end; i++) {
+          proxy.r = std::max(proxy.r, distance(spheres[i].center, proxy.center) + spheres[i].r);
+          mergeable = mergeable && materials.type[spheres[i].mat_id] != MatType::emissive;
+        }
+      } else {
+        // subtrees cover neighbouring ranges of the leaf order
+        const SphereProxy& left = sphere_proxies[node.first];
+        const SphereProxy& right = sphere_proxies[node.first + 1];
+        proxy.first = left.first;
+        proxy.end = right.end;
+        for (const SphereProxy* child : {&left, &right}) {
+          proxy.r = std::max(proxy.r, distance(child->center, proxy.center) + child->r);
+          mergeable = mergeable && child->r > 0.f;
         }
       }
+
+      const float area = sphere_area_cdf[proxy.end] - sphere_area_cdf[proxy.first];
+      proxy.coverage = std::min(area / (proxy.r * proxy.r), 1.f);
+      if (!mergeable) {
+        proxy.r = 0.f;
+      }
+    }
+  }
+
+  // moves sphere i to where it is `time` seconds in
+  [[gnu::always_inline]] inline void move_sphere(const size_t i, const float time) noexcept {
+    const SphereMotion& motion = sphere_motions[i];
+    switch (motion.kind) {
+    case Motion::none:
+      break;
+    case Motion::bounce:
+      spheres[i].center.y =
+          motion.base.y + motion.height * std::abs(std::sin(motion.speed * time + motion.phase));
+      break;
+    case Motion::orbit: {
+      const float angle = motion.speed * time + motion.phase;
+      const float cos_a = std::cos(angle);
+      const float sin_a = std::sin(angle);
+      spheres[i].center.x = motion.base.x * cos_a - motion.base.z * sin_a;
+      spheres[i].center.z = motion.base.x * sin_a + motion.base.z * cos_a;
+      break;
+    }
+    }
+  }
+
+  // a generated sphere along with the material it gets once the spheres are in their final order
+  struct NewSphere {
+    Sphere sphere;
+    Material mat;
+  };
+
+  // the few big spheres and the light, in front of the field
+  constexpr std::array<NewSphere, 4> fixed_spheres{{
+      {.sphere = {.center = {.x = -1.f, .y = 1.f, .z = -2.5f}, .mat_id = 0, .r = 1.f},
+       .mat = red_lambertian},
+      {.sphere = {.center = {.x = 0.f, .y = 1.f, .z = 0.f}, .mat_id = 0, .r = 1.f},
+       .mat = glass},
+      {.sphere = {.center = {.x = 1.f, .y = 1.f, .z = 2.5f}, .mat_id = 0, .r = 1.f},
+       .mat = copper_metallic},
+      {.sphere = {.center = {.x = 3.f, .y = 4.f, .z = -4.f}, .mat_id = 0, .r = 0.3f},
+       .mat = moon_emissive},
+  }};
+
+  // One random sphere for the cell at `row` and `col` of the field. Each cell draws from its
+  // own stream, seeded from the scene seed and the cell, so the field comes out the same
+  // however the cells are split between threads.
+  [[nodiscard]] inline NewSphere field_sphere(const uint32_t row, const uint32_t col) {
+    constexpr uint32_t side = 2 * config::sphere_field_size;
+    constexpr int half_side = static_cast<int>(config::sphere_field_size);
+    const float a = static_cast<float>(static_cast<int>(row) - half_side);
+    const float b = static_cast<float>(static_cast<int>(col) - half_side);
+    LCGRand cell_rand(sobol::hash((row * side + col) ^ sobol::hash(config::scene_seed)));
+
+    const float choose_mat = cell_rand.rand_in_range(0, 1);
+    const Vec3 center = {
+        .x = a + cell_rand.rand_in_range(0, 1),
+        .y = 0.2f,
+        .z = b + 0.9f * cell_rand.rand_in_range(0, 1),
+    };
+    Material mat;
+    if (choose_mat < 0.3) {
+      // diffuse
+      const Color albedo = {
+          .x = cell_rand.rand_in_range(0, 1),
+          .y = cell_rand.rand_in_range(0, 1),
+          .z = cell_rand.rand_in_range(0, 1),
+      };
+      mat = {.atten = albedo, .type = MatType::lambertian};
+    } else if (choose_mat < 0.7) {
+      // metal
+      const Color albedo = {
+          .x = cell_rand.rand_in_range(0.5, 1),
+          .y = cell_rand.rand_in_range(0.5, 1),
+          .z = cell_rand.rand_in_range(0.5, 1),
+      };
+      mat = {.atten = albedo, .type = MatType::metallic};
+    } else {
+      // glass
+      mat = {.atten = white, .type = MatType::dielectric};
+    }
+    return NewSphere{.sphere = {.center = center, .mat_id = 0, .r = 0.2f}, .mat = mat};
+  }
+
+  // Spreads the low 10 bits of v out to every third bit.
+  [[nodiscard]] constexpr uint32_t spread_bits(uint32_t v) noexcept {
+    v &= 0x3ffu;
+    v = (v | (v << 16)) & 0x030000ffu;
+    v = (v | (v << 8)) & 0x0300f00fu;
+    v = (v | (v << 4)) & 0x030c30c3u;
+    v = (v | (v << 2)) & 0x09249249u;
+    return v;
+  }
+
+  // Sorts keys by the 30 bit Morton codes in their top half, 10 bits (a level of the curve) per
+  // counting pass. Much faster than std::sort on millions of keys.
+  inline void radix_sort_morton(std::vector<uint64_t>& keys) {
+    constexpr unsigned digit_bits = 10;
+    constexpr uint64_t digit_mask = (1u << digit_bits) - 1;
+    std::vector<uint64_t> scratch(keys.size());
+    for (unsigned shift = 32; shift < 32 + 3 * digit_bits; shift += digit_bits) {
+      std::array<size_t, 1u << digit_bits> offsets{};
+      for (const uint64_t key : keys) {
+        offsets[(key >> shift) & digit_mask]++;
+      }
+      size_t sum = 0;
+      for (size_t& offset : offsets) {
+        sum += std::exchange(offset, sum);
+      }
+      for (const uint64_t key : keys) {
+        scratch[offsets[(key >> shift) & digit_mask]++] = key;
+      }
+      keys.swap(scratch);
+    }
+  }
+
+  // The order that walks a Morton curve through the spheres' bounds, as indices into
+  // `new_spheres` in the low half of each value.
+  [[nodiscard]] inline std::vector<uint64_t>
+  morton_order(const std::vector<NewSphere>& new_spheres) {
+    const size_t count = new_spheres.size();
+    const Vec3& first_center = new_spheres[0].sphere.center;
+    Aabb bounds{.min = first_center, .max = first_center};
+    for (const NewSphere& new_sphere : new_spheres) {
+      const Vec3& center = new_sphere.sphere.center;
+      bounds = merge(bounds, Aabb{.min = center, .max = center});
+    }
+    const auto cell_scale = [](const float min, const float max) {
+      return max > min ? 1023.f / (max - min) : 0.f;
+    };
+    const Vec3 scale{cell_scale(bounds.min.x, bounds.max.x),
+                     cell_scale(bounds.min.y, bounds.max.y),
+                     cell_scale(bounds.min.z, bounds.max.z)};
+
+    // Morton code in the high half, index in the low half, so sorting them sorts the indices
+    std::vector<uint64_t> keys(count);
+    run_on_workers([&](const unsigned worker) {
+      const size_t end = count * (worker + 1) / worker_count();
+      for (size_t i = count * worker / worker_count(); i < end; i++) {
+        const Vec3& center = new_spheres[i].sphere.center;
+        const uint32_t code =
+            spread_bits(static_cast<uint32_t>((center.x - bounds.min.x) * scale.x)) |
+            spread_bits(static_cast<uint32_t>((center.y - bounds.min.y) * scale.y)) << 1 |
+            spread_bits(static_cast<uint32_t>((center.z - bounds.min.z) * scale.z)) << 2;
+        keys[i] = uint64_t{code} << 32 | i;
+      }
+    });
+    radix_sort_morton(keys);
+    return keys;
+  }
+
+  // The few big spheres and the light, then a field of small random ones generated on every
+  // worker at once. They end up in owned_spheres along a Morton curve, so spheres that are
+  // close in space are close in memory, each with its own material numbered in the same
+  // order. That keeps material gathers for nearby hits in nearby cache lines, even after the
+  // BVH shuffles the spheres into its leaf order.
+  inline void generate_spheres() {
+    std::vector<NewSphere> new_spheres(fixed_spheres.begin(), fixed_spheres.end());
+
+    constexpr uint32_t side = 2 * config::sphere_field_size;
+    const size_t first = new_spheres.size();
+    new_spheres.resize(first + size_t{side} * side);
+    run_on_workers([&new_spheres, first](const unsigned worker) {
+      const uint32_t end_row = side * (worker + 1) / worker_count();
+      for (uint32_t row = side * worker / worker_count(); row < end_row; row++) {
+        for (uint32_t col = 0; col < side; col++) {
+          new_spheres[first + size_t{row} * side + col] = field_sphere(row, col);
+        }
+      }
+    });
+
+    const std::vector<uint64_t> order = morton_order(new_spheres);
+    const size_t count = new_spheres.size();
+    const uint32_t first_mat = static_cast<uint32_t>(materials.size());
+    owned_spheres.resize(count);
+    materials.resize(first_mat + count);
+    run_on_workers([&](const unsigned worker) {
+      const size_t end = count * (worker + 1) / worker_count();
+      for (size_t i = count * worker / worker_count(); i < end; i++) {
+        const NewSphere& new_sphere = new_spheres[static_cast<uint32_t>(order[i])];
+        const uint32_t mat_id = first_mat + static_cast<uint32_t>(i);
+        owned_spheres[i] = new_sphere.sphere;
+        owned_spheres[i].mat_id = mat_id;
+        materials.set(mat_id, new_sphere.mat);
+      }
+    });
+  }
+
+  // Everything the cached sphere scene depends on. Rather than trusting a version number to
+  // be bumped, this generates the fixed spheres and a sample of field cells, along with their
+  // motions, and hashes what comes out. Edits to the generator, the material presets or
+  // LCGRand change the key that way. sphere_generator_version is left for changes that don't
+  // show up in single spheres, like the order they're stored in. Layout changes to what's in
+  // the cache count too, since it's mapped as is.
+  [[nodiscard]] inline uint64_t sphere_cache_key() {
+    constexpr uint32_t side = 2 * config::sphere_field_size;
+    constexpr uint32_t probe_cells = 64;
+
+    uint64_t key = hash_words({
+        sphere_generator_version, config::sphere_field_size, config::scene_seed,
+        config::animate,          sizeof(Sphere),            sizeof(SphereMotion),
+        sizeof(BvhNode),          Bvh::max_leaf_size,        float_word(global::ir),
+    });
+
+    std::vector<NewSphere> probes(fixed_spheres.begin(), fixed_spheres.end());
+    const uint64_t cell_count = uint64_t{side} * side;
+    for (uint32_t probe = 0; probe < std::min<uint64_t>(probe_cells, cell_count); probe++) {
+      const uint64_t cell = cell_count * probe / std::min<uint64_t>(probe_cells, cell_count);
+      probes.push_back(field_sphere(static_cast<uint32_t>(cell / side),
+                                    static_cast<uint32_t>(cell % side)));
+    }
+
+    LCGRand motion_rand(sobol::hash(config::scene_seed + 1));
+    for (const NewSphere& probe : probes) {
+      const Sphere& sphere = probe.sphere;
+      const Material& mat = probe.mat;
+      key = hash_words({float_word(sphere.center.x), float_word(sphere.center.y),
+                        float_word(sphere.center.z), float_word(sphere.r),
+                        float_word(mat.atten.x), float_word(mat.atten.y), float_word(mat.atten.z),
+                        static_cast<uint64_t>(mat.type), float_word(mat.fuzz), float_word(mat.ir),
+                        float_word(mat.emit.x), float_word(mat.emit.y), float_word(mat.emit.z)},
+                       key);
+      if constexpr (config::animate) {
+        const SphereMotion motion =
+            sphere_motion(sphere, mat.type == MatType::emissive, motion_rand);
+        key = hash_words({static_cast<uint64_t>(motion.kind), float_word(motion.height),
+                          float_word(motion.speed), float_word(motion.phase)},
+                         key);
+      }
+    }
+    return key;
+  }
+
+  // the material table columns, in the order they're kept in the cache
+  [[nodiscard]] inline std::array<std::vector<float>*, 8> material_float_columns() noexcept {
+    return {&materials.atten_r, &materials.atten_g, &materials.atten_b, &materials.fuzz,
+            &materials.ir,      &materials.emit_r,  &materials.emit_g,  &materials.emit_b};
+  }
+
+  constexpr size_t sphere_cache_sections = 4 + 8;
+
+  // Points spheres, sphere_motions and sphere_bvh straight into the cache file. Materials are
+  // copied into the table instead, since planes and meshes add theirs after the spheres'.
+  inline bool map_sphere_cache() {
+    if (config::scene_cache_path[0] == '\0' ||
+        !sphere_cache.map(sphere_cache_key(), sphere_cache_sections)) {
+      return false;
+    }
+
+    spheres = sphere_cache.section<Sphere>(0);
+    sphere_motions = sphere_cache.section<SphereMotion>(1);
+    sphere_bvh.use_nodes(sphere_cache.section<BvhNode>(2));
+    const std::span<const int> types = sphere_cache.section<const int>(3);
+    materials.type.assign(types.begin(), types.end());
+    for (size_t i = 0; std::vector<float>* column : material_float_columns()) {
+      const std::span<const float> vals = sphere_cache.section<const float>(4 + i++);
+      column->assign(vals.begin(), vals.end());
+    }
+    return true;
+  }
+
+  inline void save_sphere_cache() {
+    if (config::scene_cache_path[0] == '\0') {
+      return;
+    }
+
+    std::vector<std::span<const std::byte>> sections{
+        std::as_bytes(spheres),
+        std::as_bytes(sphere_motions),
+        std::as_bytes(sphere_bvh.nodes),
+        std::as_bytes(std::span{materials.type}),
+    };
+    for (std::vector<float>* column : material_float_columns()) {
+      sections.push_back(std::as_bytes(std::span{*column}));
     }
+    sphere_cache.save(sphere_cache_key(), sections);
+  }
+
+  // Maps the spheres and their BVH from the scene cache, or generates and builds them (and
+  // saves them to the cache) if there's no usable one.
+  inline void init_spheres() {
+    using namespace std::chrono;
+    const auto start_time = steady_clock::now();
+
+    const bool cached = map_sphere_cache();
+    if (!cached) {
+      generate_spheres();
+      init_sphere_motions();
+      build_sphere_bvh();
+      save_sphere_cache();
+    }
+    build_sphere_proxies();
+
+    printf("%zu spheres %s in %.2f ms\n", spheres.size(), cached ? "mapped" : "built",
+           duration<double, std::milli>(steady_clock::now() - start_time).count());
   }
 
   // Returns hit t values or 0 depending on if this ray hit this sphere or not
   [[nodiscard, gnu::always_inline]]
   inline __m256 sphere_hit(const RayCluster& rays, const Sphere& sphere,
-                           const float t_max) noexcept {
+                           const __m256& t_max) noexcept {
 
     Vec3_256 sphere_center = Vec3_256::broadcast_vec(sphere.center);
     Vec3_256 oc = sphere_center - rays.orig;
@@ -102,19 +525,20 @@ namespace {
     __m256 root = (b - sqrt_d) * recip_a;
 
     // allow through roots within the max t value
-    __m256 t_max_vec = _mm256_broadcast_ss(&t_max);
-    __m256 below_max = _mm256_cmp_ps(root, t_max_vec, _CMP_LT_OS);
+    __m256 below_max = _mm256_cmp_ps(root, t_max, _CMP_LT_OS);
     __m256 above_min = _mm256_cmp_ps(root, global::t_min_vec, _CMP_NLT_US);
     hit_loc = _mm256_and_ps(above_min, below_max);
 
     // Only clear materials can have another root thats worth finding.
     // This is why i only check for the farther out hit value if the material
-    // is dielectric.
-    if (_mm256_testz_ps(hit_loc, hit_loc) && sphere.mat.type == dielectric) {
-      root = (b + sqrt_d) * recip_a;
-      below_max = _mm256_cmp_ps(root, t_max_vec, _CMP_LT_OS);
-      above_min = _mm256_cmp_ps(root, global::t_min_vec, _CMP_NLT_US);
-      hit_loc = _mm256_and_ps(above_min, below_max);
+    // is dielectric. Done per lane, since some lanes can be inside the sphere while others
+    // hit it from outside.
+    if (_mm256_movemask_ps(hit_loc) != 0xff && materials.type[sphere.mat_id] == dielectric) {
+      const __m256 far_root = (b + sqrt_d) * recip_a;
+      below_max = _mm256_cmp_ps(far_root, t_max, _CMP_LT_OS);
+      above_min = _mm256_cmp_ps(far_root, global::t_min_vec, _CMP_NLT_US);
+      root = _mm256_blendv_ps(far_root, root, hit_loc);
+      hit_loc = _mm256_or_ps(hit_loc, _mm256_and_ps(above_min, below_max));
     }
     root = _mm256_and_ps(root, hit_loc);
 
@@ -130,126 +554,328 @@ namespace {
     hit_rec.norm = hit_rec.norm.blend_vec256(outward_norm, hit_rec.front_face);
   }
 
-  [[gnu::always_inline]] inline void create_hit_record(HitRecords& hit_rec, const RayCluster& rays,
-                                                       const SphereCluster& sphere_cluster,
-                                                       const __m256& t_vals) noexcept {
-    hit_rec.t = t_vals;
-    hit_rec.mat = sphere_cluster.mat;
+  // what rays hit at `t` on spheres of the given centers and radii
+  [[nodiscard, gnu::always_inline]] inline HitRecords
+  sphere_record(const RayCluster& rays, const __m256& t, const Vec3_256& center, const __m256& r,
+                const __m256i& mat_id) noexcept {
+    HitRecords sphere_rec{
+        .orig =
+            {
+                _mm256_fmadd_ps(rays.dir.x, t, rays.orig.x),
+                _mm256_fmadd_ps(rays.dir.y, t, rays.orig.y),
+                _mm256_fmadd_ps(rays.dir.z, t, rays.orig.z),
+            },
+        .norm = {},
+        .mat_id = mat_id,
+        .front_face = {},
+        .t = t,
+        .r = r,
+    };
+    Vec3_256 norm = sphere_rec.orig - center;
+    // normalize
+    norm /= r;
+    set_face_normal(rays, sphere_rec, norm);
+    return sphere_rec;
+  }
+
+  // what a cluster needs to know to decide which proxies of sphere_bvh it takes
+  struct LodRays {
+    __m256 limit_sq; // a node is merged for lanes where its r^2 < limit_sq * distance^2
+    __m256i seed;    // per ray, for its coin flips
+  };
 
-    hit_rec.orig.x = _mm256_fmadd_ps(rays.dir.x, t_vals, rays.orig.x);
-    hit_rec.orig.y = _mm256_fmadd_ps(rays.dir.y, t_vals, rays.orig.y);
-    hit_rec.orig.z = _mm256_fmadd_ps(rays.dir.z, t_vals, rays.orig.z);
+  // Each ray picks its cutoff between lod_angle and twice that from a hash of its direction,
+  // so the same ray always makes the same choices.
+  [[nodiscard, gnu::always_inline]] inline LodRays lod_rays(const RayCluster& rays) noexcept {
+    const __m256i z_hash = sobol::hash_256((__m256i)rays.dir.z);
+    const __m256i y_hash = sobol::hash_256(_mm256_xor_si256((__m256i)rays.dir.y, z_hash));
+    const __m256i seed = sobol::hash_256(_mm256_xor_si256((__m256i)rays.dir.x, y_hash));
+    const __m256 limit =
+        (global::ones + sobol::to_unit_float_256(seed)) * _mm256_set1_ps(global::lod_angle);
+    return LodRays{.limit_sq = limit * limit, .seed = seed};
+  }
 
-    Vec3_256 norm = hit_rec.orig - sphere_cluster.center;
-    // normalize
-    norm /= sphere_cluster.r;
+  // Lanes of `lanes` that are far enough from node `node_idx` to take its proxy instead of
+  // going into its children are set in `merged`. Returns where those stop at the proxy before
+  // t_max, or 0 where they miss it or go through it.
+  [[nodiscard, gnu::always_inline]] inline __m256
+  proxy_hit(const RayCluster& rays, const LodRays& lod, const uint32_t node_idx,
+            const __m256& lanes, const __m256& t_max, __m256& merged) noexcept {
+    merged = global::zeros;
+    const SphereProxy& proxy = sphere_proxies[node_idx];
+    if (proxy.r == 0.f) {
+      return global::zeros;
+    }
+
+    const Vec3_256 oc = Vec3_256::broadcast_vec(proxy.center) - rays.orig;
+    const __m256 dist_sq = oc.dot(oc);
+    const __m256 r_sq = _mm256_set1_ps(proxy.r * proxy.r);
+    merged = _mm256_and_ps(_mm256_cmp_ps(r_sq, lod.limit_sq * dist_sq, _CMP_LT_OQ), lanes);
+    if (_mm256_testz_ps(merged, merged)) {
+      return global::zeros;
+    }
 
-    set_face_normal(rays, hit_rec, norm);
+    // merged lanes start far outside the proxy, so the near root is where they enter it
+    const __m256 a = rays.dir.dot(rays.dir);
+    const __m256 b = rays.dir.dot(oc);
+    const __m256 discrim = _mm256_fmsub_ps(b, b, a * (dist_sq - r_sq));
+    const __m256 root = (b - _mm256_sqrt_ps(_mm256_max_ps(discrim, global::zeros))) / a;
+
+    // rays stop at the proxy as often as they'd have hit one of its spheres
+    const __m256 u = sobol::to_unit_float_256(sobol::hash_256(
+        _mm256_xor_si256(lod.seed, _mm256_set1_epi32(static_cast<int>(node_idx)))));
+    __m256 hit = _mm256_and_ps(merged, _mm256_cmp_ps(discrim, global::zeros, _CMP_NLT_US));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, _mm256_set1_ps(proxy.coverage), _CMP_LT_OQ));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(root, global::t_min_vec, _CMP_NLT_US));
+    hit = _mm256_and_ps(hit, _mm256_cmp_ps(root, t_max, _CMP_LT_OS));
+    return _mm256_and_ps(root, hit);
   }
 
-  // updates a sphere cluster with a sphere given a mask of where to insert the new sphere's values
-  [[gnu::always_inline]] inline void update_sphere_cluster(SphereCluster& curr_cluster,
-                                                           const Sphere& curr_sphere,
-                                                           const __m256& update_mask) noexcept {
+  // What rays hit at `t` on the proxies of nodes `proxy_idx`, each with the material of one of
+  // the spheres under it, picked in proportion to their cross sections. Lanes without a proxy
+  // have to ask for proxy 0.
+  [[nodiscard, gnu::always_inline]] inline HitRecords
+  proxy_record(const RayCluster& rays, const LodRays& lod, const __m256& t,
+               const __m256i& proxy_idx) noexcept {
+    constexpr int stride = sizeof(SphereProxy) / sizeof(float);
+    constexpr int center_at = offsetof(SphereProxy, center) / sizeof(float);
+    constexpr int r_at = offsetof(SphereProxy, r) / sizeof(float);
+    constexpr int first_at = offsetof(SphereProxy, first) / sizeof(float);
+    constexpr int end_at = offsetof(SphereProxy, end) / sizeof(float);
+    static_assert(sizeof(SphereProxy) % sizeof(float) == 0);
+
+    const float* const base = reinterpret_cast<const float*>(sphere_proxies.data());
+    const __m256i idx = _mm256_mullo_epi32(proxy_idx, _mm256_set1_epi32(stride));
+    const Vec3_256 center{
+        _mm256_i32gather_ps(base + center_at, idx, 4),
+        _mm256_i32gather_ps(base + center_at + 1, idx, 4),
+        _mm256_i32gather_ps(base + center_at + 2, idx, 4),
+    };
+    const __m256 r = _mm256_i32gather_ps(base + r_at, idx, 4);
+    const __m256i first =
+        _mm256_i32gather_epi32(reinterpret_cast<const int*>(base + first_at), idx, 4);
+    const __m256i end = _mm256_i32gather_epi32(reinterpret_cast<const int*>(base + end_at), idx, 4);
+
+    // the last sphere in [first, end) whose running area is at or below the target
+    const float* const cdf = sphere_area_cdf.data();
+    const __m256 lo = _mm256_i32gather_ps(cdf, first, 4);
+    const __m256 hi = _mm256_i32gather_ps(cdf, end, 4);
+    const __m256 u = sobol::to_unit_float_256(
+        sobol::hash_256(_mm256_xor_si256(lod.seed, _mm256_set1_epi32(-1))));
+    const __m256 target = _mm256_fmadd_ps(u, hi - lo, lo);
+    __m256i picked = first;
+    for (uint32_t step = std::bit_floor(static_cast<uint32_t>(spheres.size())); step > 0;
+         step >>= 1) {
+      const __m256i probe = _mm256_add_epi32(picked, _mm256_set1_epi32(static_cast<int>(step)));
+      const __m256 entry = _mm256_i32gather_ps(cdf, _mm256_min_epi32(probe, end), 4);
+      const __m256i take = _mm256_and_si256(_mm256_cmpgt_epi32(end, probe),
+                                            (__m256i)_mm256_cmp_ps(entry, target, _CMP_LE_OQ));
+      picked = (__m256i)_mm256_blendv_ps((__m256)picked, (__m256)probe, (__m256)take);
+    }
+
+    constexpr int sphere_stride = sizeof(Sphere) / sizeof(uint32_t);
+    constexpr int mat_id_at = offsetof(Sphere, mat_id) / sizeof(uint32_t);
+    const __m256i mat_id = _mm256_i32gather_epi32(
+        reinterpret_cast<const int*>(spheres.data()) + mat_id_at,
+        _mm256_mullo_epi32(picked, _mm256_set1_epi32(sphere_stride)), 4);
+    return sphere_record(rays, t, center, r, mat_id);
+  }
 
-    if (_mm256_testz_ps(update_mask, update_mask)) {
+  // Replaces the lanes of hit_rec where a sphere is closer than what's already there.
+  // A t of 0 in hit_rec means nothing was hit yet.
+  // Only lanes in `active` are guaranteed correct, the rest may miss spheres they would
+  // otherwise hit.
+  [[gnu::always_inline]] inline void find_sphere_hits(HitRecords& hit_rec, const RayCluster& rays,
+                                                      const float t_max,
+                                                      const __m256& active) noexcept {
+    if (sphere_bvh.empty()) {
       return;
     }
 
-    SphereCluster new_spheres = {
-        .center = Vec3_256::broadcast_vec(curr_sphere.center),
-        .mat =
-            {
-                .atten = Vec3_256::broadcast_vec(curr_sphere.mat.atten),
-                .type = _mm256_set1_epi32(curr_sphere.mat.type),
-            },
-        .r = _mm256_broadcast_ss(&curr_sphere.r),
+    constexpr float flt_max = std::numeric_limits<float>::max();
+    const __m256 no_hit = _mm256_cmp_ps(hit_rec.t, global::zeros, _CMP_EQ_OQ);
+    __m256 closest_t = _mm256_blendv_ps(hit_rec.t, _mm256_broadcast_ss(&flt_max), no_hit);
+    closest_t = _mm256_min_ps(closest_t, _mm256_broadcast_ss(&t_max));
+    __m256i closest_sphere = _mm256_set1_epi32(-1);
+
+    // coherent clusters (camera rays, mirror bounces) can skip spheres outside their cone
+    RayCone cone;
+    const bool cull = config::packet_culling && build_ray_cone(rays, active, cone);
+
+    const Vec3_256 rcp_dirs = rcp_dir(rays.dir);
+    uint32_t stack[Bvh::max_depth];
+    unsigned stack_size = 0;
+    stack[stack_size++] = 0;
+
+    // With LOD, lanes that were merged into a node's proxy don't go on into its children, so
+    // each node on the stack carries the lanes still looking into it.
+    LodRays lod;
+    __m256 stack_lanes[config::sphere_lod ? Bvh::max_depth : 1];
+    __m256i closest_proxy = _mm256_set1_epi32(-1);
+    if constexpr (config::sphere_lod) {
+      lod = lod_rays(rays);
+      stack_lanes[0] = active;
+    }
 
-    };
+    while (stack_size > 0) {
+      const uint32_t node_idx = stack[--stack_size];
+      const BvhNode& node = sphere_bvh.nodes[node_idx];
+      const __m256 lanes = config::sphere_lod ? stack_lanes[stack_size] : active;
+      __m256 box_hit = _mm256_and_ps(ray_box_hit(rays.orig, rcp_dirs, node, closest_t), lanes);
+      if (_mm256_testz_ps(box_hit, box_hit)) {
+        continue;
+      }
 
-    new_spheres.center &= update_mask;
-    new_spheres.mat.atten &= update_mask;
-    new_spheres.mat.type = _mm256_and_si256(new_spheres.mat.type, (__m256i)update_mask);
-    new_spheres.r = _mm256_and_ps(new_spheres.r, update_mask);
+      if constexpr (config::sphere_lod) {
+        __m256 merged;
+        const __m256 t_vals = proxy_hit(rays, lod, node_idx, box_hit, closest_t, merged);
+        const __m256 closer = _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ);
+        closest_t = _mm256_blendv_ps(closest_t, t_vals, closer);
+        closest_proxy = (__m256i)_mm256_blendv_ps(
+            (__m256)closest_proxy, (__m256)_mm256_set1_epi32(static_cast<int>(node_idx)), closer);
+        closest_sphere = (__m256i)_mm256_blendv_ps((__m256)closest_sphere,
+                                                   (__m256)_mm256_set1_epi32(-1), closer);
+        box_hit = _mm256_andnot_ps(merged, box_hit);
+        if (_mm256_testz_ps(box_hit, box_hit)) {
+          continue;
+        }
+      }
 
-    // negation of update locations so we can preserve current values
-    // while clearing bits where we will update
-    __m256 preserve_curr = _mm256_xor_ps(update_mask, (__m256)global::all_set);
+      if (node.count == 0) {
+        if constexpr (config::sphere_lod) {
+          stack_lanes[stack_size] = box_hit;
+          stack_lanes[stack_size + 1] = box_hit;
+        }
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+        continue;
+      }
 
-    SphereCluster curr_spheres = {
-        .center = curr_cluster.center & preserve_curr,
-        .mat =
-            {
-                .atten = curr_cluster.mat.atten & preserve_curr,
-                .type = _mm256_and_si256(curr_cluster.mat.type, (__m256i)preserve_curr),
-            },
-        .r = _mm256_and_ps(curr_cluster.r, preserve_curr),
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        if (cull && !cone_may_hit(cone, spheres[i].center, spheres[i].r)) {
+          continue;
+        }
 
-    };
+        const __m256 t_vals = sphere_hit(rays, spheres[i], closest_t);
+        __m256 closer = _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ);
+        if constexpr (config::sphere_lod) {
+          closer = _mm256_and_ps(closer, box_hit);
+          closest_proxy = (__m256i)_mm256_blendv_ps((__m256)closest_proxy,
+                                                    (__m256)_mm256_set1_epi32(-1), closer);
+        }
+        closest_t = _mm256_blendv_ps(closest_t, t_vals, closer);
+        closest_sphere = (__m256i)_mm256_blendv_ps(
+            (__m256)closest_sphere, (__m256)_mm256_set1_epi32(static_cast<int>(i)), closer);
+      }
+    }
 
-    curr_cluster.center = new_spheres.center + curr_spheres.center;
-    curr_cluster.mat.atten = new_spheres.mat.atten + curr_spheres.mat.atten;
-    curr_cluster.mat.type = new_spheres.mat.type + curr_spheres.mat.type;
-    curr_cluster.r = new_spheres.r + curr_spheres.r;
-  };
+    if constexpr (config::sphere_lod) {
+      const __m256 found_proxy =
+          (__m256)_mm256_cmpgt_epi32(closest_proxy, _mm256_set1_epi32(-1));
+      if (!_mm256_testz_ps(found_proxy, found_proxy)) {
+        hit_rec.blend(proxy_record(rays, lod, closest_t,
+                                   _mm256_and_si256(closest_proxy, (__m256i)found_proxy)),
+                      found_proxy);
+      }
+    }
 
-  [[gnu::always_inline]] inline void find_sphere_hits(HitRecords& hit_rec, const RayCluster& rays,
-                                                      const float t_max) noexcept {
+    const __m256 found = (__m256)_mm256_cmpgt_epi32(closest_sphere, _mm256_set1_epi32(-1));
+    if (_mm256_testz_ps(found, found)) {
+      return;
+    }
 
-    SphereCluster closest_spheres = {
-        .center =
-            {
-                .x = global::zeros,
-                .y = global::zeros,
-                .z = global::zeros,
-            },
-        .mat = Material_256{},
-        .r = global::zeros,
+    // gather the winners straight out of the sphere array. Lanes without a hit read sphere 0.
+    constexpr int stride = sizeof(Sphere) / sizeof(float);
+    constexpr int center_at = offsetof(Sphere, center) / sizeof(float);
+    constexpr int mat_id_at = offsetof(Sphere, mat_id) / sizeof(float);
+    constexpr int r_at = offsetof(Sphere, r) / sizeof(float);
+    static_assert(sizeof(Sphere) % sizeof(float) == 0);
+
+    const float* const base = reinterpret_cast<const float*>(spheres.data());
+    const __m256i idx = _mm256_mullo_epi32(_mm256_and_si256(closest_sphere, (__m256i)found),
+                                           _mm256_set1_epi32(stride));
+    const Vec3_256 center{
+        _mm256_i32gather_ps(base + center_at, idx, 4),
+        _mm256_i32gather_ps(base + center_at + 1, idx, 4),
+        _mm256_i32gather_ps(base + center_at + 2, idx, 4),
     };
+    const __m256 r = _mm256_i32gather_ps(base + r_at, idx, 4);
 
-    constexpr auto flt_max = std::numeric_limits<float>::max();
-    __m256 max = _mm256_broadcast_ss(&flt_max);
-
-    // find first sphere as a baseline
-    __m256 lowest_t_vals = sphere_hit(rays, spheres[0], t_max);
-    __m256 hit_loc = _mm256_cmp_ps(lowest_t_vals, global::zeros, _CMP_NEQ_UQ);
+    const __m256i mat_id =
+        _mm256_i32gather_epi32(reinterpret_cast<const int*>(base + mat_id_at), idx, 4);
+    hit_rec.blend(sphere_record(rays, closest_t, center, r, mat_id), found);
+  }
 
-    update_sphere_cluster(closest_spheres, spheres[0], hit_loc);
+  // Returns a mask of the lanes in `active` whose ray hits any sphere before its own t_max.
+  // Used for shadow rays, so we only care that something is in the way, not what it is.
+  [[nodiscard, gnu::always_inline]] inline __m256
+  find_sphere_occlusion(const RayCluster& rays, const __m256& t_max,
+                        const __m256& active) noexcept {
+    __m256 occluded = global::zeros;
+    if (sphere_bvh.empty()) {
+      return occluded;
+    }
 
-    for (size_t i = 1; i < spheres.size(); i++) {
-      __m256 new_t_vals = sphere_hit(rays, spheres[i], t_max);
+    const Vec3_256 rcp_dirs = rcp_dir(rays.dir);
+    uint32_t stack[Bvh::max_depth];
+    unsigned stack_size = 0;
+    stack[stack_size++] = 0;
+
+    // the same lanes per node as find_sphere_hits(), so shadows see the same proxies
+    LodRays lod;
+    __m256 stack_lanes[config::sphere_lod ? Bvh::max_depth : 1];
+    if constexpr (config::sphere_lod) {
+      lod = lod_rays(rays);
+      stack_lanes[0] = active;
+    }
 
-      // don't update on instances of no hits (hit locations all zeros)
-      hit_loc = _mm256_cmp_ps(new_t_vals, global::zeros, _CMP_NEQ_UQ);
-      if (_mm256_testz_ps(hit_loc, hit_loc)) {
+    while (stack_size > 0) {
+      const uint32_t node_idx = stack[--stack_size];
+      const BvhNode& node = sphere_bvh.nodes[node_idx];
+      // lanes that are already blocked don't need to look any further
+      const __m256 searching = _mm256_andnot_ps(
+          occluded, config::sphere_lod ? stack_lanes[stack_size] : active);
+      __m256 box_hit = _mm256_and_ps(ray_box_hit(rays.orig, rcp_dirs, node, t_max), searching);
+      if (_mm256_testz_ps(box_hit, box_hit)) {
         continue;
       }
 
-      // replace all 0's with float maximum to not replace actual values with
-      // 0's during the minimum comparisons. Again, 0's represent no hits
-      __m256 no_hit_loc = _mm256_xor_ps(hit_loc, (__m256)global::all_set);
-      __m256 max_mask = _mm256_and_ps(no_hit_loc, max);
-      new_t_vals = _mm256_or_ps(new_t_vals, max_mask);
+      if constexpr (config::sphere_lod) {
+        __m256 merged;
+        const __m256 t_vals = proxy_hit(rays, lod, node_idx, box_hit, t_max, merged);
+        occluded = _mm256_or_ps(occluded, _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ));
+        box_hit = _mm256_andnot_ps(merged, box_hit);
+        if (_mm256_testz_ps(box_hit, box_hit)) {
+          continue;
+        }
+      }
 
-      // replace 0's with max for current lowest too
-      __m256 curr_no_hit_loc = _mm256_cmp_ps(lowest_t_vals, global::zeros, _CMP_EQ_OQ);
-      max_mask = _mm256_and_ps(curr_no_hit_loc, max);
-      __m256 lowest_t_masked = _mm256_or_ps(lowest_t_vals, max_mask);
+      if (node.count == 0) {
+        if constexpr (config::sphere_lod) {
+          stack_lanes[stack_size] = box_hit;
+          stack_lanes[stack_size + 1] = box_hit;
+        }
+        stack[stack_size++] = node.first + 1;
+        stack[stack_size++] = node.first;
+        continue;
+      }
 
-      // update sphere references based on where new
-      // t values are closer than the current lowest
-      __m256 update_locs = _mm256_cmp_ps(new_t_vals, lowest_t_masked, _CMP_LT_OS);
-      update_sphere_cluster(closest_spheres, spheres[i], update_locs);
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const __m256 t_vals = sphere_hit(rays, spheres[i], t_max);
+        __m256 blocked = _mm256_cmp_ps(t_vals, global::zeros, _CMP_NEQ_UQ);
+        if constexpr (config::sphere_lod) {
+          blocked = _mm256_and_ps(blocked, box_hit);
+        }
+        occluded = _mm256_or_ps(occluded, blocked);
+      }
 
-      // update current lowest t values based on new t's, however, mask out
-      // where we put float max values so that the t values still represent
-      // no hits as 0.0
-      lowest_t_vals = _mm256_min_ps(lowest_t_masked, new_t_vals);
-      __m256 actual_vals_loc = _mm256_cmp_ps(lowest_t_vals, max, _CMP_NEQ_UQ);
-      lowest_t_vals = _mm256_and_ps(lowest_t_vals, actual_vals_loc);
+      // every lane we care about is already blocked
+      if (_mm256_testc_ps(occluded, active)) {
+        break;
+      }
     }
 
-    create_hit_record(hit_rec, rays, closest_spheres, lowest_t_vals);
+    return _mm256_and_ps(occluded, active);
   }
 
 } // namespace
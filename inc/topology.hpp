@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// Which logical cpus the render workers run on. Read from /sys at startup, falling back to
+// "every cpu we're allowed on is its own core" when that isn't available.
+class Topology {
+public:
+  // logical cpu for each worker, in worker order. Cores are spread across NUMA nodes before
+  // SMT siblings get used, so a small worker count still lands on separate cores.
+  std::vector<unsigned> worker_cpus;
+  // NUMA node of each worker's cpu
+  std::vector<unsigned> worker_nodes;
+  // every logical cpu this process was allowed on at startup
+  std::vector<unsigned> usable_cpus;
+
+  unsigned cpu_count = 0;  // logical cpus this process may run on
+  unsigned core_count = 0; // physical cores among those
+  unsigned node_count = 1;
+
+  // worker_count of 0 means one worker per usable cpu (or per core without use_smt)
+  static Topology detect(bool use_smt, unsigned worker_count);
+
+  // pins the calling thread to the cpu of `worker`. Returns false if the kernel refused.
+  bool pin_worker(unsigned worker) const;
+
+  // lets the calling thread run on any of usable_cpus again
+  bool unpin_worker() const;
+
+  void print() const;
+};
@@ -0,0 +1,73 @@
+#pragma once
+#include "globals.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+// Timeline of what each thread was doing, for config::trace. Every thread that records a span
+// gets its own ring buffer, which only that thread writes to, so recording a span takes two
+// clock reads and a store, and never a lock. Once a buffer is full its oldest spans get
+// overwritten. dump() writes every buffer out as Chrome trace JSON.
+// With config::trace off, none of this does anything and Span compiles away.
+namespace trace {
+  struct Event {
+    const char* name;     // has to outlive the trace, e.g. a string literal
+    const char* arg_name; // nullptr when the span has no argument
+    uint64_t arg;
+    uint64_t start_ns;
+    uint64_t end_ns;
+  };
+
+  [[nodiscard, gnu::always_inline]] inline uint64_t now_ns() noexcept {
+    using namespace std::chrono;
+    return static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+  }
+
+  // adds a finished span to the calling thread's buffer
+  void record(const Event& event) noexcept;
+  // what the calling thread shows up as in the trace, `name` followed by `index` if it's >= 0
+  void set_thread_name(const char* name, int index);
+  // writes every thread's spans to `path`. Threads still recording while it runs may lose
+  // their oldest spans from the file. Returns false if it couldn't be written.
+  bool write_json(const char* path);
+
+  // times the scope it lives in
+  class Span {
+  public:
+    explicit Span(const char* const name, const char* const arg_name = nullptr,
+                  const uint64_t arg = 0) noexcept {
+      if constexpr (config::trace) {
+        event = Event{
+            .name = name, .arg_name = arg_name, .arg = arg, .start_ns = now_ns(), .end_ns = 0};
+      }
+    }
+
+    ~Span() {
+      if constexpr (config::trace) {
+        event.end_ns = now_ns();
+        record(event);
+      }
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+  private:
+    Event event;
+  };
+
+  inline void name_thread(const char* const name, const int index = -1) {
+    if constexpr (config::trace) {
+      set_thread_name(name, index);
+    }
+  }
+
+  inline void dump() {
+    if constexpr (config::trace) {
+      if (write_json(config::trace_path)) {
+        printf("wrote trace to %s\n", config::trace_path);
+      }
+    }
+  }
+} // namespace trace
@@ -1,6 +1,7 @@
 #pragma once
 #include "colors.hpp"
 #include "vec.hpp"
+#include <cstdint>
 #include <immintrin.h>
 
 struct RayCluster {
@@ -11,12 +12,85 @@ struct RayCluster {
 struct Material_256 {
   Color_256 atten;
   __m256i type;
+  __m256 fuzz;
+  __m256 ir;
 };
 
 struct HitRecords {
   Vec3_256 orig;
   Vec3_256 norm;
-  Material_256 mat;
+  __m256i mat_id; // index into the material table
   __m256 front_face;
   __m256 t;
+  __m256 r; // radius of the sphere that was hit, 0 for other primitives
+
+  // take other's records in the lanes set in mask
+  [[gnu::always_inline]] inline void blend(const HitRecords& other, const __m256& mask) noexcept {
+    orig = orig.blend_vec256(other.orig, mask);
+    norm = norm.blend_vec256(other.norm, mask);
+    mat_id = (__m256i)_mm256_blendv_ps((__m256)mat_id, (__m256)other.mat_id, mask);
+    front_face = _mm256_blendv_ps(front_face, other.front_face, mask);
+    t = _mm256_blendv_ps(t, other.t, mask);
+    r = _mm256_blendv_ps(r, other.r, mask);
+  }
+};
+
+// what the camera rays saw first, averaged per pixel to guide the denoiser
+struct FirstHit_256 {
+  Color_256 albedo;
+  Vec3_256 norm;
+  __m256 depth;
+};
+
+// where Camera starts out, and where daemon clients look from unless told otherwise
+constexpr Vec3 start_cam_origin{.x = -1.2f, .y = 1.f, .z = 5.f};
+
+// Where camera rays start and which way they go. Rays are made looking down -z with +y up, and
+// then turned so those axes point along `right`, `up` and `back` instead. The defaults leave
+// them as they are, which is all real-time and png renders need.
+struct View {
+  Vec3 origin;
+  Vec3 right{.x = 1.f, .y = 0.f, .z = 0.f};
+  Vec3 up{.x = 0.f, .y = 1.f, .z = 0.f};
+  Vec3 back{.x = 0.f, .y = 0.f, .z = 1.f};
+
+  [[nodiscard, gnu::always_inline]] inline Vec3_256 turn(const Vec3_256& dir) const noexcept {
+    const auto axis = [&dir](const float right, const float up, const float back) {
+      return _mm256_fmadd_ps(dir.x, _mm256_set1_ps(right),
+                             _mm256_fmadd_ps(dir.y, _mm256_set1_ps(up),
+                                             dir.z * _mm256_set1_ps(back)));
+    };
+    return Vec3_256{
+        axis(right.x, up.x, back.x),
+        axis(right.y, up.y, back.y),
+        axis(right.z, up.z, back.z),
+    };
+  }
+};
+
+// a rectangle of the image, in pixels
+struct Tile {
+  uint32_t x, y;
+  uint32_t width, height;
+};
+
+// everything one pixel's samples add up to. The first hit sums are only there with the
+// denoiser on.
+struct PixelSum {
+  Color color;
+  Color albedo;
+  Vec3 norm;
+  float depth;
+};
+
+// Full resolution float buffers that render() fills before any post processing.
+// Only allocated when a post pass (like the denoiser) needs to look at the whole frame, or when
+// a png render accumulates its samples over several passes. The first hit buffers are only
+// there with the denoiser on.
+struct FrameBuffers {
+  Color* color = nullptr;  // average radiance per pixel
+  Color* albedo = nullptr; // first hit albedo
+  Vec3* norm = nullptr;    // first hit normal, zero where the camera ray escaped
+  float* depth = nullptr;  // first hit t, zero where the camera ray escaped
+  float* lum_sq = nullptr; // sum of each pass's squared mean luminance, for noise targets
 };
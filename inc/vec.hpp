@@ -10,6 +10,53 @@ namespace { // simply to remove the need for `static` on all these methods.
     return _mm256_and_ps(vec, (__m256)sign_mask);
   }
 
+  // e^-x for x >= 0, good to about 1e-3 relative. Goes through 2^(-x*log2(e)), splitting the
+  // exponent into an integer part (built directly into the float's exponent bits) and a
+  // fractional part approximated with a polynomial.
+  [[nodiscard, gnu::always_inline]] inline __m256 exp_neg_256(const __m256& vec) noexcept {
+    constexpr float neg_log2_e = -1.44269504f;
+    constexpr float min_exp = -126.f;
+    __m256 exponent = _mm256_mul_ps(vec, _mm256_set1_ps(neg_log2_e));
+    exponent = _mm256_max_ps(exponent, _mm256_set1_ps(min_exp));
+
+    const __m256 whole = _mm256_floor_ps(exponent);
+    const __m256 frac = _mm256_sub_ps(exponent, whole);
+
+    __m256 poly = _mm256_set1_ps(0.0096181f);
+    poly = _mm256_fmadd_ps(poly, frac, _mm256_set1_ps(0.0555041f));
+    poly = _mm256_fmadd_ps(poly, frac, _mm256_set1_ps(0.2402265f));
+    poly = _mm256_fmadd_ps(poly, frac, _mm256_set1_ps(0.6931472f));
+    poly = _mm256_fmadd_ps(poly, frac, global::ones);
+
+    const __m256i bias = _mm256_set1_epi32(127);
+    const __m256i pow_2 = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(whole), bias), 23);
+    return _mm256_mul_ps(poly, (__m256)pow_2);
+  }
+
+  // sum of all 8 floats
+  [[nodiscard, gnu::always_inline]] inline float hsum_256(const __m256& vec) noexcept {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(vec), _mm256_extractf128_ps(vec, 1));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    return _mm_cvtss_f32(sum);
+  }
+
+  // largest of all 8 floats
+  [[nodiscard, gnu::always_inline]] inline float hmax_256(const __m256& vec) noexcept {
+    __m128 max = _mm_max_ps(_mm256_castps256_ps128(vec), _mm256_extractf128_ps(vec, 1));
+    max = _mm_max_ps(max, _mm_movehl_ps(max, max));
+    max = _mm_max_ss(max, _mm_movehdup_ps(max));
+    return _mm_cvtss_f32(max);
+  }
+
+  // smallest of all 8 floats
+  [[nodiscard, gnu::always_inline]] inline float hmin_256(const __m256& vec) noexcept {
+    __m128 min = _mm_min_ps(_mm256_castps256_ps128(vec), _mm256_extractf128_ps(vec, 1));
+    min = _mm_min_ps(min, _mm_movehl_ps(min, min));
+    min = _mm_min_ss(min, _mm_movehdup_ps(min));
+    return _mm_cvtss_f32(min);
+  }
+
 } // namespace
 template <typename DataType> struct _Vec3 {
   DataType x, y, z;
@@ -145,6 +192,14 @@ struct Vec3_256 {
     return _mm256_fmadd_ps(z, b.z, dot);
   }
 
+  [[nodiscard, gnu::always_inline]] inline Vec3_256 cross(const Vec3_256& b) const noexcept {
+    return Vec3_256{
+        _mm256_fmsub_ps(y, b.z, z * b.y),
+        _mm256_fmsub_ps(z, b.x, x * b.z),
+        _mm256_fmsub_ps(x, b.y, y * b.x),
+    };
+  }
+
   // reflect a ray about the axis
   // v = v - 2*dot(v,n)*n;
   [[nodiscard, gnu::always_inline]] inline Vec3_256 reflect(const Vec3_256& axis) const noexcept {
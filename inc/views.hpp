@@ -0,0 +1,40 @@
+#pragma once
+#include "globals.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include <vector>
+
+// one of the views RenderMode::multi_view renders, and the name its png goes by
+struct NamedView {
+  const char* name;
+  View view;
+};
+
+namespace {
+  // The views of config::view_set, for a camera at `origin` that looks down -z like the one in
+  // the other render modes.
+  [[nodiscard]] inline std::vector<NamedView> make_views(const Vec3& origin) {
+    if constexpr (config::view_set == ViewSet::stereo) {
+      constexpr float half_separation = config::stereo_separation / 2;
+      return {
+          {"left", View{.origin = {origin.x - half_separation, origin.y, origin.z}}},
+          {"right", View{.origin = {origin.x + half_separation, origin.y, origin.z}}},
+      };
+    }
+
+    // Each face looks down one of the axes, with +y up on the side faces, +z up on the top one
+    // and -z up on the bottom one. Like the camera's, the axes are right handed.
+    const auto face = [&origin](const char* name, const Vec3 right, const Vec3 up,
+                                const Vec3 back) {
+      return NamedView{name, View{.origin = origin, .right = right, .up = up, .back = back}};
+    };
+    return {
+        face("px", {0.f, 0.f, 1.f}, {0.f, 1.f, 0.f}, {-1.f, 0.f, 0.f}),
+        face("nx", {0.f, 0.f, -1.f}, {0.f, 1.f, 0.f}, {1.f, 0.f, 0.f}),
+        face("py", {1.f, 0.f, 0.f}, {0.f, 0.f, 1.f}, {0.f, -1.f, 0.f}),
+        face("ny", {1.f, 0.f, 0.f}, {0.f, 0.f, -1.f}, {0.f, 1.f, 0.f}),
+        face("pz", {-1.f, 0.f, 0.f}, {0.f, 1.f, 0.f}, {0.f, 0.f, -1.f}),
+        face("nz", {1.f, 0.f, 0.f}, {0.f, 1.f, 0.f}, {0.f, 0.f, 1.f}),
+    };
+  }
+} // namespace
@@ -0,0 +1,146 @@
+#pragma once
+#include "globals.hpp"
+#include "types.hpp"
+#include "vec.hpp"
+#include "workers.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <immintrin.h>
+
+// What the camera rays of one cluster hit first. Orig is left out, since it's always
+// fma(dir, t, orig) of the camera ray, and the front face mask goes in mat_id's top bit.
+struct CachedHits {
+  __m256 t;
+  Vec3_256 norm;
+  __m256i mat_face;
+};
+
+// First hits of every camera ray of the first `groups` sample groups of each pixel. Camera rays
+// only depend on the view, the pixel and the sample index, so while neither the camera nor the
+// scene moves, frames that trace the same samples again can start from the second bounce.
+// Clusters are stored in the order the packet layout traces them, so each worker's rows stay
+// on its own NUMA node.
+struct VisibilityCache {
+  CachedHits* hits = nullptr;
+  uint32_t groups = 0; // sample groups per pixel there's room for
+  bool allocated = false;
+
+  // bumped by invalidate_visibility_cache() whenever the scene changes
+  uint64_t scene_version = 0;
+  // what the cached hits were traced for
+  View view;
+  uint64_t view_version = 0;
+  bool has_view = false;
+  uint32_t filled_groups = 0;
+
+  // set for the frame being traced: groups below read_groups come out of the cache, and
+  // groups from there up to write_groups get stored into it
+  uint32_t read_groups = 0;
+  uint32_t write_groups = 0;
+};
+
+static VisibilityCache visibility_cache;
+
+namespace {
+  // every sample group's worth of hits
+  constexpr size_t cached_group_bytes = size_t{config::img_width} * config::img_height *
+                                        sizeof(CachedHits);
+
+  // has to be called whenever anything the camera could see moves or changes
+  inline void invalidate_visibility_cache() noexcept {
+    visibility_cache.scene_version++;
+  }
+
+  [[nodiscard]] inline bool same_view(const View& a, const View& b) noexcept {
+    const auto same = [](const Vec3& u, const Vec3& v) {
+      return u.x == v.x && u.y == v.y && u.z == v.z;
+    };
+    return same(a.origin, b.origin) && same(a.right, b.right) && same(a.up, b.up) &&
+           same(a.back, b.back);
+  }
+
+  // Call before tracing sample groups [0, group_count) of a frame from `view`, outside of any
+  // worker job, and end_cached_frame() once they're done. Frames in between these two are the
+  // only ones that use the cache. A view is only cached the second frame in a row it's seen,
+  // so a moving camera doesn't pay for stores it never reads back.
+  inline void begin_cached_frame(const View& view, const uint32_t group_count) {
+    VisibilityCache& cache = visibility_cache;
+    cache.read_groups = 0;
+    cache.write_groups = 0;
+    if (!cache.has_view || !same_view(cache.view, view) ||
+        cache.view_version != cache.scene_version) {
+      cache.view = view;
+      cache.view_version = cache.scene_version;
+      cache.has_view = true;
+      cache.filled_groups = 0;
+      return;
+    }
+
+    // allocated the first time it's needed, so only for a scene that stayed still for a frame
+    if (!cache.allocated) {
+      cache.allocated = true;
+      cache.groups = static_cast<uint32_t>(
+          std::min<size_t>(global::sample_group_num,
+                           size_t{config::visibility_cache_mb} * 1024 * 1024 / cached_group_bytes));
+      if (cache.groups > 0) {
+        cache.hits = static_cast<CachedHits*>(
+            alloc_first_touched(config::img_width * cache.groups * sizeof(CachedHits)));
+      }
+      printf("visibility cache: %u of %u sample groups, %.1f MiB\n", cache.groups,
+             static_cast<unsigned>(global::sample_group_num),
+             static_cast<double>(cache.groups * cached_group_bytes) / (1024.0 * 1024.0));
+    }
+    cache.read_groups = cache.filled_groups;
+    cache.write_groups = std::min(cache.groups, group_count);
+  }
+
+  inline void end_cached_frame() noexcept {
+    VisibilityCache& cache = visibility_cache;
+    cache.filled_groups = std::max(cache.filled_groups, cache.write_groups);
+    cache.read_groups = 0;
+    cache.write_groups = 0;
+  }
+
+  // Where cluster `cluster` of sample group `group` of packet `packet` goes, or nullptr if this
+  // frame doesn't cache that group. Packets are pixels with one cluster per group, or pixel
+  // quads with one per sample. The hits are already there if group < read_groups.
+  [[nodiscard, gnu::always_inline]] inline CachedHits*
+  cached_hits_slot(const uint32_t packet, const uint32_t group, const uint32_t cluster,
+                   const uint32_t clusters_per_group) noexcept {
+    const VisibilityCache& cache = visibility_cache;
+    if (group >= cache.write_groups) {
+      return nullptr;
+    }
+    return cache.hits + (size_t{packet} * cache.groups + group) * clusters_per_group + cluster;
+  }
+
+  [[gnu::always_inline]] inline void store_cached_hits(CachedHits& slot,
+                                                       const HitRecords& hit_rec) noexcept {
+    const __m256i face_bit =
+        _mm256_and_si256((__m256i)hit_rec.front_face, _mm256_set1_epi32(INT32_MIN));
+    slot.t = hit_rec.t;
+    slot.norm = hit_rec.norm;
+    slot.mat_face = _mm256_or_si256(hit_rec.mat_id, face_bit);
+  }
+
+  // the records find_closest_hits() would have written for `rays`
+  [[gnu::always_inline]] inline void load_cached_hits(HitRecords& hit_rec, const CachedHits& slot,
+                                                      const RayCluster& rays) noexcept {
+    const __m256 t = slot.t;
+    const __m256 hit = _mm256_cmp_ps(t, global::zeros, _CMP_NLE_US);
+    const __m256i mat_face = slot.mat_face;
+    hit_rec.orig = Vec3_256{
+                       _mm256_fmadd_ps(rays.dir.x, t, rays.orig.x),
+                       _mm256_fmadd_ps(rays.dir.y, t, rays.orig.y),
+                       _mm256_fmadd_ps(rays.dir.z, t, rays.orig.z),
+                   } &
+                   hit;
+    hit_rec.norm = slot.norm;
+    hit_rec.mat_id = _mm256_and_si256(mat_face, _mm256_set1_epi32(INT32_MAX));
+    hit_rec.front_face = (__m256)_mm256_srai_epi32(mat_face, 31);
+    hit_rec.t = t;
+    // only the emission MIS weight of a later bounce reads r, and it's traced again by then
+    hit_rec.r = global::zeros;
+  }
+} // namespace
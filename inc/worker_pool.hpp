@@ -0,0 +1,48 @@
+#pragma once
+#include "topology.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Threads that stay up for the whole run and take turns at jobs, so handing the workers a job
+// costs a wake up instead of a thread start. Each job runs once on every thread, with the
+// thread's worker index, and run() returns once all of them are done.
+class WorkerPool {
+public:
+  using Job = void (*)(const void* task, unsigned worker);
+
+  WorkerPool() = default;
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  ~WorkerPool();
+
+  // starts `count` threads, or changes to that many if it was already started
+  void start(unsigned count);
+
+  // calls job(task, worker) on every thread and waits for all of them. Must not be called from
+  // inside a job. Each thread first pins itself to its worker's cpu in `topology` if `pinned`,
+  // or lets itself run on any of its usable cpus if not. Threads remember how they were left
+  // by their last job, so they only touch their affinity when `pinned` changes.
+  void run(Job job, const void* task, const Topology& topology, bool pinned);
+
+  [[nodiscard]] unsigned size() const noexcept { return static_cast<unsigned>(threads.size()); }
+
+private:
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable job_ready;
+  std::condition_variable job_done;
+
+  Job job = nullptr;
+  const void* task = nullptr;
+  const Topology* topology = nullptr;
+  bool pinned = false;
+  uint64_t generation = 0; // bumped for every job, so threads can tell a new one from the last
+  unsigned running = 0;    // threads still working on the current job
+  bool stopping = false;
+
+  void thread_main(unsigned worker);
+  void stop();
+};
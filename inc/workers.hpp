@@ -0,0 +1,88 @@
+#pragma once
+#include "globals.hpp"
+#include "topology.hpp"
+#include "vec.hpp"
+#include "worker_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace workers {
+  constexpr size_t page_size = 4096;
+  constexpr size_t row_bytes = config::img_width * sizeof(CharColor);
+
+  // Rows are handed out to workers round robin in bands of this many rows. A band spans at
+  // least 8 pages of the 8 bit image, so only the pages at band edges are shared between two
+  // workers and first touching a band puts almost all of it on the worker's own NUMA node.
+  // Still small enough to keep the expensive rows spread evenly across workers. Rounded up to an
+  // even count, so the two rows of a pixel quad always belong to the same worker.
+  constexpr uint32_t band_rows =
+      (static_cast<uint32_t>((8 * page_size + row_bytes - 1) / row_bytes) + 1) & ~1u;
+} // namespace workers
+
+static Topology topology;
+// turned off by the pinning benchmark to get an unpinned baseline
+static bool pin_workers = config::pin_threads;
+// one resident thread per worker, started by init_workers()
+static WorkerPool worker_pool;
+// config::thread_count unless --threads says otherwise, e.g. for several daemons on one box
+static unsigned worker_thread_count = config::thread_count;
+
+namespace {
+  inline void init_workers() {
+    topology = Topology::detect(config::use_smt, worker_thread_count);
+    topology.print();
+    worker_pool.start(static_cast<unsigned>(topology.worker_cpus.size()));
+  }
+
+  [[nodiscard, gnu::always_inline]] inline unsigned worker_count() noexcept {
+    return static_cast<unsigned>(topology.worker_cpus.size());
+  }
+
+  // calls fn(row) for every image row that belongs to `worker`
+  template <typename Fn>
+  [[gnu::always_inline]] inline void for_each_worker_row(const unsigned worker, const Fn& fn) {
+    const uint32_t band_stride = worker_count() * workers::band_rows;
+
+    for (uint32_t band = worker * workers::band_rows; band < config::img_height;
+         band += band_stride) {
+      const uint32_t band_end = std::min(band + workers::band_rows, config::img_height);
+      for (uint32_t row = band; row < band_end; row++) {
+        fn(row);
+      }
+    }
+  }
+
+  // runs task(worker) once for every worker, each on its own (pinned) thread, and waits for
+  // all of them to finish.
+  template <typename Task> inline void run_on_workers(const Task& task) {
+    worker_pool.run(
+        [](const void* const erased, const unsigned worker) {
+          (*static_cast<const Task*>(erased))(worker);
+        },
+        &task, topology, pin_workers);
+  }
+
+  // allocates a page aligned buffer and zeroes each worker's rows from that worker, so the
+  // kernel backs them with memory on the worker's node. `row_size` is bytes per image row.
+  // Without `on_workers` the calling thread zeroes all of it, like before workers were pinned.
+  [[nodiscard]] inline void* alloc_first_touched(const size_t row_size,
+                                                 const bool on_workers = true) {
+    const size_t bytes = row_size * config::img_height;
+    const size_t rounded =
+        (bytes + workers::page_size - 1) / workers::page_size * workers::page_size;
+    uint8_t* const buf = static_cast<uint8_t*>(aligned_alloc(workers::page_size, rounded));
+
+    if (!on_workers) {
+      std::fill_n(buf, rounded, uint8_t{0});
+      return buf;
+    }
+    run_on_workers([buf, row_size](const unsigned worker) {
+      for_each_worker_row(worker, [buf, row_size](const uint32_t row) {
+        std::fill_n(buf + row * row_size, row_size, uint8_t{0});
+      });
+    });
+
+    return buf;
+  }
+} // namespace
@@ -0,0 +1,100 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <numeric>
+
+namespace {
+  float centroid(const Aabb& box, const unsigned axis) {
+    switch (axis) {
+    case 0:
+      return box.min.x + box.max.x;
+    case 1:
+      return box.min.y + box.max.y;
+    default:
+      return box.min.z + box.max.z;
+    }
+  }
+} // namespace
+
+// Median split on the axis where the centroids are spread out the most. Not as good as SAH,
+// but fast enough to rebuild big scenes at startup and gives balanced trees.
+void Bvh::build(const std::vector<Aabb>& boxes) {
+  owned_nodes.clear();
+  nodes = {};
+  prim_order.resize(boxes.size());
+  std::iota(prim_order.begin(), prim_order.end(), 0u);
+  if (boxes.empty()) {
+    return;
+  }
+
+  owned_nodes.reserve(2 * boxes.size() / max_leaf_size + 1);
+  owned_nodes.push_back(
+      BvhNode{.min = {}, .first = 0, .max = {}, .count = static_cast<uint32_t>(boxes.size())});
+
+  std::vector<uint32_t> todo{0};
+  while (!todo.empty()) {
+    const uint32_t node_idx = todo.back();
+    todo.pop_back();
+
+    const uint32_t first = owned_nodes[node_idx].first;
+    const uint32_t count = owned_nodes[node_idx].count;
+
+    Aabb bounds = boxes[prim_order[first]];
+    Aabb centroids{.min = {FLT_MAX, FLT_MAX, FLT_MAX}, .max = {-FLT_MAX, -FLT_MAX, -FLT_MAX}};
+    for (uint32_t i = first; i < first + count; i++) {
+      const Aabb& box = boxes[prim_order[i]];
+      bounds = merge(bounds, box);
+      const Vec3 center{centroid(box, 0), centroid(box, 1), centroid(box, 2)};
+      centroids = merge(centroids, Aabb{.min = center, .max = center});
+    }
+    owned_nodes[node_idx].min = bounds.min;
+    owned_nodes[node_idx].max = bounds.max;
+
+    if (count <= max_leaf_size) {
+      continue;
+    }
+
+    const Vec3 extent{centroids.max.x - centroids.min.x, centroids.max.y - centroids.min.y,
+                      centroids.max.z - centroids.min.z};
+    unsigned axis = 0;
+    if (extent.y > extent.x) {
+      axis = 1;
+    }
+    if (extent.z > (axis == 0 ? extent.x : extent.y)) {
+      axis = 2;
+    }
+
+    const uint32_t half = count / 2;
+    const auto begin = prim_order.begin() + first;
+    std::nth_element(begin, begin + half, begin + count, [&](const uint32_t a, const uint32_t b) {
+      return centroid(boxes[a], axis) < centroid(boxes[b], axis);
+    });
+
+    const uint32_t left = static_cast<uint32_t>(owned_nodes.size());
+    owned_nodes.push_back(BvhNode{.min = {}, .first = first, .max = {}, .count = half});
+    owned_nodes.push_back(
+        BvhNode{.min = {}, .first = first + half, .max = {}, .count = count - half});
+    owned_nodes[node_idx].first = left;
+    owned_nodes[node_idx].count = 0;
+
+    todo.push_back(left + 1);
+    todo.push_back(left);
+  }
+  nodes = owned_nodes;
+}
+
+// children always come after their parent in `nodes`, so walking backwards sees both children
+// of a node before the node itself
+void Bvh::refit_inner() noexcept {
+  for (size_t n = nodes.size(); n-- > 0;) {
+    BvhNode& node = nodes[n];
+    if (node.count != 0) {
+      continue;
+    }
+    const BvhNode& left = nodes[node.first];
+    const BvhNode& right = nodes[node.first + 1];
+    const Aabb bounds =
+        merge(Aabb{.min = left.min, .max = left.max}, Aabb{.min = right.min, .max = right.max});
+    node.min = bounds.min;
+    node.max = bounds.max;
+  }
+}
@@ -0,0 +1,154 @@
+#include "checkpoint.hpp"
+#include "globals.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+namespace {
+  constexpr char magic[8] = {'C', 'T', 'C', 'K', 'P', 'T', '2', '\0'};
+
+  struct CheckpointHeader {
+    char magic[8];
+    uint64_t render_key; // the scene, camera and settings the sums were traced with
+    uint32_t width;
+    uint32_t height;
+    uint32_t plane_floats; // floats per pixel across all planes
+    uint32_t groups_done;
+    uint32_t low_discrepancy; // sample patterns differ between the two samplers
+    uint32_t sample_group_num;
+    uint32_t pass_groups; // noise estimates assume every pass had the same size
+  };
+
+  // color, plus albedo, normal and depth for the denoiser, plus squared luminances for the
+  // noise estimate
+  constexpr uint32_t plane_floats =
+      3 + (config::denoise ? 3 + 3 + 1 : 0) + (global::track_noise ? 1 : 0);
+  constexpr size_t pixel_count = size_t{config::img_width} * config::img_height;
+
+  CheckpointHeader make_header(const uint64_t render_key, const uint32_t groups_done) {
+    CheckpointHeader header{};
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.render_key = render_key;
+    header.width = config::img_width;
+    header.height = config::img_height;
+    header.plane_floats = plane_floats;
+    header.groups_done = groups_done;
+    header.low_discrepancy = config::low_discrepancy;
+    header.sample_group_num = global::sample_group_num;
+    header.pass_groups = config::pass_groups;
+    return header;
+  }
+
+  // the frame's planes, in the order they're stored in the file
+  std::vector<std::pair<float*, size_t>> frame_planes(const FrameBuffers& frame) {
+    std::vector<std::pair<float*, size_t>> planes{
+        {reinterpret_cast<float*>(frame.color), pixel_count * 3},
+    };
+    if constexpr (config::denoise) {
+      planes.emplace_back(reinterpret_cast<float*>(frame.albedo), pixel_count * 3);
+      planes.emplace_back(reinterpret_cast<float*>(frame.norm), pixel_count * 3);
+      planes.emplace_back(frame.depth, pixel_count);
+    }
+    if constexpr (global::track_noise) {
+      planes.emplace_back(frame.lum_sq, pixel_count);
+    }
+    return planes;
+  }
+
+  bool write_checkpoint(const std::string& path, const CheckpointHeader& header,
+                        const std::vector<float>& data) {
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+      printf("couldn't open checkpoint file: %s\n", tmp_path.c_str());
+      return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(data.data(), sizeof(float), data.size(), file) == data.size();
+    // the data has to be on disk before the rename makes it the checkpoint
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      printf("couldn't write checkpoint file: %s\n", path.c_str());
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+} // namespace
+
+Checkpointer::Checkpointer(std::string path, const uint64_t render_key)
+    : path(std::move(path)), render_key(render_key) {}
+
+Checkpointer::~Checkpointer() { wait(); }
+
+void Checkpointer::save_async(const FrameBuffers& frame, const uint32_t groups_done) {
+  // the workers sit idle until this returns
+  const trace::Span copy_span("checkpoint copy");
+  wait();
+
+  snapshot.resize(pixel_count * plane_floats);
+  float* dst = snapshot.data();
+  for (const auto& [plane, floats] : frame_planes(frame)) {
+    dst = std::copy_n(plane, floats, dst);
+  }
+
+  pending = std::async(std::launch::async, [this, header = make_header(render_key, groups_done)]() {
+    trace::name_thread("checkpoint writer");
+    const trace::Span span("checkpoint write");
+    return write_checkpoint(path, header, snapshot);
+  });
+}
+
+bool Checkpointer::wait() {
+  if (!pending.valid()) {
+    return true;
+  }
+  return pending.get();
+}
+
+bool Checkpointer::load(const FrameBuffers& frame, uint32_t& groups_done) const {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+
+  CheckpointHeader header;
+  const CheckpointHeader expected = make_header(render_key, 0);
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            std::memcmp(header.magic, expected.magic, sizeof(magic)) == 0 &&
+            header.render_key == expected.render_key &&
+            header.width == expected.width && header.height == expected.height &&
+            header.plane_floats == expected.plane_floats &&
+            header.low_discrepancy == expected.low_discrepancy &&
+            header.sample_group_num == expected.sample_group_num &&
+            (!global::track_noise || header.pass_groups == expected.pass_groups);
+  if (!ok) {
+    printf("ignoring checkpoint from a different render: %s\n", path.c_str());
+    fclose(file);
+    return false;
+  }
+
+  // read into a scratch buffer first so a short file can't leave the frame half loaded
+  std::vector<float> data(pixel_count * plane_floats);
+  ok = fread(data.data(), sizeof(float), data.size(), file) == data.size();
+  fclose(file);
+  if (!ok) {
+    printf("checkpoint file is too short: %s\n", path.c_str());
+    return false;
+  }
+
+  const float* src = data.data();
+  for (const auto& [plane, floats] : frame_planes(frame)) {
+    std::copy_n(src, floats, plane);
+    src += floats;
+  }
+  groups_done = header.groups_done;
+  return true;
+}
+
+void Checkpointer::remove() const { std::remove(path.c_str()); }
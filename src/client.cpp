@@ -0,0 +1,168 @@
+#include "globals.hpp"
+#include "protocol.hpp"
+#include "net.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+// Sends render requests to a RenderMode::daemon server and writes the last result to a png.
+// Mostly here to try the server out and to time warm requests.
+
+namespace {
+  struct Options {
+    const char* server = config::listen_address;
+    const char* out_path = "client.png";
+    float cam_origin[3] = {start_cam_origin.x, start_cam_origin.y, start_cam_origin.z};
+    Tile tile{.x = 0, .y = 0, .width = config::img_width, .height = config::img_height};
+    uint32_t sample_groups = 1;
+    unsigned repeat = 1;
+    // get pixels back over the socket instead of through shared memory, like remote clients
+    bool inline_pixels = false;
+    bool shutdown = false;
+  };
+
+  void print_usage(const char* name) {
+    printf("usage: %s [--server address] [--out file.png] [--origin x y z] [--tile x y w h]\n"
+           "          [--groups n] [--repeat n] [--inline] [--shutdown]\n",
+           name);
+  }
+
+  bool parse_args(const int argc, char** argv, Options& opts) {
+    // checks there are `count` values after the flag at argv[i]
+    const auto has = [argc](const int i, const int count) { return i + count < argc; };
+
+    for (int i = 1; i < argc; i++) {
+      const char* arg = argv[i];
+      if (!strcmp(arg, "--server") && has(i, 1)) {
+        opts.server = argv[++i];
+      } else if (!strcmp(arg, "--out") && has(i, 1)) {
+        opts.out_path = argv[++i];
+      } else if (!strcmp(arg, "--origin") && has(i, 3)) {
+        for (float& coord : opts.cam_origin) {
+          coord = strtof(argv[++i], nullptr);
+        }
+      } else if (!strcmp(arg, "--tile") && has(i, 4)) {
+        for (uint32_t* val : {&opts.tile.x, &opts.tile.y, &opts.tile.width, &opts.tile.height}) {
+          *val = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+        }
+      } else if (!strcmp(arg, "--groups") && has(i, 1)) {
+        opts.sample_groups = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+      } else if (!strcmp(arg, "--repeat") && has(i, 1)) {
+        opts.repeat = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+      } else if (!strcmp(arg, "--inline")) {
+        opts.inline_pixels = true;
+      } else if (!strcmp(arg, "--shutdown")) {
+        opts.shutdown = true;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const char* status_name(const protocol::Status status) {
+    switch (status) {
+    case protocol::Status::ok:
+      return "ok";
+    case protocol::Status::bad_request:
+      return "bad request";
+    case protocol::Status::bad_buffer:
+      return "bad buffer";
+    }
+    return "unknown";
+  }
+
+  // sends one request and waits for its reply
+  bool round_trip(const int sock, const protocol::Request& request, const int fd,
+                  protocol::Reply& reply) {
+    int reply_fd;
+    if (!send_message(sock, &request, sizeof(request), fd) ||
+        !recv_message(sock, &reply, sizeof(reply), reply_fd)) {
+      printf("lost the connection to the server\n");
+      return false;
+    }
+    if (reply_fd >= 0) {
+      close(reply_fd);
+    }
+    return true;
+  }
+} // namespace
+
+int main(int argc, char** argv) {
+  using namespace std::chrono;
+
+  Options opts;
+  if (!parse_args(argc, argv, opts)) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const int sock = connect_to(opts.server);
+  if (sock < 0) {
+    return EXIT_FAILURE;
+  }
+
+  protocol::Request request{
+      .version = protocol::version,
+      .kind = protocol::RequestKind::shutdown,
+      .cam_origin = {opts.cam_origin[0], opts.cam_origin[1], opts.cam_origin[2]},
+      .tile = opts.tile,
+      .sample_groups = opts.sample_groups,
+  };
+  protocol::Reply reply;
+
+  if (opts.shutdown) {
+    const bool ok = round_trip(sock, request, -1, reply);
+    close(sock);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // the same memfd works for both, it's just not handed to the server for inline pixels
+  const size_t bytes = size_t{opts.tile.width} * opts.tile.height * sizeof(CharColor);
+  const int fd = memfd_create("crack-tracer-tile", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+    printf("couldn't create shared memory for the tile\n");
+    return EXIT_FAILURE;
+  }
+  void* const pixels = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pixels == MAP_FAILED) {
+    printf("couldn't map the tile\n");
+    return EXIT_FAILURE;
+  }
+
+  request.kind = protocol::RequestKind::render;
+  for (unsigned i = 0; i < opts.repeat; i++) {
+    const auto start_time = steady_clock::now();
+    if (!round_trip(sock, request, opts.inline_pixels ? -1 : fd, reply)) {
+      return EXIT_FAILURE;
+    }
+    int pixels_fd;
+    if (opts.inline_pixels && reply.status == protocol::Status::ok &&
+        !recv_message(sock, pixels, bytes, pixels_fd)) {
+      printf("lost the connection to the server\n");
+      return EXIT_FAILURE;
+    }
+    const float round_trip_ms =
+        duration<float, std::milli>(steady_clock::now() - start_time).count();
+
+    printf("request %u: %s, %u spp, server %.2f ms, round trip %.2f ms, %.2f Mrays/s\n", i,
+           status_name(reply.status), reply.samples_per_pixel, reply.render_ms, round_trip_ms,
+           static_cast<double>(reply.rays) / 1e3 / static_cast<double>(reply.render_ms));
+    if (reply.status != protocol::Status::ok) {
+      return EXIT_FAILURE;
+    }
+  }
+  close(sock);
+
+  stbi_write_png(opts.out_path, static_cast<int>(opts.tile.width),
+                 static_cast<int>(opts.tile.height), 3, pixels,
+                 static_cast<int>(opts.tile.width * sizeof(CharColor)));
+  munmap(pixels, bytes);
+  close(fd);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,283 @@
+#include "globals.hpp"
+#include "net.hpp"
+#include "protocol.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+// Splits the frame into tiles and hands them out to RenderMode::daemon servers, local or on
+// other machines, then writes the assembled image to a png. Each server pulls its next tile
+// as soon as it has room for one, so faster servers end up with more of the frame. Tiles a
+// server was working on when it died or hung up go back in the queue for the others.
+
+namespace {
+  struct Options {
+    std::vector<const char*> workers;
+    const char* out_path = "out.png";
+    float cam_origin[3] = {start_cam_origin.x, start_cam_origin.y, start_cam_origin.z};
+    uint32_t tile_width = 128;
+    uint32_t tile_height = 64;
+    uint32_t sample_groups = global::sample_group_num;
+    // requests queued up on each server, so it never sits idle while a tile is in transit
+    unsigned pipeline_depth = 2;
+    // times a tile is handed out before the render gives up on it
+    unsigned max_attempts = 3;
+    // how long a server may take per sample group of a tile before it counts as hung
+    float secs_per_group = 5.f;
+  };
+
+  void print_usage(const char* name) {
+    printf("usage: %s --worker address [--worker address ...] [--out file.png]\n"
+           "          [--origin x y z] [--tile-size w h] [--groups n] [--pipeline n]\n"
+           "          [--attempts n] [--timeout secs per sample group]\n",
+           name);
+  }
+
+  bool parse_args(const int argc, char** argv, Options& opts) {
+    // checks there are `count` values after the flag at argv[i]
+    const auto has = [argc](const int i, const int count) { return i + count < argc; };
+    const auto to_uint = [](const char* arg) {
+      return static_cast<uint32_t>(strtoul(arg, nullptr, 10));
+    };
+
+    for (int i = 1; i < argc; i++) {
+      const char* arg = argv[i];
+      if (!strcmp(arg, "--worker") && has(i, 1)) {
+        opts.workers.push_back(argv[++i]);
+      } else if (!strcmp(arg, "--out") && has(i, 1)) {
+        opts.out_path = argv[++i];
+      } else if (!strcmp(arg, "--origin") && has(i, 3)) {
+        for (float& coord : opts.cam_origin) {
+          coord = strtof(argv[++i], nullptr);
+        }
+      } else if (!strcmp(arg, "--tile-size") && has(i, 2)) {
+        opts.tile_width = to_uint(argv[++i]);
+        opts.tile_height = to_uint(argv[++i]);
+      } else if (!strcmp(arg, "--groups") && has(i, 1)) {
+        opts.sample_groups = to_uint(argv[++i]);
+      } else if (!strcmp(arg, "--pipeline") && has(i, 1)) {
+        opts.pipeline_depth = std::max(to_uint(argv[++i]), 1u);
+      } else if (!strcmp(arg, "--attempts") && has(i, 1)) {
+        opts.max_attempts = std::max(to_uint(argv[++i]), 1u);
+      } else if (!strcmp(arg, "--timeout") && has(i, 1)) {
+        opts.secs_per_group = strtof(argv[++i], nullptr);
+      } else {
+        return false;
+      }
+    }
+
+    // servers only take tiles that line up with 32 columns and pairs of rows
+    if (opts.workers.empty() || opts.tile_width == 0 || opts.tile_width % 32 != 0 ||
+        opts.tile_height == 0 || opts.tile_height % 2 != 0 || !(opts.secs_per_group > 0.f)) {
+      return false;
+    }
+    return true;
+  }
+
+  std::vector<Tile> split_frame(const uint32_t tile_width, const uint32_t tile_height) {
+    std::vector<Tile> tiles;
+    for (uint32_t y = 0; y < config::img_height; y += tile_height) {
+      for (uint32_t x = 0; x < config::img_width; x += tile_width) {
+        tiles.push_back(Tile{
+            .x = x,
+            .y = y,
+            .width = std::min(tile_width, config::img_width - x),
+            .height = std::min(tile_height, config::img_height - y),
+        });
+      }
+    }
+    return tiles;
+  }
+
+  // Tiles that still need rendering, shared by every server's connection thread.
+  class TileQueue {
+  public:
+    TileQueue(const size_t tile_count, const unsigned max_attempts)
+        : attempts(tile_count, 0), remaining(tile_count), max_attempts(max_attempts) {
+      for (uint32_t tile = 0; tile < tile_count; tile++) {
+        pending.push_back(tile);
+      }
+    }
+
+    // Takes the next tile. With `wait`, blocks while every tile left is out with some other
+    // server, since they might come back. Returns false once there's nothing left to take.
+    bool pop(uint32_t& tile, const bool wait) {
+      std::unique_lock lock(mutex);
+      if (wait) {
+        changed.wait(lock, [this]() { return !pending.empty() || remaining == 0 || failed; });
+      }
+      if (pending.empty() || failed) {
+        return false;
+      }
+      tile = pending.front();
+      pending.pop_front();
+      attempts[tile]++;
+      return true;
+    }
+
+    void done() {
+      std::lock_guard lock(mutex);
+      remaining--;
+      changed.notify_all();
+    }
+
+    // puts back a tile whose server went away. Gives up on the whole frame when it has already
+    // been tried max_attempts times.
+    void retry(const uint32_t tile) {
+      std::lock_guard lock(mutex);
+      if (attempts[tile] >= max_attempts) {
+        printf("tile %u failed %u times, giving up\n", tile, attempts[tile]);
+        failed = true;
+      } else {
+        pending.push_front(tile);
+      }
+      changed.notify_all();
+    }
+
+    [[nodiscard]] size_t tiles_left() {
+      std::lock_guard lock(mutex);
+      return remaining;
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<uint32_t> pending;
+    std::vector<unsigned> attempts;
+    size_t remaining;
+    unsigned max_attempts;
+    bool failed = false;
+  };
+
+  struct WorkerStats {
+    unsigned tiles = 0;
+    uint64_t rays = 0;
+  };
+
+  // Feeds one server tiles until there are none left, copying what comes back into `image`.
+  // Puts its unfinished tiles back in the queue if the server goes away, or takes longer than
+  // the timeout for its next tile, e.g. because it's stopped or cut off.
+  void drive_worker(const char* address, const Options& opts, const std::vector<Tile>& tiles,
+                    TileQueue& queue, CharColor* const image, WorkerStats& stats) {
+    const int sock = connect_to(address);
+    if (sock < 0) {
+      return;
+    }
+    if (!set_recv_timeout(sock, opts.secs_per_group *
+                                    static_cast<float>(std::max(opts.sample_groups, 1u)))) {
+      close(sock);
+      return;
+    }
+
+    protocol::Request request{
+        .version = protocol::version,
+        .kind = protocol::RequestKind::render,
+        .cam_origin = {opts.cam_origin[0], opts.cam_origin[1], opts.cam_origin[2]},
+        .tile = {},
+        .sample_groups = opts.sample_groups,
+    };
+    std::vector<CharColor> pixels(size_t{opts.tile_width} * opts.tile_height);
+    std::deque<uint32_t> in_flight;
+    bool alive = true;
+
+    while (alive) {
+      // keep the server's queue topped up, only waiting for a tile when it has nothing to do
+      uint32_t tile;
+      while (in_flight.size() < opts.pipeline_depth && queue.pop(tile, in_flight.empty())) {
+        request.tile = tiles[tile];
+        in_flight.push_back(tile);
+        if (!send_message(sock, &request, sizeof(request))) {
+          alive = false;
+          break;
+        }
+      }
+      if (!alive || in_flight.empty()) {
+        break;
+      }
+
+      const Tile& curr = tiles[in_flight.front()];
+      const size_t bytes = size_t{curr.width} * curr.height * sizeof(CharColor);
+      protocol::Reply reply;
+      int fd;
+      alive = recv_message(sock, &reply, sizeof(reply), fd) &&
+              reply.status == protocol::Status::ok &&
+              recv_message(sock, pixels.data(), bytes, fd);
+      if (!alive) {
+        break;
+      }
+
+      for (uint32_t row = 0; row < curr.height; row++) {
+        std::copy_n(pixels.data() + size_t{row} * curr.width, curr.width,
+                    image + size_t{curr.y + row} * config::img_width + curr.x);
+      }
+      stats.tiles++;
+      stats.rays += reply.rays;
+      in_flight.pop_front();
+      queue.done();
+    }
+
+    if (!alive) {
+      printf("lost worker %s, handing its %zu tiles to the others\n", address, in_flight.size());
+    }
+    for (const uint32_t tile : in_flight) {
+      queue.retry(tile);
+    }
+    close(sock);
+  }
+} // namespace
+
+int main(int argc, char** argv) {
+  using namespace std::chrono;
+
+  Options opts;
+  if (!parse_args(argc, argv, opts)) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const std::vector<Tile> tiles = split_frame(opts.tile_width, opts.tile_height);
+  TileQueue queue(tiles.size(), opts.max_attempts);
+  std::vector<CharColor> image(size_t{config::img_width} * config::img_height);
+  std::vector<WorkerStats> stats(opts.workers.size());
+
+  const auto start_time = steady_clock::now();
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < opts.workers.size(); i++) {
+    threads.emplace_back([&, i]() {
+      drive_worker(opts.workers[i], opts, tiles, queue, image.data(), stats[i]);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  const float secs = duration<float>(steady_clock::now() - start_time).count();
+
+  uint64_t rays = 0;
+  for (size_t i = 0; i < opts.workers.size(); i++) {
+    printf("%s: %u tiles\n", opts.workers[i], stats[i].tiles);
+    rays += stats[i].rays;
+  }
+
+  if (const size_t left = queue.tiles_left(); left > 0) {
+    printf("%zu of %zu tiles weren't rendered\n", left, tiles.size());
+    return EXIT_FAILURE;
+  }
+
+  printf("render time (ms): %f\n", secs * 1000.f);
+  printf("%zu tiles, %u spp, %.2f Mrays/s\n", tiles.size(), opts.sample_groups * 8,
+         static_cast<double>(rays) / 1e6 / static_cast<double>(secs));
+
+  stbi_write_png(opts.out_path, config::img_width, config::img_height, 3, image.data(),
+                 config::img_width * sizeof(CharColor));
+  return EXIT_SUCCESS;
+}
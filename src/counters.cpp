@@ -0,0 +1,243 @@
+#include "counters.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <memory>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+  constexpr unsigned stage_count = counters::stage_count;
+  constexpr unsigned event_count = counters::event_count;
+
+  constexpr const char* stage_names[stage_count] = {
+      "trace", "preview", "resolve", "denoise", "write out", "encode",
+  };
+
+  struct EventConfig {
+    uint32_t type;
+    uint64_t config;
+  };
+
+  // in the order of counters::Event. Cycles lead the group.
+  constexpr EventConfig event_configs[event_count] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  };
+
+  // what one thread counted in each stage since the last report. Only the owning thread
+  // adds to it, and only print_report() reads and zeroes it, between jobs.
+  struct ThreadTotals {
+    uint64_t values[stage_count][event_count] = {};
+    char name[32] = "";
+  };
+
+  // Every thread's totals, in the order they started counting. Never freed, like the trace
+  // buffers, so threads that are gone still make it into the next report.
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadTotals>> totals;
+    // which events some thread couldn't open, printed as "-"
+    std::atomic<bool> missing[event_count] = {};
+  };
+  Registry& registry = *new Registry;
+
+  std::atomic<bool> warned = false;
+
+  int perf_event_open(perf_event_attr& attr, const int group_fd) {
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+  }
+
+  // the calling thread's counter group, opened on first use and closed when it exits
+  struct ThreadCounters {
+    bool opened = false;
+    int fds[event_count];
+    // where each event is in a group read, or -1 if it couldn't be opened
+    int slots[event_count];
+    unsigned open_count = 0;
+    ThreadTotals* totals = nullptr;
+
+    ThreadCounters() {
+      std::fill_n(fds, event_count, -1);
+      std::fill_n(slots, event_count, -1);
+    }
+
+    ~ThreadCounters() {
+      for (const int fd : fds) {
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+    }
+
+    ThreadTotals& own_totals() {
+      if (totals == nullptr) {
+        std::lock_guard lock(registry.mutex);
+        totals = registry.totals.emplace_back(std::make_unique<ThreadTotals>()).get();
+        snprintf(totals->name, sizeof(totals->name), "thread %zu", registry.totals.size());
+      }
+      return *totals;
+    }
+
+    // false if not even the cycles could be opened
+    bool open() {
+      if (opened) {
+        return fds[counters::cycles] >= 0;
+      }
+      opened = true;
+
+      for (unsigned event = 0; event < event_count; event++) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = event_configs[event].type;
+        attr.config = event_configs[event].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        const int leader = fds[counters::cycles];
+        fds[event] = perf_event_open(attr, leader);
+        if (fds[event] < 0) {
+          if (event == counters::cycles) {
+            if (!warned.exchange(true)) {
+              printf("perf counters unavailable: %s\n", strerror(errno));
+            }
+            return false;
+          }
+          registry.missing[event] = true;
+          continue;
+        }
+        slots[event] = static_cast<int>(open_count++);
+      }
+      own_totals();
+      return true;
+    }
+  };
+  thread_local ThreadCounters thread_counters;
+
+  // per thousand instructions, or "-" if either count is missing
+  void print_per_kilo(const uint64_t count, const uint64_t instructions, const bool missing) {
+    if (missing || instructions == 0) {
+      printf(" %10s", "-");
+    } else {
+      printf(" %10.2f", static_cast<double>(count) * 1000.0 / static_cast<double>(instructions));
+    }
+  }
+
+  void print_row(const char* const stage, const char* const thread,
+                 const uint64_t (&values)[event_count]) {
+    const uint64_t instructions = values[counters::instructions];
+    printf("  %-10s %-12s %10.1f %10.1f", stage, thread,
+           static_cast<double>(values[counters::cycles]) / 1e6,
+           static_cast<double>(instructions) / 1e6);
+    if (values[counters::cycles] == 0 || registry.missing[counters::instructions]) {
+      printf(" %5s", "-");
+    } else {
+      printf(" %5.2f",
+             static_cast<double>(instructions) / static_cast<double>(values[counters::cycles]));
+    }
+    for (const counters::Event event :
+         {counters::l1d_misses, counters::llc_misses, counters::branch_misses}) {
+      print_per_kilo(values[event], instructions,
+                     registry.missing[event] || registry.missing[counters::instructions]);
+    }
+    printf("\n");
+  }
+} // namespace
+
+bool counters::read(Reading& reading) noexcept {
+  ThreadCounters& thread = thread_counters;
+  if (!thread.open()) {
+    return false;
+  }
+
+  // nr, time enabled, time running, then one value per open event
+  uint64_t data[3 + event_count];
+  const ssize_t size = ::read(thread.fds[cycles], data, sizeof(data));
+  if (size < static_cast<ssize_t>(sizeof(uint64_t) * (3 + thread.open_count))) {
+    return false;
+  }
+
+  // the group only runs part of the time if other groups are competing for the counters
+  const double scale = data[2] > 0 ? static_cast<double>(data[1]) / static_cast<double>(data[2])
+                                   : 0.0;
+  for (unsigned event = 0; event < event_count; event++) {
+    const int slot = thread.slots[event];
+    reading.values[event] =
+        slot >= 0 ? static_cast<uint64_t>(static_cast<double>(data[3 + slot]) * scale) : 0;
+  }
+  return true;
+}
+
+void counters::add(const Stage stage, const Reading& start, const Reading& end) noexcept {
+  ThreadTotals& totals = thread_counters.own_totals();
+  uint64_t (&values)[event_count] = totals.values[static_cast<unsigned>(stage)];
+  for (unsigned event = 0; event < event_count; event++) {
+    // scaling can make a later reading come out a little lower
+    values[event] += end.values[event] > start.values[event]
+                         ? end.values[event] - start.values[event]
+                         : 0;
+  }
+}
+
+void counters::set_thread_name(const char* const name, const int index) {
+  ThreadTotals& totals = thread_counters.own_totals();
+  if (index >= 0) {
+    snprintf(totals.name, sizeof(totals.name), "%s %d", name, index);
+  } else {
+    snprintf(totals.name, sizeof(totals.name), "%s", name);
+  }
+}
+
+void counters::print_report(const char* const label, const uint64_t index) {
+  // already said so once
+  if (warned) {
+    return;
+  }
+  std::lock_guard lock(registry.mutex);
+  printf("perf counters for %s %lu:\n", label, index);
+  printf("  %-10s %-12s %10s %10s %5s %10s %10s %10s\n", "stage", "thread", "Mcycles",
+         "Minstrs", "IPC", "L1D mpki", "LLC mpki", "br mpki");
+
+  for (unsigned stage = 0; stage < stage_count; stage++) {
+    uint64_t stage_values[event_count] = {};
+    unsigned threads = 0;
+    for (const std::unique_ptr<ThreadTotals>& totals : registry.totals) {
+      const uint64_t (&values)[event_count] = totals->values[stage];
+      if (values[cycles] == 0) {
+        continue;
+      }
+      threads++;
+      for (unsigned event = 0; event < event_count; event++) {
+        stage_values[event] += values[event];
+      }
+    }
+    if (threads == 0) {
+      continue;
+    }
+
+    print_row(stage_names[stage], "all", stage_values);
+    // a single thread's share is the same as the total
+    if (threads > 1) {
+      for (const std::unique_ptr<ThreadTotals>& totals : registry.totals) {
+        if (totals->values[stage][cycles] != 0) {
+          print_row("", totals->name, totals->values[stage]);
+        }
+      }
+    }
+  }
+
+  for (const std::unique_ptr<ThreadTotals>& totals : registry.totals) {
+    std::fill_n(&totals->values[0][0], stage_count * event_count, uint64_t{0});
+  }
+}
@@ -0,0 +1,258 @@
+#include "crack_tracer.hpp"
+#include "denoise.hpp"
+#include "env_map.hpp"
+#include "framebuffer.hpp"
+#include "globals.hpp"
+#include "instance.hpp"
+#include "lights.hpp"
+#include "materials.hpp"
+#include "mesh.hpp"
+#include "plane.hpp"
+#include "render.hpp"
+#include "sphere.hpp"
+#include "trace.hpp"
+#include "visibility_cache.hpp"
+#include "workers.hpp"
+#include <cstdio>
+#include <vector>
+
+namespace {
+  // Sums, and then averages, of the frame being rendered. Allocated by the first Renderer and
+  // kept for the rest of the process, along with the denoiser's buffers.
+  FrameBuffers frame;
+  std::vector<uint64_t> worker_rays;
+  // the worker pool outlives every Renderer as well, and is only restarted for a new thread count
+  bool workers_started = false;
+
+  [[nodiscard]] Vec3 to_vec3(const float (&v)[3]) noexcept {
+    return Vec3{v[0], v[1], v[2]};
+  }
+
+  [[nodiscard]] Material to_material(const crack_tracer::MaterialDesc& desc) noexcept {
+    MatType type = MatType::lambertian;
+    switch (desc.kind) {
+    case crack_tracer::MaterialKind::metallic:
+      type = MatType::metallic;
+      break;
+    case crack_tracer::MaterialKind::lambertian:
+      type = MatType::lambertian;
+      break;
+    case crack_tracer::MaterialKind::dielectric:
+      type = MatType::dielectric;
+      break;
+    case crack_tracer::MaterialKind::emissive:
+      type = MatType::emissive;
+      break;
+    }
+    return Material{.atten = to_vec3(desc.albedo),
+                    .type = type,
+                    .fuzz = desc.fuzz,
+                    .ir = desc.ir,
+                    .emit = to_vec3(desc.emit)};
+  }
+
+  // checks everything set_scene() relies on before any of the old scene is thrown away
+  [[nodiscard]] bool valid_scene(const crack_tracer::SceneDesc& scene) {
+    const size_t material_count = scene.materials.size();
+    if (scene.ground_plane && scene.ground_material >= material_count) {
+      printf("ground plane has material %u of %zu\n", scene.ground_material, material_count);
+      return false;
+    }
+    for (size_t i = 0; i < scene.spheres.size(); i++) {
+      const crack_tracer::SphereDesc& sphere = scene.spheres[i];
+      if (sphere.material >= material_count || !(sphere.radius > 0.f)) {
+        printf("sphere %zu has material %u of %zu and radius %f\n", i, sphere.material,
+               material_count, static_cast<double>(sphere.radius));
+        return false;
+      }
+    }
+    for (size_t i = 0; i < scene.meshes.size(); i++) {
+      const crack_tracer::MeshDesc& mesh = scene.meshes[i];
+      const size_t vert_count = mesh.verts.size() / 3;
+      if (mesh.material >= material_count || mesh.verts.size() % 3 != 0 ||
+          mesh.indices.size() % 3 != 0) {
+        printf("mesh %zu has material %u of %zu, %zu vertex floats and %zu indices\n", i,
+               mesh.material, material_count, mesh.verts.size(), mesh.indices.size());
+        return false;
+      }
+      for (const uint32_t index : mesh.indices) {
+        if (index >= vert_count) {
+          printf("mesh %zu uses vertex %u of %zu\n", i, index, vert_count);
+          return false;
+        }
+      }
+    }
+    for (size_t i = 0; i < scene.prototypes.size(); i++) {
+      const std::span<const crack_tracer::SphereDesc> spheres = scene.prototypes[i].spheres;
+      if (spheres.empty()) {
+        printf("prototype %zu has no spheres\n", i);
+        return false;
+      }
+      for (const crack_tracer::SphereDesc& sphere : spheres) {
+        if (sphere.material >= material_count || !(sphere.radius > 0.f) ||
+            scene.materials[sphere.material].kind == crack_tracer::MaterialKind::emissive) {
+          printf("prototype %zu has a sphere with material %u of %zu and radius %f\n", i,
+                 sphere.material, material_count, static_cast<double>(sphere.radius));
+          return false;
+        }
+      }
+    }
+    for (size_t i = 0; i < scene.instances.size(); i++) {
+      const crack_tracer::InstanceDesc& instance = scene.instances[i];
+      if (instance.prototype >= scene.prototypes.size() || !(instance.scale > 0.f)) {
+        printf("instance %zu has prototype %u of %zu and scale %f\n", i, instance.prototype,
+               scene.prototypes.size(), static_cast<double>(instance.scale));
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // renders sample_groups * 8 samples per pixel into `frame`, then calls
+  // write(worker) once its rows are ready to be copied out
+  template <typename Write>
+  bool render_frame(const crack_tracer::CameraDesc& camera, const uint32_t sample_groups,
+                    const void* const pixels, const size_t stride, const size_t pixel_bytes,
+                    const Write& write) {
+    if (frame.color == nullptr) {
+      printf("render called without a Renderer\n");
+      return false;
+    }
+    if (sample_groups == 0 || pixels == nullptr || stride < config::img_width * pixel_bytes) {
+      printf("bad render: %u sample groups into %p with a stride of %zu bytes\n", sample_groups,
+             pixels, stride);
+      return false;
+    }
+
+    const trace::Span span("library render", "sample groups", sample_groups);
+    const View view{
+        .origin = to_vec3(camera.origin),
+        .right = to_vec3(camera.right),
+        .up = to_vec3(camera.up),
+        .back = to_vec3(camera.back),
+    };
+    // each worker only ever touches its own rows, so without the denoiser the whole frame is a
+    // single job
+    begin_cached_frame(view, sample_groups);
+    run_on_workers([&](const unsigned worker) {
+      clear_frame_buffers(frame, worker);
+      accumulate_samples(frame, view, 0, sample_groups, worker, worker_rays[worker]);
+      resolve_frame(frame, sample_groups, worker);
+      if constexpr (!config::denoise) {
+        write(worker);
+      }
+    });
+    end_cached_frame();
+    if constexpr (config::denoise) {
+      denoise_frame(frame);
+      run_on_workers(write);
+    }
+    return true;
+  }
+} // namespace
+
+crack_tracer::Renderer::Renderer(const unsigned threads) {
+  const unsigned thread_count = threads != 0 ? threads : config::thread_count;
+  if (!workers_started || thread_count != worker_thread_count) {
+    worker_thread_count = thread_count;
+    init_workers();
+    worker_rays.assign(worker_count(), 0);
+    workers_started = true;
+  }
+  init_env_map();
+  if (frame.color == nullptr) {
+    frame = alloc_frame_buffers();
+    if constexpr (config::denoise) {
+      init_denoiser();
+    }
+  }
+}
+
+crack_tracer::Renderer::~Renderer() {
+  trace::dump();
+}
+
+uint32_t crack_tracer::Renderer::width() noexcept {
+  return config::img_width;
+}
+
+uint32_t crack_tracer::Renderer::height() noexcept {
+  return config::img_height;
+}
+
+bool crack_tracer::Renderer::set_scene(const SceneDesc& scene) {
+  if (!valid_scene(scene)) {
+    return false;
+  }
+
+  // material ids are the descs' indices, since the table starts out empty
+  materials = MaterialTable{};
+  for (const MaterialDesc& desc : scene.materials) {
+    add_material(to_material(desc));
+  }
+
+  owned_spheres.clear();
+  owned_motions.clear();
+  for (const SphereDesc& desc : scene.spheres) {
+    const Vec3 center = to_vec3(desc.center);
+    owned_spheres.push_back(Sphere{.center = center, .mat_id = desc.material, .r = desc.radius});
+    owned_motions.push_back(SphereMotion{
+        .kind = Motion::none, .base = center, .height = 0.f, .speed = 0.f, .phase = 0.f});
+  }
+  build_sphere_bvh();
+  build_sphere_proxies();
+
+  planes.clear();
+  if (scene.ground_plane) {
+    planes.push_back(Plane{.norm = {0.f, 1.f, 0.f}, .dist = 0.f, .mat_id = scene.ground_material});
+  }
+
+  triangles = TriangleSoup{};
+  std::vector<Vec3> verts;
+  for (const MeshDesc& mesh : scene.meshes) {
+    verts.clear();
+    for (size_t i = 0; i < mesh.verts.size(); i += 3) {
+      verts.push_back(Vec3{mesh.verts[i], mesh.verts[i + 1], mesh.verts[i + 2]});
+    }
+    add_mesh(verts, mesh.indices, mesh.material);
+  }
+  build_mesh_bvh();
+
+  // prototype ids are the descs' indices, for the same reason
+  proto_spheres.clear();
+  prototypes.clear();
+  sphere_instances.clear();
+  std::vector<Sphere> group;
+  for (const PrototypeDesc& proto : scene.prototypes) {
+    group.clear();
+    for (const SphereDesc& desc : proto.spheres) {
+      group.push_back(
+          Sphere{.center = to_vec3(desc.center), .mat_id = desc.material, .r = desc.radius});
+    }
+    add_sphere_prototype(group);
+  }
+  for (const InstanceDesc& instance : scene.instances) {
+    add_sphere_instance(instance.prototype, to_vec3(instance.offset), instance.scale);
+  }
+  build_instance_bvh();
+
+  init_lights();
+  invalidate_visibility_cache();
+  return true;
+}
+
+bool crack_tracer::Renderer::render_rgb8(const CameraDesc& camera, const uint32_t sample_groups,
+                                         uint8_t* const pixels, const size_t stride) {
+  return render_frame(camera, sample_groups, pixels, stride, sizeof(CharColor),
+                      [=](const unsigned worker) {
+                        write_out_frame_strided(pixels, stride, frame, worker);
+                      });
+}
+
+bool crack_tracer::Renderer::render_rgb32f(const CameraDesc& camera, const uint32_t sample_groups,
+                                           float* const pixels, const size_t stride) {
+  return render_frame(camera, sample_groups, pixels, stride, sizeof(Color),
+                      [=](const unsigned worker) {
+                        copy_out_frame_strided(pixels, stride, frame, worker);
+                      });
+}
@@ -1,45 +1,408 @@
 #include "camera.hpp"
+#include "checkpoint.hpp"
+#include "counters.hpp"
+#include "denoise.hpp"
 #include "globals.hpp"
+#include "hash.hpp"
+#include "net.hpp"
+#include "pfm.hpp"
+#include "protocol.hpp"
 #include "render.hpp"
+#include "snapshot.hpp"
+#include "trace.hpp"
+#include "views.hpp"
+#include "workers.hpp"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
-#include <future>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+// renders one full frame into img_data, including any post passes
+void render_frame(CharColor* const img_data, const FrameBuffers frame, const View view) {
+  const trace::Span span("render frame");
+  run_on_workers(
+      [=](const unsigned worker) { render(img_data, frame, view, worker); });
+
+  if constexpr (config::denoise) {
+    denoise_frame(frame);
+    run_on_workers([=](const unsigned worker) { write_out_frame(img_data, frame, worker); });
+  }
+}
+
+// renders a real-time frame with render_preview() instead, e.g. while the camera moves
+void render_preview_frame(CharColor* const img_data, const View view) {
+  const trace::Span span("preview frame");
+  run_on_workers([=](const unsigned worker) { render_preview(img_data, view, worker); });
+}
+
+// everything a png render's sums depend on that the checkpoint header doesn't check itself
+uint64_t checkpoint_key(const View& view) {
+  uint64_t key = hash_words({
+      sphere_cache_key(),
+      config::ray_depth,
+      config::molecule_grid_size,
+      config::sphere_lod,
+      float_word(config::lod_pixels),
+      float_word(config::mesh_scale),
+      float_word(config::mesh_offset[0]),
+      float_word(config::mesh_offset[1]),
+      float_word(config::mesh_offset[2]),
+      float_word(config::env_intensity),
+  });
+  for (const Vec3& vec : {view.origin, view.right, view.up, view.back}) {
+    key = hash_words({float_word(vec.x), float_word(vec.y), float_word(vec.z)}, key);
+  }
+  key = hash_text(config::mesh_path, key);
+  return hash_text(config::env_map_path, key);
+}
 
 void render_png() {
   using namespace std::chrono;
+  constexpr uint32_t total_groups = global::sample_group_num;
+  constexpr bool checkpoints = config::checkpoint_path[0] != '\0';
+  constexpr bool snapshots = config::snapshot_interval > 0.f;
 
-  CharColor* const img_data = static_cast<CharColor*>(
-      aligned_alloc(32, config::img_width * config::img_height * sizeof(CharColor)));
-  init_spheres();
-  std::array<std::future<void>, config::thread_count> futures;
+  trace::name_thread("main");
+  counters::name_thread("main");
+  init_workers();
+  CharColor* const img_data =
+      static_cast<CharColor*>(alloc_first_touched(config::img_width * sizeof(CharColor)));
+  init_scene();
+  init_lights();
+  init_env_map();
   Camera cam;
 
-  const auto start_time = system_clock::now();
+  // samples are added up over several passes, so there's a point to stop and save in between
+  FrameBuffers frame = alloc_frame_buffers();
+  if constexpr (config::denoise) {
+    init_denoiser();
+  }
 
-  for (size_t idx = 0; idx < config::thread_count; idx++) {
-    futures[idx] =
-        std::async(std::launch::async, render, img_data, cam.origin, idx * config::img_width);
+  Checkpointer checkpointer(config::checkpoint_path, checkpoint_key(cam.view()));
+  Snapshotter snapshotter(config::snapshot_path);
+  uint32_t groups_done = 0;
+  if constexpr (checkpoints && config::resume) {
+    if (checkpointer.load(frame, groups_done)) {
+      if constexpr (global::progressive) {
+        printf("resuming from %u sample groups\n", groups_done);
+      } else {
+        groups_done = std::min(groups_done, total_groups);
+        printf("resuming from %u of %u sample groups\n", groups_done, total_groups);
+      }
+    }
   }
 
-  for (size_t idx = 0; idx < config::thread_count; idx++) {
-    futures[idx].get();
+  std::vector<uint64_t> worker_rays(worker_count(), 0);
+  std::vector<double> worker_noise(worker_count(), 0.0);
+  float noise = std::numeric_limits<float>::infinity();
+
+  // Progressive renders stop before a pass that wouldn't fit into what's left of the time
+  // budget, going by how long the last one took.
+  const auto need_pass = [&](const float elapsed, const float last_pass_secs) {
+    if constexpr (!global::progressive) {
+      return groups_done < total_groups;
+    }
+    if (groups_done == 0) {
+      return true;
+    }
+    if (config::time_budget > 0.f && elapsed + last_pass_secs > config::time_budget) {
+      return false;
+    }
+    return !global::track_noise || noise > config::noise_target;
+  };
+
+  const auto start_time = steady_clock::now();
+  auto last_checkpoint = start_time;
+  auto last_snapshot = start_time;
+  float pass_secs = 0.f;
+
+  while (need_pass(duration<float>(steady_clock::now() - start_time).count(), pass_secs)) {
+    const auto pass_start = steady_clock::now();
+    const trace::Span pass_span("pass", "first group", groups_done);
+    // progressive passes are all the same size, which the noise estimate relies on
+    const uint32_t first_group = groups_done;
+    const uint32_t group_count = global::progressive
+                                     ? config::pass_groups
+                                     : std::min(config::pass_groups, total_groups - groups_done);
+    run_on_workers([=, &worker_rays](const unsigned worker) {
+      accumulate_samples(frame, cam.view(), first_group, group_count, worker, worker_rays[worker]);
+    });
+    groups_done += group_count;
+
+    if constexpr (global::track_noise) {
+      const uint32_t pass_count = groups_done / config::pass_groups;
+      if (pass_count >= 2) {
+        const trace::Span span("noise estimate");
+        run_on_workers([&](const unsigned worker) {
+          worker_noise[worker] = sum_noise(frame, pass_count, config::pass_groups, worker);
+        });
+        const double noise_sum = std::accumulate(worker_noise.begin(), worker_noise.end(), 0.0);
+        noise = static_cast<float>(noise_sum / (config::img_width * config::img_height));
+      }
+    }
+
+    const auto now = steady_clock::now();
+    pass_secs = duration<float>(now - pass_start).count();
+
+    // checkpoints and snapshots are copied out of the frame and written during the next pass
+    if (checkpoints && (global::progressive || groups_done < total_groups) &&
+        duration<float>(now - last_checkpoint).count() >= config::checkpoint_interval) {
+      checkpointer.save_async(frame, groups_done);
+      last_checkpoint = now;
+    }
+    if (snapshots && duration<float>(now - last_snapshot).count() >= config::snapshot_interval) {
+      snapshotter.save_async(frame, groups_done);
+      last_snapshot = now;
+    }
   }
+  {
+    const trace::Span span("wait for writers");
+    checkpointer.wait();
+    snapshotter.wait();
+  }
+
+  const float render_secs = duration<float>(steady_clock::now() - start_time).count();
 
-  const auto end_time = system_clock::now();
-  const auto dur = duration<float>(end_time - start_time);
+  {
+    const trace::Span span("resolve");
+    run_on_workers([=](const unsigned worker) { resolve_frame(frame, groups_done, worker); });
+  }
+  if constexpr (config::denoise) {
+    const trace::Span span("denoise");
+    denoise_frame(frame);
+  }
+  {
+    const trace::Span span("write out");
+    run_on_workers([=](const unsigned worker) { write_out_frame(img_data, frame, worker); });
+  }
+
+  const auto dur = duration<float>(steady_clock::now() - start_time);
   const float milli = static_cast<float>(duration_cast<microseconds>(dur).count()) / 1000.f;
   printf("render time (ms): %f\n", milli);
 
-  stbi_write_png("out.png", config::img_width, config::img_height, 3, img_data,
-                 config::img_width * sizeof(CharColor));
+  const uint64_t rays = std::accumulate(worker_rays.begin(), worker_rays.end(), uint64_t{0});
+  printf("samples per pixel: %u\n", groups_done * 8);
+  printf("rays traced: %lu (%.2f Mrays/s)\n", rays,
+         static_cast<double>(rays) / 1e6 / static_cast<double>(render_secs));
+  if constexpr (global::track_noise) {
+    printf("noise: %f (target %f)\n", noise, config::noise_target);
+  }
+
+  {
+    const trace::Span span("png encode");
+    const counters::Scope counting(counters::Stage::encode);
+    stbi_write_png("out.png", config::img_width, config::img_height, 3, img_data,
+                   config::img_width * sizeof(CharColor));
+  }
+  if constexpr (config::hdr_path[0] != '\0') {
+    const trace::Span span("pfm write");
+    write_pfm(config::hdr_path, frame.color, config::img_width, config::img_height);
+  }
+  if constexpr (checkpoints) {
+    checkpointer.remove();
+  }
+  counters::report("png job", 0);
+  trace::dump();
+}
+
+// renders the same frame with and without pinned, first touched workers
+void bench_pinning() {
+  using namespace std::chrono;
+  constexpr unsigned frames = 5;
+
+  init_workers();
+  init_scene();
+  init_lights();
+  init_env_map();
+  Camera cam;
+
+  float avg_milli[2];
+  for (const bool pinned : {true, false}) {
+    pin_workers = pinned;
+
+    // unpinned is what we used to do: allocate and touch everything from the main thread
+    CharColor* const img_data = static_cast<CharColor*>(
+        alloc_first_touched(config::img_width * sizeof(CharColor), pinned));
+    FrameBuffers frame;
+    if constexpr (config::denoise) {
+      frame = alloc_frame_buffers(pinned);
+      init_denoiser(pinned);
+    }
+
+    // warm up
+    render_frame(img_data, frame, cam.view());
+
+    const auto start_time = steady_clock::now();
+    for (unsigned i = 0; i < frames; i++) {
+      render_frame(img_data, frame, cam.view());
+    }
+    const auto dur = duration<float>(steady_clock::now() - start_time);
+    avg_milli[pinned ? 0 : 1] =
+        static_cast<float>(duration_cast<microseconds>(dur).count()) / 1000.f / frames;
+
+    free(img_data);
+    if constexpr (config::denoise) {
+      free_frame_buffers(frame);
+      free_denoiser();
+    }
+  }
+
+  printf("pinned   avg frame time (ms): %f\n", avg_milli[0]);
+  printf("unpinned avg frame time (ms): %f\n", avg_milli[1]);
+  printf("speedup: %.3fx\n", avg_milli[1] / avg_milli[0]);
+}
+
+// renders the same png passes with both packet layouts
+void bench_layouts() {
+  using namespace std::chrono;
+  constexpr unsigned frames = 3;
+  constexpr PacketLayout layouts[] = {PacketLayout::pixel_samples, PacketLayout::pixel_quads};
+  constexpr const char* names[] = {"pixel samples", "pixel quads  "};
+
+  init_workers();
+  init_scene();
+  init_lights();
+  init_env_map();
+  Camera cam;
+  FrameBuffers frame = alloc_frame_buffers();
+  std::vector<uint64_t> worker_rays(worker_count(), 0);
+
+  const auto bench = [&]<PacketLayout layout>() {
+    const auto render_frame = [&]() {
+      run_on_workers([&](const unsigned worker) {
+        accumulate_samples<layout>(frame, cam.view(), 0, global::sample_group_num, worker,
+                                   worker_rays[worker]);
+      });
+    };
+
+    // warm up
+    render_frame();
+
+    std::fill(worker_rays.begin(), worker_rays.end(), 0);
+    const auto start_time = steady_clock::now();
+    for (unsigned i = 0; i < frames; i++) {
+      render_frame();
+    }
+    const float secs = duration<float>(steady_clock::now() - start_time).count();
+    const uint64_t rays = std::accumulate(worker_rays.begin(), worker_rays.end(), uint64_t{0});
+    return std::pair{secs * 1000.f / frames, static_cast<float>(rays) / 1e6f / secs};
+  };
+
+  const std::pair<float, float> results[] = {
+      bench.operator()<layouts[0]>(),
+      bench.operator()<layouts[1]>(),
+  };
+
+  for (size_t i = 0; i < std::size(layouts); i++) {
+    printf("%s avg frame time (ms): %f, Mrays/s: %.2f\n", names[i], results[i].first,
+           results[i].second);
+  }
+  printf("quads speedup: %.3fx\n", results[0].first / results[1].first);
+}
+
+// Renders every view of config::view_set in one job, with the same sample groups and passes a
+// png render without a time budget uses, and writes view `name` to out_<name>.png. All the views'
+// rows are traced together on the same workers, see accumulate_views(), which saves about 9%
+// over rendering the views one after another and no more. There are no checkpoints or
+// snapshots in this mode.
+void render_views() {
+  using namespace std::chrono;
+  constexpr uint32_t total_groups = global::sample_group_num;
+
+  trace::name_thread("main");
+  counters::name_thread("main");
+  init_workers();
+  init_scene();
+  init_lights();
+  init_env_map();
+
+  const std::vector<NamedView> named_views = make_views(Camera{}.origin);
+  std::vector<View> views;
+  std::vector<FrameBuffers> frames;
+  std::vector<CharColor*> images;
+  for (const NamedView& named : named_views) {
+    views.push_back(named.view);
+    frames.push_back(alloc_frame_buffers());
+    images.push_back(
+        static_cast<CharColor*>(alloc_first_touched(config::img_width * sizeof(CharColor))));
+  }
+  if constexpr (config::denoise) {
+    init_denoiser();
+  }
+
+  std::vector<uint64_t> worker_rays(worker_count(), 0);
+  const auto start_time = steady_clock::now();
+
+  for (uint32_t first_group = 0; first_group < total_groups; first_group += config::pass_groups) {
+    const uint32_t group_count = std::min(config::pass_groups, total_groups - first_group);
+    const trace::Span span("pass", "first group", first_group);
+    run_on_workers([&, first_group, group_count](const unsigned worker) {
+      accumulate_views(frames, views, first_group, group_count, worker, worker_rays[worker]);
+    });
+  }
+  const float render_secs = duration<float>(steady_clock::now() - start_time).count();
+
+  for (size_t i = 0; i < views.size(); i++) {
+    const FrameBuffers frame = frames[i];
+    CharColor* const img_data = images[i];
+    run_on_workers([=](const unsigned worker) { resolve_frame(frame, total_groups, worker); });
+    if constexpr (config::denoise) {
+      denoise_frame(frame);
+    }
+    run_on_workers([=](const unsigned worker) { write_out_frame(img_data, frame, worker); });
+  }
+
+  const auto dur = duration<float>(steady_clock::now() - start_time);
+  const float milli = static_cast<float>(duration_cast<microseconds>(dur).count()) / 1000.f;
+  printf("render time (ms): %f for %zu views\n", milli, views.size());
+
+  const uint64_t rays = std::accumulate(worker_rays.begin(), worker_rays.end(), uint64_t{0});
+  printf("samples per pixel: %u\n", total_groups * 8);
+  printf("rays traced: %lu (%.2f Mrays/s)\n", rays,
+         static_cast<double>(rays) / 1e6 / static_cast<double>(render_secs));
+
+  for (size_t i = 0; i < views.size(); i++) {
+    const trace::Span span("png encode");
+    const counters::Scope counting(counters::Stage::encode);
+    const std::string path = std::string("out_") + named_views[i].name + ".png";
+    stbi_write_png(path.c_str(), config::img_width, config::img_height, 3, images[i],
+                   config::img_width * sizeof(CharColor));
+    free(images[i]);
+    free_frame_buffers(frames[i]);
+  }
+  counters::report("multi-view job", 0);
+  trace::dump();
 }
 
 void render_realtime() {
+  // SDL owns the pixels we write to in this mode, so there's nothing for us to first touch
+  trace::name_thread("main");
+  counters::name_thread("main");
+  init_workers();
   CharColor* img_data =
       (CharColor*)aligned_alloc(32, config::img_width * config::img_height * sizeof(CharColor));
-  init_spheres();
-  std::array<std::future<void>, config::thread_count> futures{};
+  init_scene();
+  init_lights();
+  init_env_map();
   Camera cam;
 
+  FrameBuffers frame;
+  if constexpr (config::denoise) {
+    frame = alloc_frame_buffers();
+    init_denoiser();
+  }
+
   SDL_Window* win = NULL;
   SDL_Renderer* renderer = NULL;
 
@@ -59,7 +422,9 @@ void render_realtime() {
 
   int pitch = config::img_width * sizeof(CharColor);
 
-  while (true) {
+  const auto start_time = std::chrono::steady_clock::now();
+  for (uint64_t frame_num = 0;; frame_num++) {
+    const trace::Span frame_span("frame", "frame", frame_num);
     SDL_Event e;
     if (SDL_PollEvent(&e)) {
       if (e.type == SDL_QUIT) {
@@ -70,35 +435,194 @@ void render_realtime() {
 
     cam.update();
 
-    SDL_LockTexture(buffer, NULL, (void**)(&img_data), &pitch);
+    if constexpr (config::animate) {
+      const trace::Span span("scene update");
+      const std::chrono::duration<float> time = std::chrono::steady_clock::now() - start_time;
+      update_scene(time.count());
+      update_lights();
+    }
 
-    for (size_t idx = 0; idx < config::thread_count; idx++) {
-      futures[idx] =
-          std::async(std::launch::async, render, img_data, cam.origin, idx * config::img_width);
+    {
+      const trace::Span span("texture lock");
+      SDL_LockTexture(buffer, NULL, (void**)(&img_data), &pitch);
     }
 
-    for (size_t idx = 0; idx < config::thread_count; idx++) {
-      futures[idx].get();
+    if (config::preview_while_moving && cam.moving()) {
+      render_preview_frame(img_data, cam.view());
+    } else if constexpr (config::animate) {
+      // the scene moves every frame, so there are never any first hits to reuse
+      render_frame(img_data, frame, cam.view());
+    } else {
+      begin_cached_frame(cam.view(), global::sample_group_num);
+      render_frame(img_data, frame, cam.view());
+      end_cached_frame();
     }
+    counters::report("frame", frame_num);
 
-    SDL_UnlockTexture(buffer);
+    {
+      // streaming textures go up to the GPU when they're unlocked
+      const trace::Span span("sdl upload");
+      SDL_UnlockTexture(buffer);
+    }
 
+    const trace::Span span("present");
     SDL_RenderCopy(renderer, buffer, NULL, NULL);
 
     // flip the backbuffer
     SDL_RenderPresent(renderer);
   }
+  trace::dump();
 
   SDL_DestroyTexture(buffer);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(win);
 }
 
-int main() {
+namespace {
+  // Renders the tile a client asked for into the shared memory it sent along with the request,
+  // or into `inline_pixels` if it didn't send any. Those get sent after an ok reply.
+  protocol::Reply serve_render(const protocol::Request& request, const int fd,
+                               CharColor* const inline_pixels,
+                               std::vector<uint64_t>& worker_rays) {
+    if (request.kind != protocol::RequestKind::render || !valid_tile(request.tile) ||
+        request.sample_groups == 0) {
+      return protocol::Reply{.status = protocol::Status::bad_request};
+    }
+
+    const trace::Span span("render request", "sample groups", request.sample_groups);
+    const Tile tile = request.tile;
+    const size_t bytes = size_t{tile.width} * tile.height * sizeof(CharColor);
+    CharColor* pixels = inline_pixels;
+    if (fd >= 0) {
+      struct stat fd_stat;
+      if (fstat(fd, &fd_stat) != 0 || static_cast<size_t>(fd_stat.st_size) < bytes) {
+        return protocol::Reply{.status = protocol::Status::bad_buffer};
+      }
+      void* const mapped = mmap(nullptr, bytes, PROT_WRITE, MAP_SHARED, fd, 0);
+      if (mapped == MAP_FAILED) {
+        return protocol::Reply{.status = protocol::Status::bad_buffer};
+      }
+      pixels = static_cast<CharColor*>(mapped);
+    }
+
+    const View view{
+        .origin = {request.cam_origin[0], request.cam_origin[1], request.cam_origin[2]},
+    };
+    std::fill(worker_rays.begin(), worker_rays.end(), 0);
+    run_on_workers([&](const unsigned worker) {
+      render_tile(pixels, tile, view, request.sample_groups, worker, worker_rays[worker]);
+    });
+    if (pixels != inline_pixels) {
+      munmap(pixels, bytes);
+    }
+
+    return protocol::Reply{
+        .status = protocol::Status::ok,
+        .samples_per_pixel = request.sample_groups * 8,
+        .rays = std::accumulate(worker_rays.begin(), worker_rays.end(), uint64_t{0}),
+    };
+  }
+} // namespace
+
+// Keeps the scene, its acceleration structures and the workers around, and renders whatever
+// clients send to `address`, one request at a time. See protocol.hpp. Tiles are written out
+// as they're traced, without the denoiser.
+void serve_renders(const char* address) {
+  using namespace std::chrono;
+
+  trace::name_thread("main");
+  counters::name_thread("main");
+  init_workers();
+  init_scene();
+  init_lights();
+  init_env_map();
+
+  // big enough for a full frame, for clients that can't share memory with us
+  constexpr size_t frame_bytes = size_t{config::img_width} * config::img_height * sizeof(CharColor);
+  CharColor* const inline_pixels = static_cast<CharColor*>(aligned_alloc(
+      workers::page_size,
+      (frame_bytes + workers::page_size - 1) / workers::page_size * workers::page_size));
+
+  const int listener = listen_on(address);
+  if (listener < 0) {
+    exit(EXIT_FAILURE);
+  }
+  printf("listening on %s\n", address);
+
+  std::vector<uint64_t> worker_rays(worker_count(), 0);
+  uint64_t request_num = 0;
+  bool running = true;
+  while (running) {
+    const int conn = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (conn < 0) {
+      printf("couldn't accept connection: %s\n", strerror(errno));
+      continue;
+    }
+
+    protocol::Request request;
+    int fd;
+    bool connected = true;
+    while (running && connected && recv_message(conn, &request, sizeof(request), fd)) {
+      const auto start_time = steady_clock::now();
+
+      protocol::Reply reply{.status = protocol::Status::bad_request};
+      bool send_pixels = false;
+      if (request.version == protocol::version) {
+        if (request.kind == protocol::RequestKind::shutdown) {
+          reply.status = protocol::Status::ok;
+          running = false;
+        } else {
+          reply = serve_render(request, fd, inline_pixels, worker_rays);
+          send_pixels = fd < 0 && reply.status == protocol::Status::ok;
+          counters::report("request", request_num++);
+        }
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+
+      reply.render_ms = duration<float, std::milli>(steady_clock::now() - start_time).count();
+      connected = send_message(conn, &reply, sizeof(reply));
+      if (connected && send_pixels) {
+        connected = send_message(conn, inline_pixels,
+                                 size_t{request.tile.width} * request.tile.height *
+                                     sizeof(CharColor));
+      }
+    }
+    close(conn);
+  }
+
+  stop_listening(listener, address);
+  free(inline_pixels);
+  trace::dump();
+}
+
+int main(int argc, char** argv) {
+  // settings that can differ between processes of the same build
+  const char* listen_address = config::listen_address;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+      listen_address = argv[++i];
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      worker_thread_count = static_cast<unsigned>(strtoul(argv[++i], nullptr, 10));
+    } else {
+      printf("usage: %s [--listen address] [--threads n]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
   if constexpr (config::render_mode == RenderMode::real_time) {
     render_realtime();
   } else if constexpr (config::render_mode == RenderMode::png) {
     render_png();
+  } else if constexpr (config::render_mode == RenderMode::pin_bench) {
+    bench_pinning();
+  } else if constexpr (config::render_mode == RenderMode::layout_bench) {
+    bench_layouts();
+  } else if constexpr (config::render_mode == RenderMode::daemon) {
+    serve_renders(listen_address);
+  } else if constexpr (config::render_mode == RenderMode::multi_view) {
+    render_views();
   }
   return 0;
 }
@@ -0,0 +1,100 @@
+#include "env_map.hpp"
+#include "pfm.hpp"
+#include <cmath>
+#include <cstdio>
+
+bool EnvMap::load(const char* const path, const float intensity) {
+  std::vector<Color> pixels;
+  uint32_t map_width, map_height;
+  if (!read_pfm(path, pixels, map_width, map_height)) {
+    return false;
+  }
+
+  width = map_width;
+  height = map_height;
+  r.resize(pixels.size());
+  g.resize(pixels.size());
+  b.resize(pixels.size());
+  for (size_t i = 0; i < pixels.size(); i++) {
+    // negative or NaN texels would make negative probabilities
+    r[i] = std::fmax(pixels[i].x * intensity, 0.f);
+    g[i] = std::fmax(pixels[i].y * intensity, 0.f);
+    b[i] = std::fmax(pixels[i].z * intensity, 0.f);
+  }
+  build_distribution();
+
+  printf("env map %s: %u x %u\n", path, width, height);
+  return true;
+}
+
+void EnvMap::fill(const Color& color) {
+  width = 1;
+  height = 1;
+  r = {color.x};
+  g = {color.y};
+  b = {color.z};
+  build_distribution();
+}
+
+void EnvMap::build_distribution() {
+  row_cdf.assign(height + 1, 0.f);
+  col_cdf.assign(size_t{height} * (width + 1), 0.f);
+  texel_pdf.assign(size_t{width} * height, 0.f);
+
+  // Each texel gets picked in proportion to its luminance times the solid angle it covers,
+  // which shrinks with the sine of its angle from +y. Sums are kept in double, or the last
+  // rows of a big map would barely move the row CDF.
+  std::vector<double> row_sums(height, 0.0);
+  double total = 0.0;
+  for (uint32_t row = 0; row < height; row++) {
+    const double sin_theta =
+        std::sin(global::pi * (static_cast<double>(row) + 0.5) / static_cast<double>(height));
+    float* const cdf = col_cdf.data() + size_t{row} * (width + 1);
+    double sum = 0.0;
+    for (uint32_t col = 0; col < width; col++) {
+      const size_t texel = size_t{row} * width + col;
+      const double weight = luminance(Color{r[texel], g[texel], b[texel]}) * sin_theta;
+      texel_pdf[texel] = static_cast<float>(weight);
+      sum += weight;
+      cdf[col + 1] = static_cast<float>(sum);
+    }
+    row_sums[row] = sum;
+    total += sum;
+
+    // a black row picks its texels evenly, it never gets picked itself anyway
+    for (uint32_t col = 1; col <= width; col++) {
+      cdf[col] = sum > 0.0 ? static_cast<float>(cdf[col] / sum)
+                           : static_cast<float>(col) / static_cast<float>(width);
+    }
+    cdf[width] = 1.f;
+  }
+
+  // a black map falls back to picking every texel by solid angle alone
+  if (total <= 0.0) {
+    total = 0.0;
+    for (uint32_t row = 0; row < height; row++) {
+      const double sin_theta =
+          std::sin(global::pi * (static_cast<double>(row) + 0.5) / static_cast<double>(height));
+      row_sums[row] = sin_theta * width;
+      total += row_sums[row];
+      for (uint32_t col = 0; col < width; col++) {
+        texel_pdf[size_t{row} * width + col] = static_cast<float>(sin_theta);
+      }
+    }
+  }
+
+  double sum = 0.0;
+  for (uint32_t row = 0; row < height; row++) {
+    sum += row_sums[row];
+    row_cdf[row + 1] = static_cast<float>(sum / total);
+  }
+  row_cdf[height] = 1.f;
+
+  // picking probability over the texel's share of the map's area, over the 2 pi^2 that maps
+  // (u, v) area to solid angle, leaving out the sine, which env_pdf() divides by per direction
+  const double to_pdf = static_cast<double>(width) * height /
+                        (total * 2.0 * global::pi * global::pi);
+  for (float& pdf : texel_pdf) {
+    pdf = static_cast<float>(pdf * to_pdf);
+  }
+}
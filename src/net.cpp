@@ -0,0 +1,225 @@
+#include "net.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+  // Unix socket paths have a '/' in them, anything else with a ':' is host:port
+  bool is_tcp(const char* address) {
+    return strchr(address, '/') == nullptr && strrchr(address, ':') != nullptr;
+  }
+
+  bool make_unix_address(const char* path, sockaddr_un& addr) {
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      printf("socket path is too long: %s\n", path);
+      return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+  }
+
+  // Without a host (":port"), listening and connecting both go to loopback, so a daemon is
+  // only reachable from other machines when it's given a host such as 0.0.0.0 or [::].
+  addrinfo* resolve_tcp(const char* address) {
+    const char* colon = strrchr(address, ':');
+    std::string host(address, colon);
+    // [::1]:port style IPv6 addresses
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+      host = host.substr(1, host.size() - 2);
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* found = nullptr;
+    const int res =
+        getaddrinfo(host.empty() ? nullptr : host.c_str(), colon + 1, &hints, &found);
+    if (res != 0) {
+      printf("couldn't resolve %s: %s\n", address, gai_strerror(res));
+      return nullptr;
+    }
+    return found;
+  }
+
+  // requests and replies are small, so don't let Nagle hold them back
+  void set_no_delay(const int sock) {
+    const int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+
+  // binds or connects a socket for `address`
+  int open_socket(const char* address, const bool listening) {
+    const char* const action = listening ? "listen on" : "connect to";
+
+    if (!is_tcp(address)) {
+      sockaddr_un addr;
+      if (!make_unix_address(address, addr)) {
+        return -1;
+      }
+      const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (sock < 0) {
+        printf("couldn't create socket: %s\n", strerror(errno));
+        return -1;
+      }
+
+      const sockaddr* const sock_addr = reinterpret_cast<const sockaddr*>(&addr);
+      bool ok;
+      if (listening) {
+        unlink(address);
+        ok = bind(sock, sock_addr, sizeof(addr)) == 0 && listen(sock, 8) == 0;
+      } else {
+        ok = connect(sock, sock_addr, sizeof(addr)) == 0;
+      }
+      if (!ok) {
+        printf("couldn't %s %s: %s\n", action, address, strerror(errno));
+        close(sock);
+        return -1;
+      }
+      return sock;
+    }
+
+    addrinfo* const found = resolve_tcp(address);
+    int sock = -1;
+    for (addrinfo* info = found; info != nullptr && sock < 0; info = info->ai_next) {
+      sock = socket(info->ai_family, info->ai_socktype | SOCK_CLOEXEC, info->ai_protocol);
+      if (sock < 0) {
+        continue;
+      }
+
+      bool ok;
+      if (listening) {
+        const int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        ok = bind(sock, info->ai_addr, info->ai_addrlen) == 0 && listen(sock, 8) == 0;
+      } else {
+        ok = connect(sock, info->ai_addr, info->ai_addrlen) == 0;
+      }
+      if (!ok) {
+        close(sock);
+        sock = -1;
+      }
+    }
+    if (found != nullptr) {
+      freeaddrinfo(found);
+    }
+
+    if (sock < 0) {
+      printf("couldn't %s %s\n", action, address);
+      return -1;
+    }
+    set_no_delay(sock);
+    return sock;
+  }
+} // namespace
+
+int listen_on(const char* address) { return open_socket(address, true); }
+
+int connect_to(const char* address) { return open_socket(address, false); }
+
+bool set_recv_timeout(const int sock, const float secs) {
+  const auto whole = static_cast<time_t>(secs);
+  const timeval timeout{
+      .tv_sec = whole,
+      .tv_usec = static_cast<suseconds_t>((secs - static_cast<float>(whole)) * 1e6f),
+  };
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+    printf("couldn't set receive timeout: %s\n", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+void stop_listening(const int sock, const char* address) {
+  close(sock);
+  if (!is_tcp(address)) {
+    unlink(address);
+  }
+}
+
+bool send_message(const int sock, const void* data, const size_t size, const int fd) {
+  const char* bytes = static_cast<const char*>(data);
+  size_t sent = 0;
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  while (sent < size) {
+    iovec iov{.iov_base = const_cast<char*>(bytes + sent), .iov_len = size - sent};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    // the fd rides along with the first byte
+    if (fd >= 0 && sent == 0) {
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    const ssize_t res = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (res < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      printf("couldn't send message: %s\n", strerror(errno));
+      return false;
+    }
+    sent += static_cast<size_t>(res);
+  }
+  return true;
+}
+
+bool recv_message(const int sock, void* data, const size_t size, int& fd) {
+  char* bytes = static_cast<char*>(data);
+  size_t received = 0;
+  fd = -1;
+
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+  while (received < size) {
+    iovec iov{.iov_base = bytes + received, .iov_len = size - received};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    const ssize_t res = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); res > 0 && cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+      }
+    }
+
+    if (res <= 0) {
+      if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        printf("timed out waiting for a message\n");
+      } else if (res < 0 || received > 0) {
+        printf("couldn't receive message: %s\n", res < 0 ? strerror(errno) : "cut short");
+      }
+      if (fd >= 0) {
+        close(fd);
+        fd = -1;
+      }
+      return false;
+    }
+    received += static_cast<size_t>(res);
+  }
+  return true;
+}
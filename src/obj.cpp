@@ -0,0 +1,58 @@
+#include "obj.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+bool load_obj(const char* path, std::vector<Vec3>& verts, std::vector<uint32_t>& tri_indices) {
+  std::ifstream file(path);
+  if (!file) {
+    printf("couldn't open obj file: %s\n", path);
+    return false;
+  }
+
+  const size_t first_vert = verts.size();
+  std::string line;
+  std::vector<uint32_t> face;
+  size_t line_num = 0;
+
+  while (std::getline(file, line)) {
+    line_num++;
+    std::istringstream tokens(line);
+    std::string kind;
+    tokens >> kind;
+
+    if (kind == "v") {
+      Vec3 v;
+      tokens >> v.x >> v.y >> v.z;
+      verts.push_back(v);
+    } else if (kind == "f") {
+      face.clear();
+      std::string corner;
+      while (tokens >> corner) {
+        // "v", "v/vt", "v//vn" or "v/vt/vn". Negative indices count back from the end.
+        const char* const first = corner.data();
+        const char* const last = first + std::min(corner.find('/'), corner.size());
+        long idx = 0;
+        const auto [end, err] = std::from_chars(first, last, idx);
+        const long local_count = static_cast<long>(verts.size() - first_vert);
+        const long local = idx < 0 ? local_count + idx : idx - 1;
+        if (err != std::errc{} || end != last || idx == 0 || local < 0 || local >= local_count) {
+          printf("%s:%zu: bad vertex index \"%s\" with %ld vertices so far\n", path, line_num,
+                 corner.c_str(), local_count);
+          return false;
+        }
+        face.push_back(static_cast<uint32_t>(first_vert + static_cast<size_t>(local)));
+      }
+      for (size_t i = 2; i < face.size(); i++) {
+        tri_indices.push_back(face[0]);
+        tri_indices.push_back(face[i - 1]);
+        tri_indices.push_back(face[i]);
+      }
+    }
+  }
+
+  return !tri_indices.empty();
+}
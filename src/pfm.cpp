@@ -0,0 +1,92 @@
+#include "pfm.hpp"
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+
+bool write_pfm(const char* path, const Color* pixels, const uint32_t width,
+               const uint32_t height) {
+  static_assert(sizeof(Color) == 3 * sizeof(float), "Rows are written straight from memory.");
+  static_assert(std::endian::native == std::endian::little, "A scale of -1 means little endian.");
+
+  FILE* file = fopen(path, "wb");
+  if (file == nullptr) {
+    printf("couldn't open hdr file: %s\n", path);
+    return false;
+  }
+
+  bool ok = fprintf(file, "PF\n%u %u\n-1.0\n", width, height) > 0;
+  // PFM rows go from the bottom of the image up
+  for (uint32_t row = height; ok && row-- > 0;) {
+    ok = fwrite(pixels + size_t{row} * width, sizeof(Color), width, file) == width;
+  }
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok) {
+    printf("couldn't write hdr file: %s\n", path);
+  }
+  return ok;
+}
+
+bool read_pfm(const char* path, std::vector<Color>& pixels, uint32_t& width,
+              uint32_t& height) {
+  static_assert(sizeof(Color) == 3 * sizeof(float), "Rows are read straight into memory.");
+
+  FILE* file = fopen(path, "rb");
+  if (file == nullptr) {
+    printf("couldn't open pfm file: %s\n", path);
+    return false;
+  }
+
+  // a single whitespace character separates the header from the pixels. Sizes are read signed
+  // so negative ones don't wrap around into huge ones.
+  char magic[3] = "";
+  long long header_width = 0;
+  long long header_height = 0;
+  double scale = 0.0;
+  const int fields =
+      fscanf(file, "%2s %lld %lld %lf", magic, &header_width, &header_height, &scale);
+  bool ok = fields == 4 && fgetc(file) != EOF && magic[0] == 'P' && magic[1] == 'F' &&
+            header_width > 0 && header_height > 0 && header_width <= UINT32_MAX &&
+            header_height <= UINT32_MAX && scale != 0.0;
+
+  // the pixels the header promises have to be in the file before anything gets allocated for
+  // them, which also keeps width * height * sizeof(Color) from overflowing
+  if (ok) {
+    const long header_end = ftell(file);
+    ok = header_end >= 0 && fseek(file, 0, SEEK_END) == 0;
+    const long file_end = ok ? ftell(file) : -1;
+    ok = ok && file_end >= header_end && fseek(file, header_end, SEEK_SET) == 0;
+    if (ok) {
+      const uint64_t pixel_bytes = static_cast<uint64_t>(file_end - header_end);
+      ok = pixel_bytes / sizeof(Color) / static_cast<uint64_t>(header_height) >=
+           static_cast<uint64_t>(header_width);
+    }
+  }
+  if (ok) {
+    width = static_cast<uint32_t>(header_width);
+    height = static_cast<uint32_t>(header_height);
+    pixels.resize(size_t{width} * height);
+    // PFM rows go from the bottom of the image up
+    for (uint32_t row = height; ok && row-- > 0;) {
+      ok = fread(pixels.data() + size_t{row} * width, sizeof(Color), width, file) == width;
+    }
+  }
+  fclose(file);
+  if (!ok) {
+    printf("couldn't read color pfm file: %s\n", path);
+    return false;
+  }
+
+  // a positive scale means the floats are big endian
+  if ((scale > 0.0) != (std::endian::native == std::endian::big)) {
+    const auto swap = [](float& f) {
+      f = std::bit_cast<float>(std::byteswap(std::bit_cast<uint32_t>(f)));
+    };
+    for (Color& pixel : pixels) {
+      swap(pixel.x);
+      swap(pixel.y);
+      swap(pixel.z);
+    }
+  }
+  return true;
+}
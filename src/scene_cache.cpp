@@ -0,0 +1,172 @@
+#include "scene_cache.hpp"
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+  constexpr char magic[8] = {'C', 'T', 'S', 'C', 'E', 'N', 'E', '1'};
+  // sections start on cache lines, which also covers the alignment of anything put in them
+  constexpr size_t section_alignment = 64;
+
+  struct CacheHeader {
+    char magic[8];
+    uint64_t key;
+    uint64_t checksum; // over the section table and every section
+    uint64_t section_count;
+  };
+
+  struct SectionEntry {
+    uint64_t offset; // from the start of the file
+    uint64_t bytes;
+  };
+
+  constexpr uint64_t checksum_seed = 0x27d4eb2f165667c5u;
+
+  // the accumulator round from xxHash64, one word at a time. Only has to catch truncated or
+  // corrupted files, but has to keep up with reading them.
+  [[nodiscard]] uint64_t checksum(uint64_t acc, const void* data, const size_t bytes) {
+    const auto* src = static_cast<const std::byte*>(data);
+    const auto round = [&acc](const uint64_t word) {
+      acc += word * 0xc2b2ae3d27d4eb4fu;
+      acc = std::rotl(acc, 31);
+      acc *= 0x9e3779b185ebca87u;
+    };
+
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)) {
+      uint64_t word;
+      std::memcpy(&word, src + i, sizeof(word));
+      round(word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, src + i, bytes - i);
+    round(tail ^ bytes);
+    return acc;
+  }
+
+  [[nodiscard]] size_t align_up(const size_t offset) {
+    return (offset + section_alignment - 1) / section_alignment * section_alignment;
+  }
+} // namespace
+
+SceneCache::SceneCache(std::string path) : path(std::move(path)) {}
+
+SceneCache::~SceneCache() { unmap(); }
+
+bool SceneCache::map(const uint64_t key, const size_t section_count) {
+  unmap();
+
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(CacheHeader)) {
+    printf("ignoring scene cache that's too short: %s\n", path.c_str());
+    close(fd);
+    return false;
+  }
+
+  // private so animating the scene doesn't write back to the file
+  mapping_size = static_cast<size_t>(info.st_size);
+  mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    printf("couldn't map scene cache: %s\n", path.c_str());
+    mapping = nullptr;
+    return false;
+  }
+
+  const auto* const header = static_cast<const CacheHeader*>(mapping);
+  if (std::memcmp(header->magic, magic, sizeof(magic)) != 0 || header->key != key ||
+      header->section_count != section_count) {
+    printf("ignoring scene cache from a different scene: %s\n", path.c_str());
+    unmap();
+    return false;
+  }
+
+  const size_t table_end = sizeof(CacheHeader) + section_count * sizeof(SectionEntry);
+  bool ok = table_end <= mapping_size;
+  uint64_t sum = checksum_seed;
+  if (ok) {
+    const auto* const table = reinterpret_cast<const SectionEntry*>(header + 1);
+    sum = checksum(sum, table, section_count * sizeof(SectionEntry));
+    for (size_t i = 0; ok && i < section_count; i++) {
+      // empty sections at the end can point past the end of the file
+      ok = table[i].offset % section_alignment == 0 && table[i].offset >= table_end &&
+           (table[i].bytes == 0 ||
+            (table[i].offset <= mapping_size && table[i].bytes <= mapping_size - table[i].offset));
+      if (ok) {
+        sum = checksum(sum, static_cast<const std::byte*>(mapping) + table[i].offset,
+                       table[i].bytes);
+      }
+    }
+  }
+  if (!ok || sum != header->checksum) {
+    printf("ignoring corrupted scene cache: %s\n", path.c_str());
+    unmap();
+    return false;
+  }
+  return true;
+}
+
+std::span<std::byte> SceneCache::raw_section(const size_t i) const {
+  const auto* const table = reinterpret_cast<const SectionEntry*>(
+      static_cast<const CacheHeader*>(mapping) + 1);
+  return {static_cast<std::byte*>(mapping) + table[i].offset, table[i].bytes};
+}
+
+bool SceneCache::save(const uint64_t key,
+                      const std::vector<std::span<const std::byte>>& sections) const {
+  CacheHeader header{};
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.key = key;
+  header.section_count = sections.size();
+
+  std::vector<SectionEntry> table(sections.size());
+  size_t offset = align_up(sizeof(CacheHeader) + table.size() * sizeof(SectionEntry));
+  for (size_t i = 0; i < sections.size(); i++) {
+    table[i] = SectionEntry{.offset = offset, .bytes = sections[i].size()};
+    offset = align_up(offset + sections[i].size());
+  }
+
+  header.checksum = checksum(checksum_seed, table.data(), table.size() * sizeof(SectionEntry));
+  for (const std::span<const std::byte> section : sections) {
+    header.checksum = checksum(header.checksum, section.data(), section.size());
+  }
+
+  const std::string tmp_path = path + ".tmp";
+  FILE* file = fopen(tmp_path.c_str(), "wb");
+  if (file == nullptr) {
+    printf("couldn't open scene cache file: %s\n", tmp_path.c_str());
+    return false;
+  }
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(table.data(), sizeof(SectionEntry), table.size(), file) == table.size();
+  for (size_t i = 0; ok && i < sections.size(); i++) {
+    ok = fseek(file, static_cast<long>(table[i].offset), SEEK_SET) == 0 &&
+         fwrite(sections[i].data(), 1, sections[i].size(), file) == sections[i].size();
+  }
+  ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    printf("couldn't write scene cache file: %s\n", path.c_str());
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+void SceneCache::unmap() {
+  if (mapping != nullptr) {
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+}
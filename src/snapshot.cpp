@@ -0,0 +1,65 @@
+#include "snapshot.hpp"
+#include "colors.hpp"
+#include "globals.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <immintrin.h>
+#include <stb_image_write.h>
+
+namespace {
+  constexpr size_t pixel_count = size_t{config::img_width} * config::img_height;
+
+  bool write_snapshot(const std::string& path, const std::vector<Color>& sums,
+                      const uint32_t groups_done) {
+    const __m256 scale = _mm256_set1_ps(255.f / static_cast<float>(groups_done * 8));
+    std::vector<CharColor> img(pixel_count);
+
+    // same encoding, rounding and clamping as write_out_color_buf(), 8 channels at a time.
+    // Rows are a multiple of 32 pixels, so there's nothing left over.
+    const float* const channels = reinterpret_cast<const float*>(sums.data());
+    uint8_t* const out = reinterpret_cast<uint8_t*>(img.data());
+    for (size_t i = 0; i < pixel_count * 3; i += 8) {
+      const __m256 encoded = encode_output_256(_mm256_loadu_ps(channels + i), scale);
+      alignas(32) int vals[8];
+      _mm256_store_si256(reinterpret_cast<__m256i*>(vals), _mm256_cvtps_epi32(encoded));
+      for (size_t lane = 0; lane < 8; lane++) {
+        out[i + lane] = static_cast<uint8_t>(std::clamp(vals[lane], 0, 255));
+      }
+    }
+
+    const std::string tmp_path = path + ".tmp";
+    if (!stbi_write_png(tmp_path.c_str(), config::img_width, config::img_height, 3, img.data(),
+                        config::img_width * sizeof(CharColor)) ||
+        rename(tmp_path.c_str(), path.c_str()) != 0) {
+      printf("couldn't write snapshot: %s\n", path.c_str());
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+    return true;
+  }
+} // namespace
+
+Snapshotter::Snapshotter(std::string path) : path(std::move(path)) {}
+
+Snapshotter::~Snapshotter() { wait(); }
+
+void Snapshotter::save_async(const FrameBuffers& frame, const uint32_t groups_done) {
+  // the workers sit idle until this returns
+  const trace::Span copy_span("snapshot copy");
+  wait();
+
+  snapshot.assign(frame.color, frame.color + pixel_count);
+  pending = std::async(std::launch::async, [this, groups_done]() {
+    trace::name_thread("snapshot writer");
+    const trace::Span span("snapshot write");
+    return write_snapshot(path, snapshot, groups_done);
+  });
+}
+
+bool Snapshotter::wait() {
+  if (!pending.valid()) {
+    return true;
+  }
+  return pending.get();
+}
@@ -0,0 +1,134 @@
+#include "topology.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+namespace {
+  struct CpuInfo {
+    unsigned cpu;
+    unsigned node = 0;
+    int package = -1;
+    int core = -1;
+    unsigned sibling_idx = 0; // 0 for the first logical cpu of a core
+  };
+
+  int read_int(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    int val = -1;
+    file >> val;
+    return val;
+  }
+
+  // the node a cpu belongs to shows up as a `nodeN` entry in its sysfs directory
+  unsigned read_node(const std::filesystem::path& cpu_dir) {
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(cpu_dir, ec)) {
+      const std::string name = entry.path().filename().string();
+      if (name.starts_with("node") && name.size() > 4 &&
+          std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+        return static_cast<unsigned>(std::stoul(name.substr(4)));
+      }
+    }
+    return 0;
+  }
+} // namespace
+
+Topology Topology::detect(const bool use_smt, const unsigned worker_count) {
+  Topology topo;
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  std::vector<CpuInfo> cpus;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+    for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(CpuInfo{.cpu = cpu});
+      }
+    }
+  }
+  if (cpus.empty()) {
+    const unsigned hw_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    for (unsigned cpu = 0; cpu < hw_threads; cpu++) {
+      cpus.push_back(CpuInfo{.cpu = cpu});
+    }
+  }
+
+  // group logical cpus into physical cores
+  std::map<std::pair<int, int>, unsigned> core_sizes;
+  for (CpuInfo& info : cpus) {
+    const std::filesystem::path cpu_dir =
+        "/sys/devices/system/cpu/cpu" + std::to_string(info.cpu);
+    info.package = read_int(cpu_dir / "topology/physical_package_id");
+    info.core = read_int(cpu_dir / "topology/core_id");
+    info.node = read_node(cpu_dir);
+
+    if (info.core < 0) {
+      // no topology info, treat it as its own core
+      info.package = -1;
+      info.core = static_cast<int>(info.cpu);
+    }
+    info.sibling_idx = core_sizes[{info.package, info.core}]++;
+  }
+
+  topo.cpu_count = static_cast<unsigned>(cpus.size());
+  for (const CpuInfo& info : cpus) {
+    topo.usable_cpus.push_back(info.cpu);
+  }
+  topo.core_count = static_cast<unsigned>(core_sizes.size());
+  for (const CpuInfo& info : cpus) {
+    topo.node_count = std::max(topo.node_count, info.node + 1);
+  }
+
+  if (!use_smt) {
+    std::erase_if(cpus, [](const CpuInfo& info) { return info.sibling_idx != 0; });
+  }
+
+  // first sibling of every core before any second siblings. Within that, round robin over the
+  // nodes so workers (and the bands of the image they first touch) are split evenly.
+  std::map<std::pair<unsigned, unsigned>, unsigned> node_rank; // (node, sibling) -> seen so far
+  std::vector<std::tuple<unsigned, unsigned, unsigned, unsigned>> ordered; // sort key, then cpu
+  for (const CpuInfo& info : cpus) {
+    const unsigned rank = node_rank[{info.node, info.sibling_idx}]++;
+    ordered.emplace_back(info.sibling_idx, rank, info.node, info.cpu);
+  }
+  std::sort(ordered.begin(), ordered.end());
+
+  const unsigned count = worker_count ? worker_count : static_cast<unsigned>(ordered.size());
+  for (unsigned worker = 0; worker < count; worker++) {
+    const auto& [sibling_idx, rank, node, cpu] = ordered[worker % ordered.size()];
+    topo.worker_cpus.push_back(cpu);
+    topo.worker_nodes.push_back(node);
+  }
+
+  return topo;
+}
+
+bool Topology::pin_worker(const unsigned worker) const {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(worker_cpus[worker], &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool Topology::unpin_worker() const {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const unsigned cpu : usable_cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+void Topology::print() const {
+  printf("topology: %u cpus, %u cores, %u numa nodes, %zu workers\n", cpu_count, core_count,
+         node_count, worker_cpus.size());
+}
@@ -0,0 +1,131 @@
+#include "trace.hpp"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+  struct ThreadBuffer {
+    std::unique_ptr<trace::Event[]> events =
+        std::make_unique<trace::Event[]>(config::trace_capacity);
+    // spans recorded so far, overwritten ones included. Only the owning thread stores to it.
+    std::atomic<uint64_t> written = 0;
+    unsigned tid = 0;
+    char name[32] = "";
+    // Cleared when the owning thread exits, so the next new thread takes the buffer over
+    // instead of adding another one, e.g. for the short lived checkpoint writers.
+    bool in_use = true;
+  };
+
+  // Every buffer ever handed out, in the order they were. Buffers are never freed, so the spans
+  // of threads that are gone still make it into the trace. Leaked on purpose: threads of static
+  // pools give their buffers back while statics are being destroyed.
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+  };
+  Registry& registry = *new Registry;
+
+  // spans are written relative to this, so the trace starts at 0
+  const uint64_t epoch_ns = trace::now_ns();
+
+  struct BufferOwner {
+    ThreadBuffer* buffer = nullptr;
+
+    ~BufferOwner() {
+      if (buffer != nullptr) {
+        std::lock_guard lock(registry.mutex);
+        buffer->in_use = false;
+      }
+    }
+  };
+  thread_local BufferOwner owner;
+
+  ThreadBuffer& local_buffer() {
+    if (owner.buffer != nullptr) [[likely]] {
+      return *owner.buffer;
+    }
+
+    std::lock_guard lock(registry.mutex);
+    for (const std::unique_ptr<ThreadBuffer>& buffer : registry.buffers) {
+      if (!buffer->in_use) {
+        owner.buffer = buffer.get();
+        break;
+      }
+    }
+    if (owner.buffer == nullptr) {
+      ThreadBuffer& buffer = *registry.buffers.emplace_back(std::make_unique<ThreadBuffer>());
+      buffer.tid = static_cast<unsigned>(registry.buffers.size());
+      snprintf(buffer.name, sizeof(buffer.name), "thread %u", buffer.tid);
+      owner.buffer = &buffer;
+    }
+    owner.buffer->in_use = true;
+    return *owner.buffer;
+  }
+
+  [[nodiscard]] double to_micros(const uint64_t ns) {
+    return static_cast<double>(ns) / 1000.0;
+  }
+} // namespace
+
+void trace::record(const Event& event) noexcept {
+  ThreadBuffer& buffer = local_buffer();
+  const uint64_t written = buffer.written.load(std::memory_order_relaxed);
+  buffer.events[written % config::trace_capacity] = event;
+  buffer.written.store(written + 1, std::memory_order_release);
+}
+
+void trace::set_thread_name(const char* const name, const int index) {
+  ThreadBuffer& buffer = local_buffer();
+  if (index >= 0) {
+    snprintf(buffer.name, sizeof(buffer.name), "%s %d", name, index);
+  } else {
+    snprintf(buffer.name, sizeof(buffer.name), "%s", name);
+  }
+}
+
+bool trace::write_json(const char* const path) {
+  FILE* file = fopen(path, "w");
+  if (file == nullptr) {
+    printf("couldn't open trace file: %s\n", path);
+    return false;
+  }
+
+  std::lock_guard lock(registry.mutex);
+  bool ok = fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                  "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+                  "\"args\":{\"name\":\"crack-tracer\"}}",
+                  file) >= 0;
+  for (const std::unique_ptr<ThreadBuffer>& buffer : registry.buffers) {
+    ok = ok && fprintf(file,
+                       ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+                       "\"args\":{\"name\":\"%s\"}}",
+                       buffer->tid, buffer->name) > 0;
+
+    const uint64_t end = buffer->written.load(std::memory_order_acquire);
+    const uint64_t begin = end > config::trace_capacity ? end - config::trace_capacity : 0;
+    if (begin > 0) {
+      printf("%s only kept its last %u of %lu spans\n", buffer->name, config::trace_capacity,
+             end);
+    }
+    for (uint64_t i = begin; ok && i < end; i++) {
+      const Event& event = buffer->events[i % config::trace_capacity];
+      ok = fprintf(file,
+                   ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,"
+                   "\"dur\":%.3f",
+                   event.name, buffer->tid, to_micros(event.start_ns - epoch_ns),
+                   to_micros(event.end_ns - event.start_ns)) > 0;
+      if (ok && event.arg_name != nullptr) {
+        ok = fprintf(file, ",\"args\":{\"%s\":%lu}", event.arg_name, event.arg) > 0;
+      }
+      ok = ok && fputs("}", file) >= 0;
+    }
+  }
+  ok = ok && fputs("\n]}\n", file) >= 0;
+  ok = fclose(file) == 0 && ok;
+
+  if (!ok) {
+    printf("couldn't write trace file: %s\n", path);
+  }
+  return ok;
+}
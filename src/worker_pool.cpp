@@ -0,0 +1,95 @@
+#include "worker_pool.hpp"
+#include "counters.hpp"
+#include "trace.hpp"
+
+WorkerPool::~WorkerPool() { stop(); }
+
+void WorkerPool::start(const unsigned count) {
+  stop();
+
+  stopping = false;
+  threads.reserve(count);
+  for (unsigned worker = 0; worker < count; worker++) {
+    threads.emplace_back([this, worker]() { thread_main(worker); });
+  }
+}
+
+void WorkerPool::run(const Job new_job, const void* const new_task,
+                     const Topology& new_topology, const bool new_pinned) {
+  std::unique_lock lock(mutex);
+  job = new_job;
+  task = new_task;
+  topology = &new_topology;
+  pinned = new_pinned;
+  running = size();
+  generation++;
+  job_ready.notify_all();
+
+  job_done.wait(lock, [this]() { return running == 0; });
+}
+
+void WorkerPool::thread_main(const unsigned worker) {
+  trace::name_thread("worker", static_cast<int>(worker));
+  counters::name_thread("worker", static_cast<int>(worker));
+  uint64_t seen = 0;
+  // threads start out on any cpu
+  bool thread_pinned = false;
+
+  while (true) {
+    Job curr_job;
+    const void* curr_task;
+    const Topology* curr_topology;
+    bool curr_pinned;
+    {
+      std::unique_lock lock(mutex);
+      job_ready.wait(lock, [this, seen]() { return stopping || generation != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+      curr_job = job;
+      curr_task = task;
+      curr_topology = topology;
+      curr_pinned = pinned;
+    }
+
+    if (curr_pinned != thread_pinned) {
+      thread_pinned = curr_pinned;
+      if (thread_pinned) {
+        curr_topology->pin_worker(worker);
+      } else {
+        curr_topology->unpin_worker();
+      }
+    }
+
+    {
+      const trace::Span span("job");
+      curr_job(curr_task, worker);
+    }
+
+    std::lock_guard lock(mutex);
+    if (--running == 0) {
+      job_done.notify_one();
+    }
+  }
+}
+
+void WorkerPool::stop() {
+  {
+    std::lock_guard lock(mutex);
+    stopping = true;
+    job_ready.notify_all();
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  threads.clear();
+
+  // threads started after this wait for a generation past 0, so they mustn't find the last
+  // job (whose task is long gone) still posted
+  job = nullptr;
+  task = nullptr;
+  topology = nullptr;
+  generation = 0;
+  running = 0;
+}
@@ -0,0 +1,72 @@
+#include "topology.hpp"
+#include "worker_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Every job has to run exactly once on every worker, including the first job after the pool
+// was started again, and run() must not come back before all of them are done.
+
+namespace {
+  // how many times each worker ran one job. Kept alive to the end, so a job that gets run
+  // again by mistake shows up in its counts instead of writing into a dead stack frame.
+  struct CountTask {
+    std::vector<std::atomic<unsigned>> counts;
+  };
+
+  void count_job(const void* const task, const unsigned worker) {
+    const_cast<CountTask*>(static_cast<const CountTask*>(task))->counts[worker]++;
+  }
+
+  std::vector<std::unique_ptr<CountTask>> tasks;
+
+  void run_counted(WorkerPool& pool, const Topology& topology, const unsigned workers) {
+    tasks.push_back(std::make_unique<CountTask>());
+    tasks.back()->counts = std::vector<std::atomic<unsigned>>(workers);
+    pool.run(count_job, tasks.back().get(), topology, false);
+  }
+
+  // checks every job so far ran once on each of its workers
+  bool check_counts() {
+    bool ok = true;
+    for (size_t job = 0; job < tasks.size(); job++) {
+      const std::vector<std::atomic<unsigned>>& counts = tasks[job]->counts;
+      for (size_t worker = 0; worker < counts.size(); worker++) {
+        if (counts[worker] != 1) {
+          printf("job %zu ran %u times on worker %zu\n", job, counts[worker].load(), worker);
+          ok = false;
+        }
+      }
+    }
+    return ok;
+  }
+
+  // gives freshly started threads time to (wrongly) pick up an old job before the next one
+  void settle() { std::this_thread::sleep_for(std::chrono::milliseconds(50)); }
+} // namespace
+
+int main() {
+  const Topology topology = Topology::detect(true, 4);
+  WorkerPool pool;
+
+  pool.start(4);
+  run_counted(pool, topology, 4);
+  run_counted(pool, topology, 4);
+
+  pool.start(3);
+  settle();
+  run_counted(pool, topology, 3);
+  pool.start(4);
+  settle();
+  run_counted(pool, topology, 4);
+  pool.start(4);
+  settle();
+
+  const bool ok = check_counts();
+  printf("worker pool: %s\n", ok ? "ok" : "FAILED");
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}